@@ -4,78 +4,348 @@
  * Quite appreciate "CPython Virtual Machine", from which I learnt a lot.
  *
  * Usage:
- * $ g++ svm.cpp -o svm
- * $ svm -r (-e) ./helloworld.slb (-v) (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator)
- * $ svm -d ./helloworld.slb (-p password) -- Disassembly
- * $ svm -i (-v) (-e) -- Interact Mode (-v: in verbose mode, -e: performance evaluator)
- * $ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) -- Assembly input file
+ * $ g++ svm.cpp -o svm -pthread
+ * $ svm -r (-e) (-M) (-l limits) (-P profile.json|profile.csv|-) (-S stacks.folded) (-R|-J) ./helloworld.slb (-v)
+ *   (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator, -M: memory report with leaked
+ *   arrays, -l: instructions=N,calls=N,stack=N,heap=N resource limits, a program exceeding one exits 3, -P: evaluator
+ *   with a per-opcode profile on the stack engine, also written to the file unless it is -, -S: sample the call stacks
+ *   on the stack engine into folded stacks for flamegraph.pl, -R: on the register engine, -J: register engine with the
+ *   x86-64 JIT)
+ * $ svm -r ./init.slb -W ./init.svs (-c count) (-p password) -- Run the program until its first GETCH (or for count
+ *   instructions) and save the machine, svm -r ./init.svs (options of -r) goes on from there
+ * $ svm -r ./helloworld.slb -g port|socket (-p password) -- Debug the program from a client connected to the TCP port
+ *   on 127.0.0.1 or to the Unix socket: break/clear ADDR, watch/unwatch global|local N, continue, step, pause, where,
+ *   stack, locals, globals, operands and quit, one per line
+ * $ svm -d ./helloworld.slb (-v) (-p password) -- Disassembly (-v: as linked, with superinstructions)
+ * $ svm -i (-v) (-e) (-M) -- Interact Mode (-v: in verbose mode, -e: performance evaluator, -M: memory report)
+ * $ svm -a ./helloworld.txt -o ./helloworld.slb (-v) (-j workers) (-p password) -- Assembly input file (binary .slb, older
+ *   text bytecode still runs; labels and named constants, -v: list the instructions, -j: parse big files in parallel)
+ * $ svm -b ./jobs.txt (-j workers) (-s slice) (-l limits) (-p password) -- Run a batch of programs in parallel
+ *   (-s: each worker runs its instances in turns of slice instructions instead of one after another)
+ * $ svm -B ./bench (-n runs) (-R|-J) -- Benchmark every assembly program of the directory
  *
  * @author Junru Shen
  */
 #define MAGIC "80JF34R9S "
+#define SLB_MAGIC "SLB\x1a"
+#define SLB_VERSION 1
+#define SNAPSHOT_MAGIC "SVS\x1a"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SLICE (1 << 20)
+#define DEBUG_SLICE (1 << 16)
+#define ASSEMBLY_CHUNK (1 << 20)
 #define MAX_INSTRUCTION_NUM 1000000
 #define MAX_INSTRUCTION_ADDR 2000000
+#define INITIAL_STACK_SIZE 1024
+#define MAX_STACK_SIZE (1 << 24)
+#define INITIAL_FRAME_NUM 256
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define QUICKEN_THRESHOLD 8
+#define QUICKEN_BACKOFF 256
+#define JIT_THRESHOLD 1000
+#define SAMPLE_INTERVAL_US 1000
+#define BENCH_WARMUP 2
+#define BENCH_RUNS 10
 #define MEM_DBG
 #undef MEM_DBG
-#define OP_POP() (*operands)[(*op_top_ptr)--]
-#define OP_TOP() (*operands)[*op_top_ptr]
-#define OP_PUSH(slot) (*operands)[++(*op_top_ptr)] = slot
+#define OP_POP() operands->data[operands->top--]
+#define OP_TOP() operands->data[operands->top]
+#define OP_PUSH(value)                                                  \
+    do {                                                                \
+        slot pushed_ = (value);                                         \
+        if (!VERIFIED && operands->top + 1 == operands->capacity) grow_stack(); \
+        operands->data[++operands->top] = pushed_;                      \
+    } while (0)
+// Scalars live inline in their slot, only arrays are heap allocated and reference counted
 #ifdef MEM_DBG
 #define SLOT_INCREF(slot, reason)                                       \
     do {                                                                \
-        slot->ref_cnt++;                                                \
-        std::cout << "+MD* inc slot ref count because " << reason;      \
-        std::cout << " [" << slot->ref_cnt << "]" << std::endl;         \
+        if ((slot).type != ARRAY) break;                                \
+        (slot).array_val->ref_cnt++;                                    \
+        std::cout << "+MD* inc array ref count because " << reason;     \
+        std::cout << " [" << (slot).array_val->ref_cnt << "]" << std::endl; \
     } while (0)
 #else
 #define SLOT_INCREF(slot, reason)                                       \
     do {                                                                \
-        slot->ref_cnt++;                                                \
+        if ((slot).type == ARRAY) (slot).array_val->ref_cnt++;          \
     } while (0)
 #endif
 #ifdef MEM_DBG
 #define SLOT_DECREF(slot, reason)                                       \
   do {                                                                  \
-    slot->ref_cnt--;                                                    \
-    std::cout << "-MD* Decreased slot ref count because " << reason;    \
-    std::cout << " [" << slot->ref_cnt << "]" << std::endl;             \
-    if (!slot->ref_cnt) {                                               \
-        std::cout << "xMD* Freed slot because " << reason << " v=";     \
-        std::cout << slot->as_string() << std::endl;                    \
-        RELEASE(slot);                                                  \
-        slot = nullptr;                                                 \
+    if ((slot).type != ARRAY) break;                                    \
+    (slot).array_val->ref_cnt--;                                        \
+    std::cout << "-MD* Decreased array ref count because " << reason;   \
+    std::cout << " [" << (slot).array_val->ref_cnt << "]" << std::endl; \
+    if (!(slot).array_val->ref_cnt) {                                   \
+        std::cout << "xMD* Freed array because " << reason << " v=";    \
+        std::cout << (slot).as_string() << std::endl;                   \
+        RELEASE((slot).array_val);                                      \
     }                                                                   \
   } while (0)
 #else
 #define SLOT_DECREF(slot, reason)                                       \
   do {                                                                  \
-    if (slot == nullptr) break;                                         \
-    slot->ref_cnt--;                                                    \
-    if (!slot->ref_cnt) {                                               \
-        RELEASE(slot);                                                  \
+    if ((slot).type != ARRAY) break;                                    \
+    if (!--(slot).array_val->ref_cnt) {                                 \
+        RELEASE((slot).array_val);                                      \
     }                                                                   \
   } while (0)
 #endif
 
-#define RELEASE(slot) \
+// Array elements are packed scalars (nested array is not supported), so they hold no reference
+#define RELEASE(arr) \
 do { \
-    if (slot == nullptr) break; \
-    if (slot->type == ARRAY) { \
-        for (int i = 0; i < slot->array_size; i++) { \
-            slot->array_val[i]->ref_cnt--; \
-            if (!slot->array_val[i]->ref_cnt) { \
-                if (slot->array_val[i] == nullptr) continue; \
-                delete slot->array_val[i]; \
-                slot->array_val[i] = nullptr; \
-            } \
-        } \
-    } \
-    delete slot; \
-    slot = nullptr; \
+    if (arr == nullptr) break; \
+    memory.released(arr); \
+    if (!in_snapshot(arr->elements)) array_buffers.release(arr->elements, arr->bytes()); \
+    array_pool.destroy(arr); \
+    arr = nullptr; \
 } while (0)
 
+// Counted for the evaluator and the instruction budget, which only runs out when limits were set
+#define COUNT_INSTRUCTION                                               \
+    do {                                                                \
+        if (COUNTING && ++n_ins > instruction_budget) budget_exhausted(); \
+    } while (0)
+// The stack engine also returns at the end of a time slice, ip is the last instruction run and resume() goes on after it
+#define COUNT_OR_YIELD                                                  \
+    do {                                                                \
+        if (COUNTING && ++n_ins > instruction_budget) {                 \
+            end_slice();                                                \
+            n_ins--;                                                    \
+            this->ip = ip;                                              \
+            return;                                                     \
+        }                                                               \
+    } while (0)
+
+// Threaded dispatch with labels as values where the compiler supports it, a switch otherwise
+#if defined(__GNUC__) && !defined(SVM_NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO
+#endif
+// Template JIT for the register engine, on x86-64 only
+#if defined(__x86_64__) && !defined(SVM_NO_JIT)
+#define USE_JIT
+#endif
+#ifdef USE_COMPUTED_GOTO
+#define TARGET(op) case op: TARGET_##op
+#define DISPATCH                                                        \
+    do {                                                                \
+        COUNT_OR_YIELD;                                                 \
+        ins = &instructs[++ip];                                         \
+        if (PROFILING) profile.step(ip, ins->code, (int) frames.size()); \
+        if (SAMPLING && sample_due) take_sample(ip);                    \
+        if (VERBOSE) trace(*ins);                                       \
+        goto *opcode_targets[ins->code];                                \
+    } while (0)
+#else
+#define TARGET(op) case op
 #define DISPATCH goto dispatch
+#endif
 #define FULL_DISPATCH goto full_dispatch
+// Run the current instruction again, after it has been rewritten
+#ifdef USE_COMPUTED_GOTO
+#define DISPATCH_AGAIN goto *opcode_targets[ins->code]
+#else
+#define DISPATCH_AGAIN goto dispatch_again
+#endif
+// Rewrite the current instruction into its quickened variant once its operand types were seen often enough
+#define QUICKEN(quickened)                                              \
+    do {                                                                \
+        if (++ins->counter >= QUICKEN_THRESHOLD) {                      \
+            ins->code = quickened;                                      \
+            ins->counter = 0;                                           \
+        }                                                               \
+    } while (0)
+#define DEOPTIMIZE(generic)                                             \
+    do {                                                                \
+        ins->code = generic;                                            \
+        ins->counter = -QUICKEN_BACKOFF;                                \
+        DISPATCH_AGAIN;                                                 \
+    } while (0)
+#define INT_INT (left.type == INT && right.type == INT)
+#define FLOAT_FLOAT (left.type == FLOAT && right.type == FLOAT)
+#define IS_NUMBER(slot) ((slot).type == INT || (slot).type == FLOAT)
+#define AS_FLOAT(slot) ((slot).type == INT ? (float_tp) (slot).int_val : (slot).float_val)
+#define TRACE_UNARY_OP(operand)                                         \
+    do {                                                                \
+        if (!VERBOSE) break;                                            \
+        std::cout << "Pop " << (operand).as_string() << ", calculate with unary operator " \
+                  << ins->operand << ". Result " << OP_TOP().as_string() \
+                  << " is pushed into the stack." << std::endl;         \
+    } while (0)
+#define TRACE_BINARY_OP(left, right)                                    \
+    do {                                                                \
+        if (!VERBOSE) break;                                            \
+        std::cout << "Pop " << (left).as_string() << " and " << (right).as_string() \
+                  << ", calculate with binary operator " << ins->operand << ". Result " \
+                  << OP_TOP().as_string() << " is pushed into the stack." << std::endl; \
+    } while (0)
+// The result replaces the left operand on the top of the stack
+#define NUMERIC_BINARY_OP(op, name)                                     \
+    do {                                                                \
+        slot right = OP_POP();                                          \
+        slot left = OP_TOP();                                           \
+        if (INT_INT) {                                                  \
+            OP_TOP() = slot(left.int_val op right.int_val);             \
+            QUICKEN(name##_INT_INT);                                    \
+        } else if (IS_NUMBER(left) && IS_NUMBER(right)) {               \
+            OP_TOP() = slot(AS_FLOAT(left) op AS_FLOAT(right));         \
+            if (FLOAT_FLOAT) QUICKEN(name##_FLOAT_FLOAT);               \
+        } else {                                                        \
+            panic("Unsupported binary operator");                       \
+        }                                                               \
+        TRACE_BINARY_OP(left, right);                                   \
+    } while (0)
+// Quickened variant of an operator, goes back to the generic one when the guard fails
+#define GUARDED_BINARY_OP(generic, guard, result)                       \
+    do {                                                                \
+        slot right = OP_POP();                                          \
+        slot left = OP_TOP();                                           \
+        if (!(guard)) {                                                 \
+            operands->top++;                                            \
+            DEOPTIMIZE(generic);                                        \
+        }                                                               \
+        OP_TOP() = slot(result);                                        \
+        TRACE_BINARY_OP(left, right);                                   \
+    } while (0)
+#define INTEGER_BINARY_OP(op)                                           \
+    do {                                                                \
+        slot right = OP_POP();                                          \
+        slot left = OP_TOP();                                           \
+        if (left.type != INT || right.type != INT) {                    \
+            panic("Unsupported binary operator");                       \
+        }                                                               \
+        OP_TOP() = slot((int_tp) ((unsigned int) left.int_val op (unsigned int) right.int_val)); \
+        TRACE_BINARY_OP(left, right);                                   \
+    } while (0)
+#define COMPARE_BINARY_OP(op, name)                                     \
+    do {                                                                \
+        slot right = OP_POP();                                          \
+        slot left = OP_TOP();                                           \
+        if (INT_INT) {                                                  \
+            OP_TOP() = slot(left.int_val op right.int_val);             \
+            QUICKEN(name##_INT_INT);                                    \
+        } else if (IS_NUMBER(left) && IS_NUMBER(right)) {               \
+            OP_TOP() = slot(AS_FLOAT(left) op AS_FLOAT(right));         \
+            if (FLOAT_FLOAT) QUICKEN(name##_FLOAT_FLOAT);               \
+        } else {                                                        \
+            panic("Unsupported binary operator");                       \
+        }                                                               \
+        TRACE_BINARY_OP(left, right);                                   \
+    } while (0)
+// Operands of different types are never equal
+#define EQUALITY_BINARY_OP(op, name, different)                         \
+    do {                                                                \
+        slot right = OP_POP();                                          \
+        slot left = OP_TOP();                                           \
+        if (INT_INT) {                                                  \
+            OP_TOP() = slot(left.int_val op right.int_val);             \
+            QUICKEN(name##_INT_INT);                                    \
+        } else if (left.type == FLOAT && right.type == FLOAT) {         \
+            OP_TOP() = slot(left.float_val op right.float_val);         \
+        } else if (left.type == CHAR && right.type == CHAR) {           \
+            OP_TOP() = slot(left.char_val op right.char_val);           \
+        } else {                                                        \
+            OP_TOP() = slot(different);                                 \
+        }                                                               \
+        TRACE_BINARY_OP(left, right);                                   \
+        SLOT_DECREF(left, "Bin-Op Left operand decref");                \
+        SLOT_DECREF(right, "Bin-Op Right operand decref");              \
+    } while (0)
+// Superinstructions run their first instruction alone when the operands do not suit the fused form
+#define FUSED_FALLBACK(vars)                                            \
+    do {                                                                \
+        slot var_ = (vars)[ins->operand];                               \
+        SLOT_INCREF(var_, "Fused fallback");                            \
+        OP_PUSH(var_);                                                  \
+        DISPATCH;                                                       \
+    } while (0)
+// LOAD_NAME a, LOAD_NAME b or LOAD_INT k, compare, JMP_FALSE
+#define FUSED_COMPARE_JMP_FALSE(locals_code, globals_code, op)          \
+    TARGET(locals_code):                                                \
+    TARGET(globals_code): {                                             \
+        slot *vars = ins->code == locals_code ? locals : globals;       \
+        slot left = vars[ins->operand];                                 \
+        slot right = ins[1].code == LOAD_INT ? slot((int_tp) ins[1].operand) : vars[ins[1].operand]; \
+        bool cond;                                                      \
+        if (INT_INT) {                                                  \
+            cond = left.int_val op right.int_val;                       \
+        } else if (FLOAT_FLOAT) {                                       \
+            cond = left.float_val op right.float_val;                   \
+        } else {                                                        \
+            FUSED_FALLBACK(vars);                                       \
+        }                                                               \
+        if (VERBOSE) {                                                  \
+            std::cout << "Compared " << left.as_string() << " and "     \
+                      << right.as_string() << (cond ? ", no jump." : ", jumped.") << std::endl; \
+        }                                                               \
+        ip = cond ? ip + 3 : ins[3].operand - 1;                        \
+        DISPATCH;                                                       \
+    }
+// Register engine, operands >= 0 are registers of the current frame, ~r is the absolute register r
+#define REG(x) ((x) >= 0 ? fp[x] : regs[~(x)])
+// The value is computed before the old one is released, it may be read from the overwritten register
+#define REG_SET(x, value)                                               \
+    do {                                                                \
+        slot set_ = (value);                                            \
+        slot &dst_ = REG(x);                                            \
+        SLOT_DECREF(dst_, "Register override");                         \
+        dst_ = set_;                                                    \
+    } while (0)
+#ifdef USE_COMPUTED_GOTO
+#define REG_TARGET(op) case op: REG_TARGET_##op
+#define REG_DISPATCH                                                    \
+    do {                                                                \
+        COUNT_INSTRUCTION;                                              \
+        ri = &prog[pc++];                                               \
+        goto *reg_targets[ri->code];                                    \
+    } while (0)
+#else
+#define REG_TARGET(op) case op
+#define REG_DISPATCH goto reg_dispatch
+#endif
+// Integer operands are handled inline, everything else by register_binary()
+#define REG_BINARY_OP(name, op)                                         \
+    REG_TARGET(name): {                                                 \
+        const slot &left = REG(ri->b);                                  \
+        const slot &right = REG(ri->c);                                 \
+        if (INT_INT) {                                                  \
+            REG_SET(ri->a, slot(left.int_val op right.int_val));        \
+        } else {                                                        \
+            REG_SET(ri->a, register_binary(name, left, right));         \
+        }                                                               \
+        REG_DISPATCH;                                                   \
+    }
+#define REG_COMPARE_JMP(name, compare, op)                              \
+    REG_TARGET(name): {                                                 \
+        const slot &left = REG(ri->b);                                  \
+        const slot &right = REG(ri->c);                                 \
+        bool cond;                                                      \
+        if (INT_INT) {                                                  \
+            cond = left.int_val op right.int_val;                       \
+        } else {                                                        \
+            cond = register_binary(compare, left, right).int_val != 0;  \
+        }                                                               \
+        if (!cond) REG_JUMP(ri->a);                                     \
+        REG_DISPATCH;                                                   \
+    }
+// Native code is entered at jumps, calls and returns, functions are compiled once their loops or calls are hot
+#define REG_JIT_ENTER                                                   \
+    do {                                                                \
+        if (native[function] != nullptr) pc = native[function]->run(fp, regs, pc); \
+    } while (0)
+#define REG_JUMP(target)                                                \
+    do {                                                                \
+        int from_ = pc;                                                 \
+        pc = (target);                                                  \
+        if (!JIT) break;                                                \
+        if (pc < from_ && native[function] == nullptr && ++hotness[function] == JIT_THRESHOLD) { \
+            jit_compile(function);                                      \
+        }                                                               \
+        REG_JIT_ENTER;                                                  \
+    } while (0)
 #if __WORDSIZE == 64
 typedef long int      int_tp;
 #else
@@ -93,14 +363,63 @@ typedef char char_tp;
 #include <getopt.h>
 #include <ctime>
 #include <iomanip>
+#include <vector>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <charconv>
+#include <map>
+#include <csignal>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <cmath>
+#include <string_view>
+#include <numeric>
+#include <cctype>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
-void panic(const std::string& msg) {
-    std::cout << "Runtime error: " << msg << std::endl;
-    std::cout << "Enter verbose mode to see details." << std::endl;
-    std::cout << "ABORTING..." << std::endl;
-    abort();
+// Raised by panic(), a machine that raised it can only be reset
+struct vm_error : std::runtime_error {
+    explicit vm_error(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+[[noreturn]] void panic(const std::string& msg) {
+    throw vm_error(msg);
 }
 
+// Resource limits of a machine, a program that runs out of one is terminated but the host and its other machines go on
+enum limit_kind {
+    INSTRUCTION_LIMIT,
+    CALL_DEPTH_LIMIT,
+    STACK_LIMIT,
+    HEAP_LIMIT
+};
+
+struct limit_exceeded : vm_error {
+    limit_kind limit;
+
+    limit_exceeded(limit_kind _limit, const std::string &msg) : vm_error(msg), limit(_limit) {}
+};
+
 // Instruction codes
 enum instruct_code {
     CMALLOC,
@@ -147,100 +466,401 @@ enum instruct_code {
     PRINTK,
     // Basic I/O
     PUTCH,
-    GETCH
+    GETCH,
+    // Bulk array operations
+    ARR_FILL,
+    ARR_COPY,
+    ARR_ADD,
+    ARR_MUL,
+    ARR_SUM,
+    ARR_MIN,
+    ARR_MAX,
+    ARR_DOT,
+    // Write a char array
+    PUTS,
+    // Internal instructions, only produced by the loader
+    INC_NAME,
+    DEC_NAME,
+    INC_NAME_GLOBAL,
+    DEC_NAME_GLOBAL,
+    INC_SUBSCR,
+    DEC_SUBSCR,
+    PUSH_ARGS,
+    CALL_ARGS,
+    ENTER,
+    TAIL_CALL,
+    // BINARY_OP, UNARY_OP and TYPE_CVT specialized by their operand
+    ADD,
+    SUB,
+    MUL,
+    MOD,
+    DIV,
+    AND,
+    OR,
+    SHL,
+    SHR,
+    XOR,
+    LT,
+    LE,
+    GT,
+    GE,
+    EQ,
+    NE,
+    NOT,
+    NEG,
+    CVT_INT,
+    CVT_FLOAT,
+    CVT_CHAR,
+    // Operators quickened for the operand types seen at run time, guarded by their types
+    ADD_INT_INT,
+    SUB_INT_INT,
+    MUL_INT_INT,
+    DIV_INT_INT,
+    MOD_INT_INT,
+    LT_INT_INT,
+    LE_INT_INT,
+    GT_INT_INT,
+    GE_INT_INT,
+    EQ_INT_INT,
+    NE_INT_INT,
+    ADD_FLOAT_FLOAT,
+    SUB_FLOAT_FLOAT,
+    MUL_FLOAT_FLOAT,
+    DIV_FLOAT_FLOAT,
+    LT_FLOAT_FLOAT,
+    LE_FLOAT_FLOAT,
+    GT_FLOAT_FLOAT,
+    GE_FLOAT_FLOAT,
+    // Superinstructions, fused by link() from the sequence they start
+    ADD_LOCAL_IMM,
+    SUB_LOCAL_IMM,
+    ADD_GLOBAL_IMM,
+    SUB_GLOBAL_IMM,
+    CMP_LT_JMP_FALSE_LOCALS,
+    CMP_LE_JMP_FALSE_LOCALS,
+    CMP_GT_JMP_FALSE_LOCALS,
+    CMP_GE_JMP_FALSE_LOCALS,
+    CMP_LT_JMP_FALSE_GLOBALS,
+    CMP_LE_JMP_FALSE_GLOBALS,
+    CMP_GT_JMP_FALSE_GLOBALS,
+    CMP_GE_JMP_FALSE_GLOBALS,
+    LOAD_ELEM_LOCAL,
+    LOAD_ELEM_GLOBAL,
+    // Patched by the debugger over the instruction it stops at, never loaded
+    BREAK,
+    // Number of instruction codes, not an instruction
+    INSTRUCT_CODE_NUM
 };
 
+// Codes after this one are internal and never appear in bytecode files
+const instruct_code LAST_PUBLIC_CODE = PUTS;
+
 // Basic data types
 enum basic_data_types {
     INT = 0,
     FLOAT,
     CHAR,
     VOID,
-    ARRAY
+    ARRAY,
+    UNUSED // Never a value, marks stack entries not written yet
 };
 
-// Slot
+struct array;
+
+// Slot, a tagged value stored inline in operand stacks, locals, globals and constants
 struct slot {
     basic_data_types type = VOID;
-    int_tp int_val{};
-    float_tp float_val{};
-    char_tp char_val{};
-    slot **array_val{};
-    int array_size{};
-    int ref_cnt = 1;
+    union {
+        int_tp int_val = 0;
+        float_tp float_val;
+        char_tp char_val;
+        array *array_val;
+    };
+
+    explicit slot(int_tp _int_val) : type(INT), int_val(_int_val) {}
+
+    explicit slot(bool bool_val) : type(INT), int_val(bool_val ? 1 : 0) {}
+
+    explicit slot(float_tp _float_val) : type(FLOAT), float_val(_float_val) {}
+
+    explicit slot(char_tp _char_val) : type(CHAR) {
+        char_val = _char_val;
+    }
+
+    explicit slot(array *_array_val) : type(ARRAY), array_val(_array_val) {}
+
+    slot() = default;
 
-    explicit slot(int_tp _int_val) : int_val(_int_val), type(INT) {}
+    // Only a non-zero int is true, and only a char is printed as itself, as when every type kept a field of its own
+    bool truth() const {
+        return type == INT && int_val != 0;
+    }
 
-    explicit slot(bool bool_val) : int_val(bool_val ? 1 : 0), type(INT) {}
+    char_tp put_char() const {
+        return type == CHAR ? char_val : 0;
+    }
 
-    explicit slot(float_tp _float_val) : float_val(_float_val), type(FLOAT) {}
+    std::string as_string() const;
 
-    explicit slot(char_tp _char_val) : char_val(_char_val), type(CHAR) {}
+    int format(char *text) const;
+};
 
-    slot(int _array_size, basic_data_types _type) {
-        if (_type == ARRAY || _type == VOID) {
+// Scalar value converted to an element type of packed arrays
+template<typename T>
+T scalar_as(const slot &val) {
+    switch (val.type) {
+        case INT:
+            return (T) val.int_val;
+        case FLOAT:
+            return (T) val.float_val;
+        case CHAR:
+            return (T) val.char_val;
+        default:
             // do not support nested array
-            return;
-        }
-        type = ARRAY;
-        array_size = _array_size;
-        array_val = new slot *[array_size];
-        for (int i = 0; i < array_size; i++) {
-            slot *fill_slot = nullptr;
-            switch (_type) {
-                case INT:
-                    fill_slot = new slot((int_tp) 0);
-                    break;
-                case FLOAT:
-                    fill_slot = new slot((float_tp) 0.0);
-                    break;
-                case CHAR:
-                    fill_slot = new slot((char) '\0');
-                    break;
-                default:
-                    panic("Unsupported type here");
-                    break;
-            }
-            *(array_val + i) = fill_slot;
-            SLOT_INCREF(fill_slot, "array initialize");
-        }
+            panic("Unsupported array element type");
     }
+}
 
-    slot() = default;
+// Array, the only heap allocated (and reference counted) value, its elements are packed by their type
+struct array {
+    void *elements{};
+    int array_size{};
+    basic_data_types element_type;
+    int ref_cnt = 1;
 
-    std::string as_string() {
-        std::stringstream res;
-        std::string ret;
+    static size_t element_size(basic_data_types type) {
         switch (type) {
             case INT:
-                res << int_val << "(int)";
-                break;
+                return sizeof(int_tp);
             case FLOAT:
-                res << float_val << "(float)";
-                break;
+                return sizeof(float_tp);
             case CHAR:
-                res << char_val << "(char)";
+                return sizeof(char_tp);
+            default:
+                // do not support nested array
+                panic("Unsupported array element type");
+        }
+    }
+
+    // Elements restored from a snapshot already hold their values
+    array(void *_elements, int _array_size, basic_data_types _type, bool zeroed = true)
+            : elements(_elements), array_size(_array_size), element_type(_type) {
+        if (zeroed && array_size) memset(elements, 0, element_size(element_type) * array_size);
+    }
+
+    int_tp *ints() const {
+        return static_cast<int_tp *>(elements);
+    }
+
+    float_tp *floats() const {
+        return static_cast<float_tp *>(elements);
+    }
+
+    char_tp *chars() const {
+        return static_cast<char_tp *>(elements);
+    }
+
+    size_t bytes() const {
+        return element_size(element_type) * array_size;
+    }
+
+    slot get(int i) const {
+        switch (element_type) {
+            case INT:
+                return slot(ints()[i]);
+            case FLOAT:
+                return slot(floats()[i]);
+            default:
+                return slot(chars()[i]);
+        }
+    }
+
+    // Stored values are converted to the element type
+    void set(int i, const slot &val) {
+        switch (element_type) {
+            case INT:
+                ints()[i] = scalar_as<int_tp>(val);
                 break;
-            case ARRAY:
-                res << "array[" << array_size << "]";
+            case FLOAT:
+                floats()[i] = scalar_as<float_tp>(val);
                 break;
-            case VOID:
-                res << "(null)";
+            default:
+                chars()[i] = scalar_as<char_tp>(val);
                 break;
         }
-        res >> ret;
-        return ret;
     }
 };
 
-typedef slot *T_OPSTACK[2000];
-typedef slot **T_VARIABLES;
+// Longest text of format()
+#define SLOT_TEXT_SIZE 32
+
+// Writes the text PRINTK shows to text, which has room for SLOT_TEXT_SIZE chars, and returns its length
+int slot::format(char *text) const {
+    char *end = text;
+    auto append = [&end](const char *suffix) {
+        size_t n = strlen(suffix);
+        memcpy(end, suffix, n);
+        end += n;
+    };
+    switch (type) {
+        case INT:
+            end = std::to_chars(end, text + SLOT_TEXT_SIZE, int_val).ptr;
+            append("(int)");
+            break;
+        case FLOAT:
+            // the default format of streams
+            end += snprintf(end, SLOT_TEXT_SIZE, "%g", float_val);
+            append("(float)");
+            break;
+        case CHAR:
+            // white space was dropped when this text was read back from a stream
+            if (!isspace((unsigned char) char_val)) *end++ = char_val;
+            append("(char)");
+            break;
+        case ARRAY:
+            append("array[");
+            end = std::to_chars(end, text + SLOT_TEXT_SIZE, array_val->array_size).ptr;
+            append("]");
+            break;
+        case VOID:
+        case UNUSED:
+            // an entry not written yet is never printed as a value, it reads as empty if it is
+            append("(null)");
+            break;
+    }
+    return (int) (end - text);
+}
+
+std::string slot::as_string() const {
+    char text[SLOT_TEXT_SIZE];
+    return std::string(text, format(text));
+}
+
+// Output of PRINTK, PUTCH and PUTS, passed on to the stream when full, before GETCH and when the machine stops
+class output_buffer {
+private:
+    std::ostream *sink;
+    std::vector<char> data;
+    int size = 0;
+    bool line_mode = false; // Every completed line is flushed, for terminals
+
+public:
+    explicit output_buffer(std::ostream *_sink) : sink(_sink), data(OUTPUT_BUFFER_SIZE) {}
+
+    void redirect(std::ostream *_sink) {
+        flush();
+        sink = _sink;
+    }
+
+    void set_line_mode(bool on) {
+        line_mode = on;
+    }
+
+    void put(char c) {
+        if (size == OUTPUT_BUFFER_SIZE) drain();
+        data[size++] = c;
+        if (line_mode && c == '\n') flush();
+    }
+
+    void write(const char *text, int n) {
+        if (size + n > OUTPUT_BUFFER_SIZE) drain();
+        if (n > OUTPUT_BUFFER_SIZE) {
+            sink->write(text, n);
+        } else {
+            memcpy(data.data() + size, text, n);
+            size += n;
+        }
+        if (line_mode && memchr(text, '\n', n) != nullptr) flush();
+    }
+
+    // A line of PRINTK
+    void print(const slot &val) {
+        if (size + SLOT_TEXT_SIZE + 1 > OUTPUT_BUFFER_SIZE) drain();
+        size += val.format(data.data() + size);
+        data[size++] = '\n';
+        if (line_mode) flush();
+    }
+
+    // Pass the buffered output to the stream without flushing it
+    void drain() {
+        if (size) sink->write(data.data(), size);
+        size = 0;
+    }
+
+    void flush() {
+        drain();
+        sink->flush();
+    }
+};
+
+// Growable stack of slots, entries above the top are painted UNUSED until first written, for the high-water mark
+struct slot_stack {
+    slot *data{};
+    int top = -1;
+    int capacity = 0;
+    int limit = MAX_STACK_SIZE;
+
+    explicit slot_stack(int initial_capacity) {
+        data = static_cast<slot *>(::operator new(sizeof(slot) * initial_capacity));
+        capacity = initial_capacity;
+        paint(0);
+    }
+
+    slot_stack(const slot_stack &) = delete;
+
+    slot_stack &operator=(const slot_stack &) = delete;
+
+    ~slot_stack() {
+        ::operator delete(data);
+    }
+
+    // No more than n entries, the capacity is cut down so the next push beyond it reaches reserve()
+    void set_limit(int n) {
+        limit = std::max(std::min(n, MAX_STACK_SIZE), top + 1);
+        if (capacity > limit) capacity = limit;
+    }
+
+    // Make room for at least n more entries, slots are moved so pointers into the stack are invalidated
+    void reserve(int n) {
+        if (top + 1 + n <= capacity) return;
+        if ((long long) top + 1 + n > limit) {
+            if (limit == MAX_STACK_SIZE) panic("Stack overflow");
+            throw limit_exceeded(STACK_LIMIT, "Stack limit of " + std::to_string(limit) + " slots exceeded");
+        }
+        int fresh_capacity = capacity;
+        while (fresh_capacity < top + 1 + n) fresh_capacity *= 2;
+        if (fresh_capacity > limit) fresh_capacity = limit;
+        auto *fresh = static_cast<slot *>(::operator new(sizeof(slot) * fresh_capacity));
+        // entries above the top are kept too, they tell how deep the stack has been
+        std::copy(data, data + capacity, fresh);
+        ::operator delete(data);
+        data = fresh;
+        int painted = capacity;
+        capacity = fresh_capacity;
+        paint(painted);
+    }
+
+    // Entries ever written, found by scanning down to the last one not UNUSED
+    int high_water() const {
+        int n = capacity;
+        while (n > 0 && data[n - 1].type == UNUSED) n--;
+        return n;
+    }
+
+private:
+    void paint(int from) {
+        for (int i = from; i < capacity; i++) data[i].type = UNUSED;
+    }
+};
+
+typedef slot *T_VARIABLES;
 
 // Instruction = Code + no more than 1 operand
 struct instruct {
     instruct_code code = NOOP;
     int operand{};
     int address = -1;
+    int counter{}; // Executions seen by quickening
 
     instruct(int _addr, instruct_code _code, int _operand) : address(_addr), code(_code), operand(_operand) {}
 
@@ -249,425 +869,3874 @@ struct instruct {
     instruct() = default;
 };
 
-// Stack frame
+// Stack frame, a window of the VM stack: locals first, operands after them. Frames are kept in call order.
 struct frame {
-    T_VARIABLES locals{};
+    int base;
     int var_cnt = 0;
     int return_ip{};
-    T_OPSTACK local_operands{};
-    int op_top = -1;
-    frame *caller;
+    int function = -1; // Entry of the called function, for the sampling profiler
 
-    explicit frame(frame *_caller) : caller(_caller) {}
+    explicit frame(int _base) : base(_base) {}
 };
 
-instruct instructs[MAX_INSTRUCTION_NUM]; // Instructions
-int addrs[MAX_INSTRUCTION_ADDR + 1];
-slot **constants;
-T_VARIABLES globals;
-int var_cnt = 0;
-int constant_cnt = 0;
-T_OPSTACK global_operands;
-
-// Virtual Machine
-class Machine {
-private:
-    int ins_cnt{};
-    frame *esp{};
-    int op_top;
-    int ip{};
-    bool verbose = false;
-    bool evaluator = false;
-    long long int n_ins = 0;
-    T_OPSTACK *operands{};
-    int *op_top_ptr{};
-
-public:
-    static std::unordered_map<std::string, instruct_code> string_inscode_mapping;
-    static int inscode_param_cnt_mapping[200];
+// Memory used by a machine: arrays are counted where they are built and released, frames where they are pushed
+struct memory_stats {
+    static const int SIZE_BUCKETS = 33; // Empty arrays, then sizes in [2^(i-1), 2^i)
+    long long arrays = 0;
+    long long array_bytes = 0; // Elements and headers of the live arrays
+    long long peak_arrays = 0;
+    long long peak_array_bytes = 0;
+    long long built = 0;
+    long long built_by_type[VOID]{};
+    long long live_by_type[VOID]{};
+    long long peak_by_type[VOID]{};
+    long long sizes[SIZE_BUCKETS]{};
+    long long peak_frames = 0;
+    long long peak_frame_bytes = 0;
+    int peak_globals = 0;
+    long long leaked_arrays = 0; // Still live after reset() released every slot
+    long long leaked_bytes = 0;
 
-    static void load_name_code_mapping() {
-        string_inscode_mapping["CMALLOC"] = CMALLOC;
-        string_inscode_mapping["VMALLOC"] = VMALLOC;
-        string_inscode_mapping["CONSTANT"] = CONSTANT;
-        string_inscode_mapping["LOAD_CONSTANT"] = LOAD_CONSTANT;
-        string_inscode_mapping["POP_OP"] = POP_OP;
-        string_inscode_mapping["NOOP"] = NOOP;
-        string_inscode_mapping["LOAD_NULL"] = LOAD_NULL;
-        string_inscode_mapping["LOAD_NAME"] = LOAD_NAME;
-        string_inscode_mapping["LOAD_NAME_GLOBAL"] = LOAD_NAME_GLOBAL;
-        string_inscode_mapping["LOAD_INT"] = LOAD_INT;
-        string_inscode_mapping["LOAD_FLOAT"] = LOAD_FLOAT;
-        string_inscode_mapping["LOAD_CHAR"] = LOAD_CHAR;
-        string_inscode_mapping["STORE_NAME"] = STORE_NAME;
-        string_inscode_mapping["STORE_NAME_GLOBAL"] = STORE_NAME_GLOBAL;
-        string_inscode_mapping["STORE_NAME_NOPOP"] = STORE_NAME_NOPOP;
-        string_inscode_mapping["STORE_NAME_GLOBAL_NOPOP"] = STORE_NAME_GLOBAL_NOPOP;
-        string_inscode_mapping["JMP"] = JMP;
-        string_inscode_mapping["JMP_TRUE"] = JMP_TRUE;
-        string_inscode_mapping["JMP_FALSE"] = JMP_FALSE;
-        string_inscode_mapping["BINARY_OP"] = BINARY_OP;
-        string_inscode_mapping["UNARY_OP"] = UNARY_OP;
-        string_inscode_mapping["HALT"] = HALT;
-        string_inscode_mapping["RET"] = RET;
-        string_inscode_mapping["PUSH"] = PUSH;
-        string_inscode_mapping["CALL"] = CALL;
-        string_inscode_mapping["LOAD_GLOBAL"] = LOAD_GLOBAL;
-        string_inscode_mapping["STORE_GLOBAL"] = STORE_GLOBAL;
-        string_inscode_mapping["BUILD_ARR"] = BUILD_ARR;
-        string_inscode_mapping["TYPE_CVT"] = TYPE_CVT;
-        string_inscode_mapping["BINARY_SUBSCR"] = BINARY_SUBSCR;
-        string_inscode_mapping["STORE_SUBSCR"] = STORE_SUBSCR;
-        string_inscode_mapping["STORE_SUBSCR_INPLACE"] = STORE_SUBSCR_INPLACE;
-        string_inscode_mapping["STORE_SUBSCR_NOPOP"] = STORE_SUBSCR_NOPOP;
-        string_inscode_mapping["PRINTK"] = PRINTK;
-        string_inscode_mapping["PUTCH"] = PUTCH;
-        string_inscode_mapping["GETCH"] = GETCH;
-        string_inscode_mapping["SIZE_OF"] = SIZE_OF;
+    static long long footprint(const array *arr) {
+        return (long long) (sizeof(array) + arr->bytes());
     }
 
-    static void load_param_mapping() {
-        inscode_param_cnt_mapping[VMALLOC] = 1;
-        inscode_param_cnt_mapping[CMALLOC] = 1;
-        inscode_param_cnt_mapping[POP_OP] = 0;
-        inscode_param_cnt_mapping[NOOP] = 0;
-        inscode_param_cnt_mapping[LOAD_NULL] = 0;
-        inscode_param_cnt_mapping[LOAD_CONSTANT] = 1;
-        inscode_param_cnt_mapping[LOAD_NAME] = 1;
-        inscode_param_cnt_mapping[LOAD_NAME_GLOBAL] = 1;
-        inscode_param_cnt_mapping[LOAD_INT] = 1;
-        inscode_param_cnt_mapping[LOAD_FLOAT] = 1;
-        inscode_param_cnt_mapping[LOAD_CHAR] = 1;
-        inscode_param_cnt_mapping[STORE_NAME] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_NOPOP] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_GLOBAL] = 1;
-        inscode_param_cnt_mapping[STORE_NAME_GLOBAL_NOPOP] = 1;
-        inscode_param_cnt_mapping[JMP] = 1;
-        inscode_param_cnt_mapping[JMP_TRUE] = 1;
-        inscode_param_cnt_mapping[JMP_FALSE] = 1;
-        inscode_param_cnt_mapping[BINARY_OP] = 1;
-        inscode_param_cnt_mapping[UNARY_OP] = 1;
-        inscode_param_cnt_mapping[HALT] = 0;
-        inscode_param_cnt_mapping[RET] = 0;
-        inscode_param_cnt_mapping[PUSH] = 0;
-        inscode_param_cnt_mapping[CALL] = 1;
-        inscode_param_cnt_mapping[LOAD_GLOBAL] = 0;
-        inscode_param_cnt_mapping[STORE_GLOBAL] = 0;
-        inscode_param_cnt_mapping[BUILD_ARR] = 1;
-        inscode_param_cnt_mapping[TYPE_CVT] = 1;
-        inscode_param_cnt_mapping[BINARY_SUBSCR] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR_INPLACE] = 0;
-        inscode_param_cnt_mapping[STORE_SUBSCR_NOPOP] = 0;
-        inscode_param_cnt_mapping[PRINTK] = 0;
-        inscode_param_cnt_mapping[PUTCH] = 0;
-        inscode_param_cnt_mapping[GETCH] = 0;
-        inscode_param_cnt_mapping[SIZE_OF] = 0;
-        // only used for assemble/disassemble
-        inscode_param_cnt_mapping[CONSTANT] = 3;
+    static int size_bucket(int size) {
+        int bucket = 0;
+        while (size) {
+            size >>= 1;
+            bucket++;
+        }
+        return bucket;
     }
 
-    Machine() {
-        op_top = -1;
-        reset();
+    void array_built(const array *arr) {
+        arrays++;
+        array_bytes += footprint(arr);
+        built++;
+        built_by_type[arr->element_type]++;
+        if (++live_by_type[arr->element_type] > peak_by_type[arr->element_type]) {
+            peak_by_type[arr->element_type] = live_by_type[arr->element_type];
+        }
+        sizes[size_bucket(arr->array_size)]++;
+        if (arrays > peak_arrays) peak_arrays = arrays;
+        if (array_bytes > peak_array_bytes) peak_array_bytes = array_bytes;
     }
 
-    ~Machine() {
-        reset();
+    void released(const array *arr) {
+        arrays--;
+        array_bytes -= footprint(arr);
+        live_by_type[arr->element_type]--;
     }
 
-    void enable_verbose() {
-        verbose = true;
+    void frame_pushed(size_t depth, size_t frame_bytes) {
+        if ((long long) depth <= peak_frames) return;
+        peak_frames = (long long) depth;
+        peak_frame_bytes = (long long) (depth * frame_bytes);
+    }
+};
+
+// Where Machine::resume() stopped
+enum dispatch_status {
+    HALTED,
+    YIELDED, // The time slice is over
+    WAITING_INPUT, // GETCH would block, the input has no char ready and was not closed
+    BREAKPOINT // A BREAK patched in by the debugger is the next instruction
+};
+
+// Limits set by the host, 0 is unlimited
+struct resource_limits {
+    long long instructions = 0; // Counted like the evaluator does, so native code of the JIT is not used
+    int call_depth = 0; // Frames of the running calls
+    int stack_slots = 0; // Of each operand stack, the frame stack holds the locals and operands of all calls
+    long long heap_bytes = 0; // Live arrays, elements and headers
+};
+
+// Free-list allocator for objects of one type, memory is carved from slabs and kept until the pool dies
+template<typename T, int SLAB_OBJECTS>
+class object_pool {
+private:
+    union node {
+        node *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    std::vector<node *> slabs;
+    node *free_list = nullptr;
+
+    void grow() {
+        node *slab = static_cast<node *>(::operator new(sizeof(node) * SLAB_OBJECTS));
+        slabs.push_back(slab);
+        for (int i = 0; i < SLAB_OBJECTS; i++) {
+            slab[i].next = free_list;
+            free_list = slab + i;
+        }
+    }
+
+public:
+    object_pool() = default;
+
+    object_pool(const object_pool &) = delete;
+
+    object_pool &operator=(const object_pool &) = delete;
+
+    ~object_pool() {
+        for (node *slab : slabs) ::operator delete(slab);
+    }
+
+    template<typename... Args>
+    T *create(Args &&... args) {
+        if (free_list == nullptr) grow();
+        node *n = free_list;
+        free_list = n->next;
+        return new(n->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *object) {
+        object->~T();
+        node *n = reinterpret_cast<node *>(object);
+        n->next = free_list;
+        free_list = n;
+    }
+};
+
+// Allocator of array element buffers, small buffers are recycled by power-of-two size classes
+class buffer_allocator {
+private:
+    static const int MIN_CLASS = 4;
+    static const int MAX_CLASS = 16;
+    struct free_buffer {
+        free_buffer *next;
+    };
+    free_buffer *free_lists[MAX_CLASS + 1]{};
+
+    static int size_class(size_t bytes) {
+        int c = MIN_CLASS;
+        while (((size_t) 1 << c) < bytes) c++;
+        return c;
+    }
+
+public:
+    buffer_allocator() = default;
+
+    buffer_allocator(const buffer_allocator &) = delete;
+
+    buffer_allocator &operator=(const buffer_allocator &) = delete;
+
+    ~buffer_allocator() {
+        for (free_buffer *list : free_lists) {
+            while (list != nullptr) {
+                free_buffer *next = list->next;
+                ::operator delete(list);
+                list = next;
+            }
+        }
+    }
+
+    // The buffer is uninitialized
+    void *allocate(size_t bytes) {
+        if (bytes == 0) return nullptr;
+        int c = size_class(bytes);
+        if (c > MAX_CLASS) return ::operator new(bytes);
+        if (free_lists[c] != nullptr) {
+            free_buffer *buffer = free_lists[c];
+            free_lists[c] = buffer->next;
+            return buffer;
+        }
+        return ::operator new((size_t) 1 << c);
+    }
+
+    void release(void *buffer, size_t bytes) {
+        if (buffer == nullptr) return;
+        int c = size_class(bytes);
+        if (c > MAX_CLASS) {
+            ::operator delete(buffer);
+            return;
+        }
+        auto *node = static_cast<free_buffer *>(buffer);
+        node->next = free_lists[c];
+        free_lists[c] = node;
+    }
+};
+
+
+// Bulk array kernels, written once with vector extensions and built for every ISA in array_kernel_sets
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+struct add_op {
+    template<typename T>
+    static ALWAYS_INLINE void apply(T &a, const T &b) { a = a + b; }
+};
+
+struct mul_op {
+    template<typename T>
+    static ALWAYS_INLINE void apply(T &a, const T &b) { a = a * b; }
+};
+
+struct min_op {
+    template<typename T>
+    static ALWAYS_INLINE void apply(T &a, const T &b) { a = a < b ? a : b; }
+};
+
+struct max_op {
+    template<typename T>
+    static ALWAYS_INLINE void apply(T &a, const T &b) { a = a > b ? a : b; }
+};
+
+// Unaligned loads, vectors are not passed by value so that the baseline ABI does not depend on the ISA
+template<typename V, typename T>
+ALWAYS_INLINE void load_vector(V &v, const T *p) {
+    memcpy(&v, p, sizeof(V));
+}
+
+template<typename T, typename V, typename Op>
+ALWAYS_INLINE void zip_kernel(T *dst, const T *a, const T *b, int n) {
+    const int w = sizeof(V) / sizeof(T);
+    int i = 0;
+    for (; i + w <= n; i += w) {
+        V x, y;
+        load_vector(x, a + i);
+        load_vector(y, b + i);
+        Op::apply(x, y);
+        memcpy(dst + i, &x, sizeof(V));
+    }
+    for (; i < n; i++) {
+        T x = a[i];
+        Op::apply(x, b[i]);
+        dst[i] = x;
+    }
+}
+
+// Lanes are combined at the end, so float sums may round differently from a sequential loop
+template<typename T, typename V, typename Op>
+ALWAYS_INLINE T reduce_kernel(const T *a, int n, T init) {
+    const int w = sizeof(V) / sizeof(T);
+    V acc = V{} + init;
+    int i = 0;
+    for (; i + w <= n; i += w) {
+        V x;
+        load_vector(x, a + i);
+        Op::apply(acc, x);
+    }
+    T res = init;
+    for (int k = 0; k < w; k++) Op::apply(res, (T) acc[k]);
+    for (; i < n; i++) Op::apply(res, a[i]);
+    return res;
+}
+
+template<typename T, typename V>
+ALWAYS_INLINE T dot_kernel(const T *a, const T *b, int n) {
+    const int w = sizeof(V) / sizeof(T);
+    V acc = V{};
+    int i = 0;
+    for (; i + w <= n; i += w) {
+        V x, y;
+        load_vector(x, a + i);
+        load_vector(y, b + i);
+        acc += x * y;
+    }
+    T res = 0;
+    for (int k = 0; k < w; k++) res += acc[k];
+    for (; i < n; i++) res += a[i] * b[i];
+    return res;
+}
+
+struct array_kernels {
+    const char *isa;
+    void (*add_int)(int_tp *, const int_tp *, const int_tp *, int);
+    void (*add_float)(float_tp *, const float_tp *, const float_tp *, int);
+    void (*mul_int)(int_tp *, const int_tp *, const int_tp *, int);
+    void (*mul_float)(float_tp *, const float_tp *, const float_tp *, int);
+    int_tp (*sum_int)(const int_tp *, int);
+    float_tp (*sum_float)(const float_tp *, int);
+    int_tp (*min_int)(const int_tp *, int);
+    float_tp (*min_float)(const float_tp *, int);
+    int_tp (*max_int)(const int_tp *, int);
+    float_tp (*max_float)(const float_tp *, int);
+    int_tp (*dot_int)(const int_tp *, const int_tp *, int);
+    float_tp (*dot_float)(const float_tp *, const float_tp *, int);
+};
+
+// Min and max need at least one element
+#define ARRAY_KERNEL_SET(set, isa_name, attr, bytes)                    \
+namespace set {                                                         \
+typedef int_tp int_vec __attribute__((vector_size(bytes)));            \
+typedef float_tp float_vec __attribute__((vector_size(bytes)));        \
+attr void add_int(int_tp *d, const int_tp *a, const int_tp *b, int n) { zip_kernel<int_tp, int_vec, add_op>(d, a, b, n); } \
+attr void add_float(float_tp *d, const float_tp *a, const float_tp *b, int n) { zip_kernel<float_tp, float_vec, add_op>(d, a, b, n); } \
+attr void mul_int(int_tp *d, const int_tp *a, const int_tp *b, int n) { zip_kernel<int_tp, int_vec, mul_op>(d, a, b, n); } \
+attr void mul_float(float_tp *d, const float_tp *a, const float_tp *b, int n) { zip_kernel<float_tp, float_vec, mul_op>(d, a, b, n); } \
+attr int_tp sum_int(const int_tp *a, int n) { return reduce_kernel<int_tp, int_vec, add_op>(a, n, 0); } \
+attr float_tp sum_float(const float_tp *a, int n) { return reduce_kernel<float_tp, float_vec, add_op>(a, n, 0); } \
+attr int_tp min_int(const int_tp *a, int n) { return reduce_kernel<int_tp, int_vec, min_op>(a, n, a[0]); } \
+attr float_tp min_float(const float_tp *a, int n) { return reduce_kernel<float_tp, float_vec, min_op>(a, n, a[0]); } \
+attr int_tp max_int(const int_tp *a, int n) { return reduce_kernel<int_tp, int_vec, max_op>(a, n, a[0]); } \
+attr float_tp max_float(const float_tp *a, int n) { return reduce_kernel<float_tp, float_vec, max_op>(a, n, a[0]); } \
+attr int_tp dot_int(const int_tp *a, const int_tp *b, int n) { return dot_kernel<int_tp, int_vec>(a, b, n); } \
+attr float_tp dot_float(const float_tp *a, const float_tp *b, int n) { return dot_kernel<float_tp, float_vec>(a, b, n); } \
+const array_kernels kernels = {isa_name, add_int, add_float, mul_int, mul_float, sum_int, sum_float, \
+                               min_int, min_float, max_int, max_float, dot_int, dot_float}; \
+}
+
+// 16 byte vectors are SSE2 on x86-64 and NEON on AArch64, AVX2 is only used when the CPU has it
+#if defined(__x86_64__)
+ARRAY_KERNEL_SET(baseline_kernels, "sse2", , 16)
+ARRAY_KERNEL_SET(avx2_kernels, "avx2", __attribute__((target("avx2"))), 32)
+#elif defined(__aarch64__)
+ARRAY_KERNEL_SET(baseline_kernels, "neon", , 16)
+#else
+ARRAY_KERNEL_SET(baseline_kernels, "scalar", , 16)
+#endif
+
+const array_kernels &select_array_kernels() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return avx2_kernels::kernels;
+#endif
+    return baseline_kernels::kernels;
+}
+
+const array_kernels &bulk = select_array_kernels();
+
+// Program, a code object owning its instructions
+class Program {
+public:
+    std::vector<instruct> instructs;
+    std::vector<int> addrs; // Instruction address -> instruction index, -1 if none
+    std::vector<slot> constants; // Constants are always scalars
+    bool linked = false;
+    // Found by verify() when the program is linked
+    bool verified = false;
+    std::string unverified = "the program is not linked"; // Why the stack engine keeps its stack checks
+    std::string malformed; // Why the program cannot run, empty if it can
+    std::vector<int> frame_slots; // Function entry -> slots its frame needs at most, when verified
+
+    static bool is_jump(instruct_code code) {
+        return code == JMP || code == JMP_TRUE || code == JMP_FALSE || code == CALL;
+    }
+
+    int size() const {
+        return (int) instructs.size();
+    }
+
+    // Resolve patterns spanning several instructions, once all instructions are loaded
+    void link() {
+        if (linked) return;
+        linked = true;
+        // jumps go to instruction indices, so that addrs is not needed at runtime
+        for (instruct &ins : instructs) {
+            if (!is_jump(ins.code)) continue;
+            int addr = ins.operand;
+            if (addr < 0 || addr >= (int) addrs.size() || addrs[addr] < 0) panic("Undefined jump address");
+            ins.operand = addrs[addr];
+        }
+        bind_increments();
+        optimize();
+        int ins_cnt = size();
+        // a jump past the last instruction goes to the HALT added at the end
+        std::vector<bool> jump_target(ins_cnt + 1, false);
+        for (const instruct &ins : instructs) {
+            if (is_jump(ins.code)) jump_target[ins.operand] = true;
+        }
+        /*
+         * In a function, STORE_GLOBAL * k, PUSH, LOAD_GLOBAL * k moves the top k operands to the new frame in the
+         * same order, so the new frame can be started right under them instead.
+         */
+        for (int i = 0; i < ins_cnt; i++) {
+            if (instructs[i].code != STORE_GLOBAL && instructs[i].code != PUSH) continue;
+            int k = 0;
+            while (i + k < ins_cnt && instructs[i + k].code == STORE_GLOBAL) k++;
+            if (i + 2 * k >= ins_cnt || instructs[i + k].code != PUSH) continue;
+            bool matched = true;
+            for (int j = 1; j <= 2 * k && matched; j++) {
+                matched = !jump_target[i + j] && (j <= k || instructs[i + j].code == LOAD_GLOBAL);
+            }
+            if (!matched) continue;
+            // the call right after the arguments is taken in the same dispatch, a call returned at once reuses the frame
+            bool call = i + 2 * k + 1 < ins_cnt && instructs[i + 2 * k + 1].code == CALL;
+            bool tail = call && i + 2 * k + 2 < ins_cnt && instructs[i + 2 * k + 2].code == RET;
+            instructs[i].code = tail ? TAIL_CALL : call ? CALL_ARGS : PUSH_ARGS;
+            instructs[i].operand = k;
+            i += 2 * k;
+        }
+        /*
+         * A function starting with VMALLOC n, STORE_NAME k - 1, ..., STORE_NAME 0 stores its k arguments to the first
+         * locals, where the arguments already are when the frame was started under them.
+         */
+        for (int i = 0; i < ins_cnt; i++) {
+            if (instructs[i].code != CALL) continue;
+            int entry = instructs[i].operand;
+            if (instructs[entry].code != VMALLOC || entry + 1 >= ins_cnt) continue;
+            const instruct &first = instructs[entry + 1];
+            int k = first.code == STORE_NAME ? first.operand + 1 : 0;
+            if (k <= 0 || k > instructs[entry].operand || entry + k >= ins_cnt) continue;
+            bool matched = true;
+            for (int j = 1; j <= k && matched; j++) {
+                const instruct &store = instructs[entry + j];
+                matched = !jump_target[entry + j] && store.code == STORE_NAME && store.operand == k - j;
+            }
+            if (matched) instructs[entry].code = ENTER;
+        }
+        fuse();
+        // running past the last instruction halts
+        instructs.emplace_back(-1, HALT);
+        verify();
+    }
+
+    // Folds constants and drops dead code once jumps go to instruction indices, see bytecode_optimizer
+    void optimize();
+
+    /*
+     * Walks the control flow of every function from its entry and finds the operand stack depth before each
+     * instruction, so that malformed programs are rejected by the machine loading them instead of crashing it.
+     */
+    void verify();
+
+    // Number of instructions a superinstruction stands for
+    static int fused_length(instruct_code code) {
+        if (code >= ADD_LOCAL_IMM && code <= CMP_GE_JMP_FALSE_GLOBALS) return 4;
+        if (code == LOAD_ELEM_LOCAL || code == LOAD_ELEM_GLOBAL) return 3;
+        return 1;
+    }
+
+    // Superinstructions stand for their first instruction in the passes over linked code, the rest follows them
+    static instruct_code unfused(instruct_code code) {
+        switch (code) {
+            case ADD_LOCAL_IMM:
+            case SUB_LOCAL_IMM:
+            case CMP_LT_JMP_FALSE_LOCALS:
+            case CMP_LE_JMP_FALSE_LOCALS:
+            case CMP_GT_JMP_FALSE_LOCALS:
+            case CMP_GE_JMP_FALSE_LOCALS:
+            case LOAD_ELEM_LOCAL:
+                return LOAD_NAME;
+            case ADD_GLOBAL_IMM:
+            case SUB_GLOBAL_IMM:
+            case CMP_LT_JMP_FALSE_GLOBALS:
+            case CMP_LE_JMP_FALSE_GLOBALS:
+            case CMP_GT_JMP_FALSE_GLOBALS:
+            case CMP_GE_JMP_FALSE_GLOBALS:
+            case LOAD_ELEM_GLOBAL:
+                return LOAD_NAME_GLOBAL;
+            default:
+                return code;
+        }
+    }
+
+    static bool is_load(instruct_code code) {
+        return code == LOAD_NAME || code == LOAD_NAME_GLOBAL || code == BINARY_SUBSCR;
+    }
+
+    // Pushes a value without popping one, a condition of a jump between a load and its increment
+    static bool is_push(instruct_code code) {
+        return code == LOAD_NULL || code == LOAD_INT || code == LOAD_FLOAT || code == LOAD_CHAR ||
+               code == LOAD_CONSTANT || code == LOAD_NAME || code == LOAD_NAME_GLOBAL;
+    }
+
+    /*
+     * The loads whose value the increment at i gets, found back through the code that leaves the stack under it
+     * alone: NOOP, JMP, and JMP_TRUE/JMP_FALSE with the push of their condition. That code must lead to the
+     * increment only and be entered from the loads only, so each load can increase its own variable instead.
+     */
+    bool increment_loads(int i, const std::vector<std::vector<int>> &sources, std::vector<int> &loads) {
+        std::vector<bool> passed(size(), false);
+        std::vector<int> region;
+        std::vector<int> work{i};
+        while (!work.empty()) {
+            int to = work.back();
+            work.pop_back();
+            std::vector<int> from = sources[to];
+            instruct_code before = to > 0 ? instructs[to - 1].code : HALT;
+            if (before != JMP && before != RET && before != HALT) from.push_back(to - 1);
+            for (int p : from) {
+                instruct_code code = instructs[p].code;
+                if (is_load(code) && p == to - 1) {
+                    loads.push_back(p);
+                    continue;
+                }
+                if (passed[p]) continue;
+                passed[p] = true;
+                region.push_back(p);
+                if (code == JMP_TRUE || code == JMP_FALSE) {
+                    if (p == 0 || !sources[p].empty() || !is_push(instructs[p - 1].code)) return false;
+                    passed[p - 1] = true;
+                    region.push_back(p - 1);
+                    work.push_back(p - 1);
+                } else if (code == NOOP || code == JMP) {
+                    work.push_back(p);
+                } else {
+                    return false;
+                }
+            }
+        }
+        auto inside = [&](int to) {
+            return to == i || (to < size() && passed[to]);
+        };
+        for (int r : region) {
+            const instruct &ins = instructs[r];
+            if (ins.code != JMP && !inside(r + 1)) return false;
+            if (is_jump(ins.code) && !inside(ins.operand)) return false;
+        }
+        return !loads.empty();
+    }
+
+    /*
+     * Scalars are copied when loaded, so the variable UNARY_OP 2/3 increases is bound to the loads it gets the value
+     * of. An increment of a temporary just drops it, one jumped to without a known variable panics if it is run.
+     */
+    void bind_increments() {
+        int ins_cnt = size();
+        std::vector<std::vector<int>> sources(ins_cnt);
+        for (int i = 0; i < ins_cnt; i++) {
+            if (is_jump(instructs[i].code)) sources[instructs[i].operand].push_back(i);
+        }
+        for (int i = 0; i < ins_cnt; i++) {
+            instruct &ins = instructs[i];
+            if (ins.code != UNARY_OP || (ins.operand != 2 && ins.operand != 3)) continue;
+            std::vector<int> loads;
+            if (!increment_loads(i, sources, loads)) {
+                if (sources[i].empty()) ins.code = POP_OP;
+                continue;
+            }
+            bool increase = ins.operand == 2;
+            for (int load : loads) {
+                instruct &loaded = instructs[load];
+                if (loaded.code == LOAD_NAME) {
+                    loaded.code = increase ? INC_NAME : DEC_NAME;
+                } else if (loaded.code == LOAD_NAME_GLOBAL) {
+                    loaded.code = increase ? INC_NAME_GLOBAL : DEC_NAME_GLOBAL;
+                } else {
+                    loaded.code = increase ? INC_SUBSCR : DEC_SUBSCR;
+                }
+            }
+            ins.code = NOOP;
+        }
+    }
+
+    /*
+     * Peephole pass: the first instruction of a common sequence becomes a superinstruction reading the operands of
+     * the following ones, which stay in place for jumps into the sequence and for the fallback.
+     */
+    void fuse() {
+        int ins_cnt = size();
+        for (int i = 0; i < ins_cnt; i++) {
+            instruct_code code = instructs[i].code;
+            if (code != LOAD_NAME && code != LOAD_NAME_GLOBAL) continue;
+            bool global = code == LOAD_NAME_GLOBAL;
+            instruct_code next = i + 1 < ins_cnt ? instructs[i + 1].code : NOOP;
+            instruct_code op = i + 2 < ins_cnt ? instructs[i + 2].code : NOOP;
+            instruct_code last = i + 3 < ins_cnt ? instructs[i + 3].code : NOOP;
+            if (next == LOAD_INT && (op == ADD || op == SUB) && last == (global ? STORE_NAME_GLOBAL : STORE_NAME)) {
+                instructs[i].code = op == ADD ? (global ? ADD_GLOBAL_IMM : ADD_LOCAL_IMM)
+                                              : (global ? SUB_GLOBAL_IMM : SUB_LOCAL_IMM);
+            } else if ((next == code || next == LOAD_INT) && (op == LT || op == LE || op == GT || op == GE) &&
+                       last == JMP_FALSE) {
+                static const instruct_code local_codes[] = {CMP_LT_JMP_FALSE_LOCALS, CMP_LE_JMP_FALSE_LOCALS,
+                                                            CMP_GT_JMP_FALSE_LOCALS, CMP_GE_JMP_FALSE_LOCALS};
+                static const instruct_code global_codes[] = {CMP_LT_JMP_FALSE_GLOBALS, CMP_LE_JMP_FALSE_GLOBALS,
+                                                             CMP_GT_JMP_FALSE_GLOBALS, CMP_GE_JMP_FALSE_GLOBALS};
+                instructs[i].code = (global ? global_codes : local_codes)[op - LT];
+            } else if (next == code && op == BINARY_SUBSCR) {
+                instructs[i].code = global ? LOAD_ELEM_GLOBAL : LOAD_ELEM_LOCAL;
+            } else {
+                continue;
+            }
+            i += fused_length(instructs[i].code) - 1;
+        }
+    }
+
+    void add_instruct(instruct ins) {
+        if (size() >= MAX_INSTRUCTION_NUM) panic("Too many instructions");
+        if (ins.address < 0 || ins.address > MAX_INSTRUCTION_ADDR) panic("Instruction address out of range");
+        // Operators get an instruction code of their own, so that the handler does not look at the operand
+        static const instruct_code binary_op_codes[] = {ADD, SUB, MUL, MOD, DIV, AND, OR, SHL, SHR, XOR,
+                                                        LT, LE, GT, GE, EQ, NE};
+        static const instruct_code unary_op_codes[] = {NOT, NEG};
+        static const instruct_code type_cvt_codes[] = {CVT_INT, CVT_FLOAT, CVT_CHAR};
+        if (ins.code == BINARY_OP && ins.operand >= 0 && ins.operand < 16) {
+            ins.code = binary_op_codes[ins.operand];
+        } else if (ins.code == UNARY_OP && ins.operand >= 0 && ins.operand < 2) {
+            // UNARY_OP 2/3 increases a loaded variable, bound by link() once the jumps are known
+            ins.code = unary_op_codes[ins.operand];
+        } else if (ins.code == TYPE_CVT && ins.operand >= 0 && ins.operand < 3) {
+            ins.code = type_cvt_codes[ins.operand];
+        }
+        if (ins.address >= (int) addrs.size()) addrs.resize(ins.address + 1, -1);
+        addrs[ins.address] = size();
+        instructs.push_back(ins);
+    }
+};
+
+/*
+ * Stack effects of a linked program, function by function from the top level. A program is malformed when a
+ * reachable instruction would pop an empty stack, read a variable beyond VMALLOC or return from the top level, and
+ * jumps must agree on the stack they reach. Code the walk cannot follow leaves the program unverified.
+ */
+class bytecode_verifier {
+private:
+    struct rejected {
+        std::string reason;
+        bool malformed;
+    };
+
+    // Before an instruction: operands of the frame, global operands it stored and operands of a frame pushed by it
+    struct stack_state {
+        int depth = -1; // -1 if not reached
+        int stored = 0;
+        int pushed = -1; // -1 if no frame is pushed
+
+        bool operator!=(const stack_state &o) const {
+            return depth != o.depth || stored != o.stored || pushed != o.pushed;
+        }
+    };
+
+    Program &program;
+    std::vector<stack_state> state_at;
+    std::vector<int> owner; // Entry of the function an instruction was reached in
+    std::vector<int> argc_of; // Arguments of the function starting at an instruction index, -1 if none
+    std::vector<int> pending; // Reached instructions not walked yet
+    std::vector<int> callees; // Entries of functions not walked yet
+    int global_cnt = 0;
+    // the function being walked
+    int entry = 0;
+    bool top_level = true;
+    int var_cnt = 0;
+    int slots = 0;
+
+    [[noreturn]] void fail(const std::string &reason, int i) {
+        throw rejected{reason + " at address " + std::to_string(program.instructs[i].address), true};
+    }
+
+    [[noreturn]] void give_up(const std::string &reason, int i) {
+        throw rejected{reason + " at address " + std::to_string(program.instructs[i].address), false};
+    }
+
+    void reach(int i, const stack_state &state, int from) {
+        if (owner[i] >= 0 && owner[i] != entry) give_up("Code shared between functions", from);
+        if (state_at[i].depth >= 0) {
+            if (state_at[i] != state) fail("Inconsistent operand stack depth", from);
+            return;
+        }
+        state_at[i] = state;
+        owner[i] = entry;
+        slots = std::max(slots, var_cnt + state.depth);
+        pending.push_back(i);
+    }
+
+    void local(int index, int i) {
+        if (top_level) fail("Locals at the top level", i);
+        if (index < 0 || index >= var_cnt) fail("Local out of range", i);
+    }
+
+    void global(int index, int i) {
+        if (index < 0 || index >= global_cnt) fail("Global out of range", i);
+    }
+
+    void underflow_unless(bool enough, int i) {
+        if (!enough) fail("Operand stack underflow", i);
+    }
+
+    // The instruction pops n operands and pushes pushed, then the next one runs
+    void effect(int i, int n, int pushed) {
+        stack_state state = state_at[i];
+        underflow_unless(state.depth >= n, i);
+        state.depth += pushed - n;
+        reach(i + 1, state, i);
+    }
+
+    void call(int call, int argc) {
+        int callee = program.instructs[call].operand;
+        if (callee == 0) give_up("Call to the top level", call);
+        if (argc_of[callee] >= 0 && argc_of[callee] != argc) {
+            give_up("Function called with different argument counts", call);
+        }
+        if (argc_of[callee] < 0) callees.push_back(callee);
+        argc_of[callee] = argc;
+    }
+
+    // PUSH ... CALL, where the arguments are moved from the global operands to the frame pushed
+    void walk_pushed(int i) {
+        const instruct &ins = program.instructs[i];
+        stack_state state = state_at[i];
+        switch (ins.code) {
+            case NOOP:
+                break;
+            case LOAD_GLOBAL:
+                // the global operands of the top level are its own operands
+                if (top_level) {
+                    underflow_unless(state.depth >= 1, i);
+                    state.depth--;
+                } else {
+                    if (state.stored < 1) give_up("Global operand stored by the caller", i);
+                    state.stored--;
+                }
+                state.pushed++;
+                break;
+            case CALL:
+                call(i, state.pushed);
+                state.pushed = -1;
+                state.depth++;
+                break;
+            default:
+                give_up("Frame pushed apart from its CALL", i);
+        }
+        reach(i + 1, state, i);
+    }
+
+    void walk(int i) {
+        const instruct &ins = program.instructs[i];
+        stack_state state = state_at[i];
+        if (state.pushed >= 0) {
+            walk_pushed(i);
+            return;
+        }
+        switch (Program::unfused(ins.code)) {
+            case NOOP:
+                effect(i, 0, 0);
+                break;
+            case LOAD_NULL:
+            case LOAD_INT:
+            case LOAD_FLOAT:
+            case LOAD_CHAR:
+            case GETCH:
+                effect(i, 0, 1);
+                break;
+            case LOAD_CONSTANT:
+                if (ins.operand < 0 || ins.operand >= (int) program.constants.size()) fail("Undefined constant", i);
+                effect(i, 0, 1);
+                break;
+            case LOAD_NAME:
+                local(ins.operand, i);
+                effect(i, 0, 1);
+                break;
+            case LOAD_NAME_GLOBAL:
+                global(ins.operand, i);
+                effect(i, 0, 1);
+                break;
+            case STORE_NAME:
+            case STORE_NAME_NOPOP:
+                local(ins.operand, i);
+                effect(i, 1, ins.code == STORE_NAME_NOPOP ? 1 : 0);
+                break;
+            case STORE_NAME_GLOBAL:
+            case STORE_NAME_GLOBAL_NOPOP:
+                global(ins.operand, i);
+                effect(i, 1, ins.code == STORE_NAME_GLOBAL_NOPOP ? 1 : 0);
+                break;
+            case INC_NAME:
+            case DEC_NAME:
+                local(ins.operand, i);
+                effect(i, 0, 0);
+                break;
+            case INC_NAME_GLOBAL:
+            case DEC_NAME_GLOBAL:
+                global(ins.operand, i);
+                effect(i, 0, 0);
+                break;
+            case POP_OP:
+            case PRINTK:
+            case PUTCH:
+            case PUTS:
+                effect(i, 1, 0);
+                break;
+            case NOT:
+            case NEG:
+            case CVT_INT:
+            case CVT_FLOAT:
+            case CVT_CHAR:
+            case SIZE_OF:
+            case BUILD_ARR:
+            case ARR_SUM:
+            case ARR_MIN:
+            case ARR_MAX:
+                effect(i, 1, 1);
+                break;
+            case ADD:
+            case SUB:
+            case MUL:
+            case MOD:
+            case DIV:
+            case AND:
+            case OR:
+            case SHL:
+            case SHR:
+            case XOR:
+            case LT:
+            case LE:
+            case GT:
+            case GE:
+            case EQ:
+            case NE:
+            case BINARY_SUBSCR:
+            case ARR_DOT:
+                effect(i, 2, 1);
+                break;
+            case INC_SUBSCR:
+            case DEC_SUBSCR:
+            case ARR_FILL:
+            case ARR_COPY:
+                effect(i, 2, 0);
+                break;
+            case STORE_SUBSCR_INPLACE:
+            case STORE_SUBSCR_NOPOP:
+                effect(i, 3, 1);
+                break;
+            case STORE_SUBSCR:
+            case ARR_ADD:
+            case ARR_MUL:
+                effect(i, 3, 0);
+                break;
+            case STORE_GLOBAL:
+                // an argument of a call made later, it stays on the stack at the top level
+                underflow_unless(state.depth >= 1, i);
+                if (!top_level) {
+                    state.depth--;
+                    state.stored++;
+                }
+                reach(i + 1, state, i);
+                break;
+            case LOAD_GLOBAL:
+                if (top_level) {
+                    underflow_unless(state.depth >= 1, i);
+                } else {
+                    if (state.stored < 1) give_up("Global operand stored by the caller", i);
+                    state.depth++;
+                    state.stored--;
+                }
+                reach(i + 1, state, i);
+                break;
+            case PUSH:
+                state.pushed = 0;
+                reach(i + 1, state, i);
+                break;
+            case JMP:
+                reach(ins.operand, state, i);
+                break;
+            case JMP_TRUE:
+            case JMP_FALSE:
+                effect(i, 1, 0);
+                state.depth--;
+                reach(ins.operand, state, i);
+                break;
+            case PUSH_ARGS:
+            case CALL_ARGS:
+            case TAIL_CALL: {
+                // STORE_GLOBAL * k, PUSH, LOAD_GLOBAL * k, then the CALL, which returns one value
+                int k = ins.operand;
+                underflow_unless(state.depth >= k, i);
+                state.depth -= k;
+                if (ins.code == PUSH_ARGS) {
+                    state.pushed = k;
+                    reach(i + 2 * k + 1, state, i);
+                    break;
+                }
+                call(i + 2 * k + 1, k);
+                // the callee of a tail call returns to the caller directly, the top level makes a plain call
+                if (ins.code == TAIL_CALL && !top_level) break;
+                state.depth++;
+                reach(i + 2 * k + 2, state, i);
+                break;
+            }
+            case CALL:
+                give_up("CALL without PUSH", i);
+            case RET:
+                if (top_level) fail("RET at the top level", i);
+                underflow_unless(state.depth >= 1, i);
+                if (state.stored > 0) give_up("Global operands left by the function", i);
+                break;
+            case VMALLOC:
+            case ENTER:
+                give_up("VMALLOC inside a function", i);
+            default:
+                // HALT, and the instructions that always panic
+                break;
+        }
+    }
+
+    void walk_function(int start) {
+        const instruct &first = program.instructs[start];
+        entry = start;
+        top_level = start == 0;
+        var_cnt = 0;
+        int argc = top_level ? 0 : argc_of[start];
+        slots = argc;
+        int i = start;
+        stack_state state;
+        state.depth = argc;
+        if (first.code == VMALLOC || first.code == ENTER) {
+            owner[start] = entry;
+            state_at[start] = state;
+            if (top_level) global_cnt = first.operand;
+            else var_cnt = first.operand;
+            int k = first.code == ENTER ? program.instructs[start + 1].operand + 1 : -1;
+            if (k == argc) {
+                // the arguments are the first locals, their STORE_NAMEs are skipped
+                i += k;
+                state.depth = 0;
+            }
+            i++;
+        }
+        reach(i, state, start);
+        while (!pending.empty()) {
+            int next = pending.back();
+            pending.pop_back();
+            walk(next);
+        }
+        program.frame_slots[start] = slots;
+    }
+
+public:
+    explicit bytecode_verifier(Program &_program) : program(_program) {}
+
+    void verify() {
+        int ins_cnt = program.size();
+        state_at.assign(ins_cnt, stack_state());
+        owner.assign(ins_cnt, -1);
+        argc_of.assign(ins_cnt, -1);
+        program.frame_slots.assign(ins_cnt, -1);
+        program.verified = false;
+        program.malformed.clear();
+        try {
+            // VMALLOC also runs apart from a function entry, where the variables it allocates are not known here
+            std::vector<bool> is_entry(ins_cnt, false);
+            for (const instruct &ins : program.instructs) {
+                if (ins.code == CALL) is_entry[ins.operand] = true;
+            }
+            for (int i = 1; i < ins_cnt; i++) {
+                instruct_code code = program.instructs[i].code;
+                if ((code == VMALLOC || code == ENTER) && !is_entry[i]) give_up("VMALLOC inside a function", i);
+            }
+            callees.push_back(0);
+            while (!callees.empty()) {
+                int start = callees.back();
+                callees.pop_back();
+                walk_function(start);
+            }
+        } catch (const rejected &e) {
+            program.frame_slots.clear();
+            program.unverified = e.reason;
+            if (e.malformed) program.malformed = "Malformed program: " + e.reason;
+            return;
+        }
+        program.verified = true;
+        program.unverified.clear();
+    }
+};
+
+void Program::verify() {
+    bytecode_verifier(*this).verify();
+}
+
+// Register IR, three-address code translated from the stack code of a linked program
+enum reg_code {
+    R_MOVE,
+    // in the order of ADD ... CVT_CHAR
+    R_ADD,
+    R_SUB,
+    R_MUL,
+    R_MOD,
+    R_DIV,
+    R_AND,
+    R_OR,
+    R_SHL,
+    R_SHR,
+    R_XOR,
+    R_LT,
+    R_LE,
+    R_GT,
+    R_GE,
+    R_EQ,
+    R_NE,
+    R_NOT,
+    R_NEG,
+    R_CVT_INT,
+    R_CVT_FLOAT,
+    R_CVT_CHAR,
+    // Variables and array elements increased in place
+    R_INC,
+    R_DEC,
+    R_INC_ELEM,
+    R_DEC_ELEM,
+    R_LOAD_ELEM,
+    R_STORE_ELEM,
+    R_BUILD_ARR,
+    R_SIZE_OF,
+    R_JMP,
+    R_JMP_TRUE,
+    R_JMP_FALSE,
+    // Comparison and JMP_FALSE
+    R_JMP_UNLESS_LT,
+    R_JMP_UNLESS_LE,
+    R_JMP_UNLESS_GT,
+    R_JMP_UNLESS_GE,
+    R_CALL,
+    R_TAIL_CALL,
+    R_RET,
+    R_HALT,
+    R_PRINTK,
+    R_PUTCH,
+    R_PUTS,
+    R_GETCH,
+    // Number of register codes, not an instruction
+    REG_CODE_NUM
+};
+
+// a = b op c, jumps go to a, see REG() for the operands
+struct reg_instruct {
+    reg_code code;
+    int a, b, c;
+};
+
+/*
+ * A frame holds the locals of a function, then one temporary per operand stack depth, arguments arrive in the
+ * temporaries like on the stack. The absolute registers under the first frame hold the globals and the constants.
+ */
+struct reg_function {
+    int entry;
+    int var_cnt;
+    int argc;
+    int frame_size;
+};
+
+struct register_program {
+    std::vector<reg_instruct> code;
+    std::vector<reg_function> functions; // The top level first
+    std::vector<slot> constants; // Absolute registers after the globals
+    int global_cnt = 0;
+
+    int frame_base() const {
+        return global_cnt + (int) constants.size();
+    }
+};
+
+// Caller of a running function, the return value goes to its register result
+struct reg_frame {
+    int return_pc;
+    int base;
+    int frame_size;
+    int result;
+    int function;
+};
+
+// The most negative int divided by -1 wraps around like the other operators instead of trapping, its remainder is 0
+inline int_tp int_div(int_tp left, int_tp right) {
+    return right == -1 ? (int_tp) (0 - (uint64_t) left) : left / right;
+}
+
+inline int_tp int_mod(int_tp left, int_tp right) {
+    return right == -1 ? 0 : left % right;
+}
+
+// Operator semantics of the stack engine, for the operands the register engine has no fast path for
+slot register_binary(reg_code op, const slot &left, const slot &right) {
+    switch (op) {
+        case R_AND:
+        case R_OR:
+        case R_SHL:
+        case R_SHR:
+        case R_XOR: {
+            if (left.type != INT || right.type != INT) {
+                panic("Unsupported binary operator");
+            }
+            auto l = (unsigned int) left.int_val, r = (unsigned int) right.int_val;
+            unsigned int res = op == R_AND ? l & r : op == R_OR ? l | r : op == R_SHL ? l << r
+                                                                        : op == R_SHR ? l >> r : l ^ r;
+            return slot((int_tp) res);
+        }
+        case R_EQ:
+        case R_NE: {
+            // operands of different types are never equal
+            bool equal;
+            if (INT_INT) {
+                equal = left.int_val == right.int_val;
+            } else if (FLOAT_FLOAT) {
+                equal = left.float_val == right.float_val;
+            } else if (left.type == CHAR && right.type == CHAR) {
+                equal = left.char_val == right.char_val;
+            } else {
+                equal = false;
+            }
+            return slot(op == R_EQ ? equal : !equal);
+        }
+        case R_MOD:
+            if (!INT_INT) {
+                panic("Unsupported binary operator");
+            }
+            if (right.int_val == 0) {
+                panic("Division by zero");
+            }
+            return slot(int_mod(left.int_val, right.int_val));
+        default:
+            break;
+    }
+    if (INT_INT) {
+        int_tp l = left.int_val, r = right.int_val;
+        switch (op) {
+            case R_ADD:
+                return slot(l + r);
+            case R_SUB:
+                return slot(l - r);
+            case R_MUL:
+                return slot(l * r);
+            case R_DIV:
+                if (r == 0) {
+                    panic("Division by zero");
+                }
+                return slot(int_div(l, r));
+            case R_LT:
+                return slot(l < r);
+            case R_LE:
+                return slot(l <= r);
+            case R_GT:
+                return slot(l > r);
+            default:
+                return slot(l >= r);
+        }
+    }
+    if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+        panic("Unsupported binary operator");
+    }
+    float_tp l = AS_FLOAT(left), r = AS_FLOAT(right);
+    switch (op) {
+        case R_ADD:
+            return slot(l + r);
+        case R_SUB:
+            return slot(l - r);
+        case R_MUL:
+            return slot(l * r);
+        case R_DIV:
+            return slot(l / r);
+        case R_LT:
+            return slot(l < r);
+        case R_LE:
+            return slot(l <= r);
+        case R_GT:
+            return slot(l > r);
+        default:
+            return slot(l >= r);
+    }
+}
+
+/*
+ * Load-time pass over the resolved jumps of a program: operators and conditional jumps of constant loads are folded
+ * and constants that fit an operand become immediates, jumps to jumps are threaded, then NOOPs and code after
+ * unconditional transfers that no jump reaches are dropped. Folding stops at jump targets and never folds an operator
+ * that would panic.
+ */
+class bytecode_optimizer {
+private:
+    Program &program;
+    std::vector<bool> is_target;
+
+    void find_targets() {
+        is_target.assign(program.size() + 1, false);
+        for (const instruct &ins : program.instructs) {
+            if (Program::is_jump(ins.code)) is_target[ins.operand] = true;
+        }
+    }
+
+    bool constant_of(const instruct &ins, slot &val) const {
+        switch (ins.code) {
+            case LOAD_INT:
+                val = slot((int_tp) ins.operand);
+                return true;
+            case LOAD_FLOAT:
+                val = slot((float_tp) ins.operand);
+                return true;
+            case LOAD_CHAR:
+                val = slot((char_tp) ins.operand);
+                return true;
+            case LOAD_CONSTANT:
+                if (ins.operand < 0 || ins.operand >= (int) program.constants.size()) return false;
+                val = program.constants[ins.operand];
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // The constant pool entry of a value, added if there is none
+    int pooled(const slot &val) {
+        std::vector<slot> &constants = program.constants;
+        for (int i = 0; i < (int) constants.size(); i++) {
+            const slot &c = constants[i];
+            if (c.type == val.type && (val.type == VOID || memcmp(&c.int_val, &val.int_val, sizeof(val.int_val)) == 0)) {
+                return i;
+            }
+        }
+        constants.push_back(val);
+        return (int) constants.size() - 1;
+    }
+
+    // Loads val at the place of ins, as an immediate operand where it fits
+    void load(instruct &ins, const slot &val) {
+        ins.counter = 0;
+        if (val.type == INT && val.int_val >= INT32_MIN && val.int_val <= INT32_MAX) {
+            ins.code = LOAD_INT;
+            ins.operand = (int) val.int_val;
+        } else if (val.type == FLOAT && val.float_val >= INT32_MIN && val.float_val <= INT32_MAX &&
+                   val.float_val == (float_tp) (int) val.float_val && !std::signbit(val.float_val)) {
+            ins.code = LOAD_FLOAT;
+            ins.operand = (int) val.float_val;
+        } else if (val.type == CHAR) {
+            ins.code = LOAD_CHAR;
+            ins.operand = val.char_val;
+        } else {
+            ins.code = LOAD_CONSTANT;
+            ins.operand = pooled(val);
+        }
+    }
+
+    // Conversions of floats out of the range of the type are left to run time
+    static bool fold_unary(instruct_code code, const slot &operand, slot &res) {
+        bool is_float = operand.type == FLOAT;
+        float_tp f = operand.float_val;
+        // ends of the ranges of int_tp and char_tp, exact as floats
+        const float_tp int_end = -(float_tp) std::numeric_limits<int_tp>::min();
+        const float_tp char_end = -(float_tp) std::numeric_limits<char_tp>::min();
+        switch (code) {
+            case NOT:
+                if (operand.type != INT) return false;
+                res = slot((int_tp) (operand.int_val ? 0 : 1));
+                return true;
+            case NEG:
+                if (operand.type == INT && operand.int_val != std::numeric_limits<int_tp>::min()) {
+                    res = slot(-operand.int_val);
+                } else if (is_float) {
+                    res = slot(-f);
+                } else {
+                    return false;
+                }
+                return true;
+            case CVT_INT:
+                if (operand.type == INT) res = operand;
+                else if (is_float && f >= -int_end && f < int_end) res = slot((int_tp) f);
+                else if (operand.type == CHAR) res = slot((int_tp) operand.char_val);
+                else return false;
+                return true;
+            case CVT_FLOAT:
+                if (is_float) res = operand;
+                else if (operand.type == INT) res = slot((float_tp) operand.int_val);
+                else if (operand.type == CHAR) res = slot((float_tp) operand.char_val);
+                else return false;
+                return true;
+            case CVT_CHAR:
+                if (operand.type == CHAR) res = operand;
+                else if (operand.type == INT) res = slot((char_tp) operand.int_val);
+                else if (is_float && f > -char_end - 1 && f < char_end) res = slot((char_tp) f);
+                else return false;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool fold_binary(instruct_code code, const slot &left, const slot &right, slot &res) {
+        try {
+            res = register_binary((reg_code) (R_ADD + (code - ADD)), left, right);
+        } catch (const vm_error &) {
+            return false;
+        }
+        return true;
+    }
+
+    void fold() {
+        std::vector<instruct> &instructs = program.instructs;
+        for (instruct &ins : instructs) {
+            slot val;
+            if (ins.code == LOAD_CONSTANT && constant_of(ins, val)) load(ins, val);
+        }
+        // constant loads on the top of the stack, since the last jump target
+        std::vector<int> loads;
+        for (int i = 0; i < program.size(); i++) {
+            if (is_target[i]) loads.clear();
+            instruct &ins = instructs[i];
+            slot left, right, res;
+            if (ins.code == NOOP) continue;
+            if (constant_of(ins, res)) {
+                loads.push_back(i);
+                continue;
+            }
+            int n = (int) loads.size();
+            if (ins.code >= ADD && ins.code <= NE && n >= 2 && constant_of(instructs[loads[n - 2]], left) &&
+                constant_of(instructs[loads[n - 1]], right) && fold_binary(ins.code, left, right, res)) {
+                load(instructs[loads[n - 2]], res);
+                instructs[loads[n - 1]] = instruct(instructs[loads[n - 1]].address, NOOP);
+                loads.pop_back();
+            } else if (ins.code >= NOT && ins.code <= CVT_CHAR && n >= 1 && constant_of(instructs[loads[n - 1]], left) &&
+                       fold_unary(ins.code, left, res)) {
+                load(instructs[loads[n - 1]], res);
+            } else if ((ins.code == JMP_TRUE || ins.code == JMP_FALSE) && n >= 1 &&
+                       constant_of(instructs[loads[n - 1]], left)) {
+                // a constant condition always or never jumps
+                instructs[loads[n - 1]] = instruct(instructs[loads[n - 1]].address, NOOP);
+                loads.pop_back();
+                if (left.truth() == (ins.code == JMP_TRUE)) {
+                    ins.code = JMP;
+                    loads.clear();
+                    continue;
+                }
+            } else {
+                loads.clear();
+                continue;
+            }
+            ins = instruct(ins.address, NOOP);
+        }
+    }
+
+    // First instruction run from i on, the end of the program if only NOOPs follow
+    int skip_noops(int i) const {
+        while (i < program.size() && program.instructs[i].code == NOOP) i++;
+        return i;
+    }
+
+    void thread_jumps() {
+        std::vector<instruct> &instructs = program.instructs;
+        int ins_cnt = program.size();
+        for (int i = 0; i < ins_cnt; i++) {
+            instruct &ins = instructs[i];
+            if (ins.code != JMP && ins.code != JMP_TRUE && ins.code != JMP_FALSE) continue;
+            int target = skip_noops(ins.operand);
+            // a loop of jumps is left as it is after going around it once
+            for (int hops = 0; target < ins_cnt && instructs[target].code == JMP && hops < ins_cnt; hops++) {
+                target = skip_noops(instructs[target].operand);
+            }
+            ins.operand = target;
+            // a jump to RET or HALT does the same in place, CALL, JMP to RET becomes a tail call
+            if (ins.code == JMP && target < ins_cnt && (instructs[target].code == RET || instructs[target].code == HALT)) {
+                ins = instruct(ins.address, instructs[target].code, instructs[target].operand);
+            }
+        }
+    }
+
+    // Drops NOOPs, code no jump reaches after JMP, RET or HALT, and jumps to the next instruction kept
+    void drop_dead_code() {
+        std::vector<instruct> &instructs = program.instructs;
+        int ins_cnt = program.size();
+        find_targets();
+        std::vector<bool> keep(ins_cnt + 1, false);
+        keep[ins_cnt] = true;
+        bool reachable = true;
+        for (int i = 0; i < ins_cnt; i++) {
+            instruct_code code = instructs[i].code;
+            if (is_target[i]) reachable = true;
+            keep[i] = reachable && code != NOOP;
+            if (code == JMP || code == RET || code == HALT) reachable = false;
+        }
+        std::vector<int> next_kept(ins_cnt + 1, ins_cnt);
+        for (int i = ins_cnt - 1; i >= 0; i--) {
+            const instruct &ins = instructs[i];
+            if (keep[i] && ins.code == JMP && ins.operand > i && next_kept[ins.operand] == next_kept[i + 1]) {
+                keep[i] = false;
+            }
+            next_kept[i] = keep[i] ? i : next_kept[i + 1];
+        }
+        std::vector<int> index(ins_cnt + 1); // Old instruction index -> new one, that of the next kept if dropped
+        std::vector<instruct> kept;
+        kept.reserve(ins_cnt);
+        for (int i = 0; i <= ins_cnt; i++) {
+            index[i] = (int) kept.size();
+            if (i < ins_cnt && keep[i]) kept.push_back(instructs[i]);
+        }
+        for (instruct &ins : kept) {
+            if (Program::is_jump(ins.code)) ins.operand = index[ins.operand];
+        }
+        for (int &addr : program.addrs) {
+            if (addr >= 0) addr = index[addr];
+        }
+        instructs = std::move(kept);
+    }
+
+public:
+    explicit bytecode_optimizer(Program &_program) : program(_program) {}
+
+    void optimize() {
+        find_targets();
+        fold();
+        thread_jumps();
+        drop_dead_code();
+    }
+};
+
+void Program::optimize() {
+    bytecode_optimizer(*this).optimize();
+}
+
+/*
+ * Translates each function (the top level and every CALL target) by following the operand stack depth. Loads are
+ * not copied but kept on a symbolic stack as the register they read, results go to the temporary of their depth.
+ * The symbolic stack is written back to the temporaries on jumps, calls and jump targets.
+ */
+class register_translator {
+private:
+    struct untranslatable {
+        std::string reason;
+    };
+
+    const Program &program;
+    register_program &out;
+    std::vector<int> label; // Instruction index -> register code index
+    std::vector<int> depth_at; // Operand stack depth at jump targets, -1 if not known yet
+    std::vector<bool> is_target;
+    std::vector<int> argc_of; // Arguments of the function starting at an instruction index, -1 if none
+    std::vector<std::pair<int, int>> fixups; // Jump -> instruction index of its target
+    std::unordered_map<int64_t, int> constant_index[ARRAY + 1]; // By type, then by value bits
+    // the function being translated
+    int region_start = 0, region_end = 0;
+    int var_cnt = 0;
+    bool top_level = true;
+    std::vector<int> stack;
+    int max_depth = 0;
+    int last_def = -1; // The last instruction if it wrote the temporary on the top of the stack
+
+    [[noreturn]] void fail(const std::string &reason, int i) {
+        throw untranslatable{reason + " at address " + std::to_string(program.instructs[i].address)};
+    }
+
+    int pc() const {
+        return (int) out.code.size();
+    }
+
+    void emit(reg_code code, int a, int b = 0, int c = 0) {
+        out.code.push_back({code, a, b, c});
+        last_def = -1;
+    }
+
+    int temp(int depth) const {
+        return var_cnt + depth;
+    }
+
+    int constant(const slot &val) {
+        int64_t bits = 0;
+        memcpy(&bits, &val.int_val, sizeof(val.int_val));
+        std::unordered_map<int64_t, int> &index = constant_index[val.type];
+        auto found = index.find(val.type == VOID ? 0 : bits);
+        if (found != index.end()) return found->second;
+        out.constants.push_back(val);
+        int r = ~(out.global_cnt + (int) out.constants.size() - 1);
+        index[val.type == VOID ? 0 : bits] = r;
+        return r;
+    }
+
+    void push(int r) {
+        int depth = (int) stack.size();
+        // a temporary moved to another depth would be overwritten by the next value at its own depth
+        if (r >= var_cnt && r != temp(depth)) {
+            emit(R_MOVE, temp(depth), r);
+            r = temp(depth);
+        }
+        stack.push_back(r);
+        max_depth = std::max(max_depth, depth + 1);
+    }
+
+    int pop(int i) {
+        if (stack.empty()) fail("Operand stack underflow", i);
+        int r = stack.back();
+        stack.pop_back();
+        return r;
+    }
+
+    void flush(int depth) {
+        if (stack[depth] == temp(depth)) return;
+        emit(R_MOVE, temp(depth), stack[depth]);
+        stack[depth] = temp(depth);
+    }
+
+    void flush_all() {
+        for (int d = 0; d < (int) stack.size(); d++) flush(d);
+    }
+
+    // Loads of a variable about to be written are done first
+    void flush_loads_of(int r) {
+        for (int d = 0; d < (int) stack.size(); d++) {
+            if (stack[d] == r) flush(d);
+        }
+    }
+
+    void result(reg_code code, int b = 0, int c = 0) {
+        int dst = temp((int) stack.size());
+        emit(code, dst, b, c);
+        push(dst);
+        last_def = pc() - 1;
+    }
+
+    void store(int r, bool nopop, int i) {
+        int val = pop(i);
+        bool loaded = std::find(stack.begin(), stack.end(), r) != stack.end();
+        if (!loaded && last_def >= 0 && last_def == pc() - 1 && val == temp((int) stack.size()) &&
+            out.code[last_def].a == val) {
+            // the result is written to the variable directly
+            out.code[last_def].a = r;
+        } else {
+            flush_loads_of(r);
+            emit(R_MOVE, r, val);
+        }
+        last_def = -1;
+        if (nopop) push(r);
+    }
+
+    void jump(reg_code code, int target, int b, int c, int i) {
+        if (target < region_start || target >= region_end) fail("Jump out of the function", i);
+        int depth = (int) stack.size();
+        if (depth_at[target] >= 0 && depth_at[target] != depth) fail("Inconsistent operand stack depth", i);
+        depth_at[target] = depth;
+        fixups.emplace_back(pc(), target);
+        emit(code, -1, b, c);
+    }
+
+    int local(int index, int i) {
+        if (top_level) fail("Locals at the top level", i);
+        if (index < 0 || index >= var_cnt) fail("Local out of range", i);
+        return index;
+    }
+
+    int global(int index, int i) {
+        if (index < 0 || index >= out.global_cnt) fail("Global out of range", i);
+        return ~index;
+    }
+
+    // Returns the index of the last instruction translated, reachable is cleared after an unconditional transfer
+    int translate_instruct(int i, bool &reachable) {
+        const instruct &ins = program.instructs[i];
+        switch (Program::unfused(ins.code)) {
+            case NOOP:
+                break;
+            case LOAD_NULL:
+                push(constant(slot()));
+                break;
+            case LOAD_INT:
+                push(constant(slot((int_tp) ins.operand)));
+                break;
+            case LOAD_FLOAT:
+                push(constant(slot((float_tp) ins.operand)));
+                break;
+            case LOAD_CHAR:
+                push(constant(slot((char_tp) ins.operand)));
+                break;
+            case LOAD_CONSTANT:
+                if (ins.operand < 0 || ins.operand >= (int) program.constants.size()) fail("Undefined constant", i);
+                push(constant(program.constants[ins.operand]));
+                break;
+            case LOAD_NAME:
+                push(local(ins.operand, i));
+                break;
+            case LOAD_NAME_GLOBAL:
+                push(global(ins.operand, i));
+                break;
+            case STORE_NAME:
+            case STORE_NAME_NOPOP:
+                store(local(ins.operand, i), ins.code == STORE_NAME_NOPOP, i);
+                break;
+            case STORE_NAME_GLOBAL:
+            case STORE_NAME_GLOBAL_NOPOP:
+                store(global(ins.operand, i), ins.code == STORE_NAME_GLOBAL_NOPOP, i);
+                break;
+            case POP_OP:
+                pop(i);
+                break;
+            case ADD:
+            case SUB:
+            case MUL:
+            case MOD:
+            case DIV:
+            case AND:
+            case OR:
+            case SHL:
+            case SHR:
+            case XOR:
+            case LT:
+            case LE:
+            case GT:
+            case GE:
+            case EQ:
+            case NE: {
+                int right = pop(i);
+                int left = pop(i);
+                result((reg_code) (R_ADD + (ins.code - ADD)), left, right);
+                break;
+            }
+            case NOT:
+            case NEG:
+            case CVT_INT:
+            case CVT_FLOAT:
+            case CVT_CHAR:
+                result((reg_code) (R_ADD + (ins.code - ADD)), pop(i));
+                break;
+            case INC_NAME:
+            case DEC_NAME:
+            case INC_NAME_GLOBAL:
+            case DEC_NAME_GLOBAL: {
+                int r = (ins.code == INC_NAME || ins.code == DEC_NAME) ? local(ins.operand, i)
+                                                                       : global(ins.operand, i);
+                flush_loads_of(r);
+                emit((ins.code == INC_NAME || ins.code == INC_NAME_GLOBAL) ? R_INC : R_DEC, r);
+                break;
+            }
+            case INC_SUBSCR:
+            case DEC_SUBSCR: {
+                int subscr = pop(i);
+                int target = pop(i);
+                emit(ins.code == INC_SUBSCR ? R_INC_ELEM : R_DEC_ELEM, target, subscr);
+                break;
+            }
+            case BINARY_SUBSCR: {
+                int subscr = pop(i);
+                int target = pop(i);
+                result(R_LOAD_ELEM, target, subscr);
+                break;
+            }
+            case STORE_SUBSCR:
+            case STORE_SUBSCR_INPLACE:
+            case STORE_SUBSCR_NOPOP: {
+                int val = pop(i);
+                int subscr = pop(i);
+                if (stack.empty()) fail("Operand stack underflow", i);
+                emit(R_STORE_ELEM, stack.back(), subscr, val);
+                if (ins.code != STORE_SUBSCR_INPLACE) stack.pop_back();
+                if (ins.code == STORE_SUBSCR_NOPOP) push(val);
+                break;
+            }
+            case BUILD_ARR:
+                result(R_BUILD_ARR, pop(i), ins.operand);
+                break;
+            case SIZE_OF:
+                result(R_SIZE_OF, pop(i));
+                break;
+            case JMP:
+                flush_all();
+                jump(R_JMP, ins.operand, 0, 0, i);
+                reachable = false;
+                break;
+            case JMP_TRUE:
+            case JMP_FALSE: {
+                int cond = pop(i);
+                const reg_instruct *compare = last_def >= 0 && last_def == pc() - 1 ? &out.code[last_def] : nullptr;
+                if (ins.code == JMP_FALSE && compare != nullptr && compare->a == cond &&
+                    compare->code >= R_LT && compare->code <= R_GE) {
+                    // the condition is only used by the jump
+                    reg_instruct fused = *compare;
+                    out.code.pop_back();
+                    flush_all();
+                    jump((reg_code) (R_JMP_UNLESS_LT + (fused.code - R_LT)), ins.operand, fused.b, fused.c, i);
+                } else {
+                    flush_all();
+                    jump(ins.code == JMP_TRUE ? R_JMP_TRUE : R_JMP_FALSE, ins.operand, cond, 0, i);
+                }
+                break;
+            }
+            case PUSH_ARGS:
+            case CALL_ARGS:
+            case TAIL_CALL: {
+                // STORE_GLOBAL * k, PUSH, LOAD_GLOBAL * k, CALL
+                int k = ins.operand;
+                int call = i + 2 * k + 1;
+                if ((int) stack.size() < k) fail("Operand stack underflow", i);
+                if (is_target[call]) fail("Jump into a call sequence", i);
+                flush_all();
+                int args = (int) stack.size() - k;
+                // functions are numbered by their entries, after the top level
+                int callee = 1 + (int) std::count_if(argc_of.begin(), argc_of.begin() + program.instructs[call].operand,
+                                                     [](int argc) { return argc >= 0; });
+                if (ins.code == TAIL_CALL && !top_level) {
+                    // the RET after the call is only reached by jumps
+                    emit(R_TAIL_CALL, callee, temp(args));
+                    stack.resize(args);
+                    reachable = false;
+                    return call;
+                }
+                emit(R_CALL, callee, temp(args), top_level ? 1 : 0);
+                stack.resize(args);
+                push(temp(args));
+                return call;
+            }
+            case RET:
+                if (top_level) fail("RET at the top level", i);
+                emit(R_RET, pop(i));
+                reachable = false;
+                break;
+            case HALT:
+                emit(R_HALT, 0);
+                reachable = false;
+                break;
+            case PRINTK:
+                emit(R_PRINTK, pop(i));
+                break;
+            case PUTCH:
+                emit(R_PUTCH, pop(i));
+                break;
+            case PUTS:
+                emit(R_PUTS, pop(i));
+                break;
+            case GETCH:
+                result(R_GETCH);
+                break;
+            default:
+                fail("No register form for instruction " + std::to_string(ins.code), i);
+        }
+        return i;
+    }
+
+    void translate_function(int start, int end) {
+        const std::vector<instruct> &instructs = program.instructs;
+        region_start = start;
+        region_end = end;
+        top_level = start == 0;
+        var_cnt = 0;
+        int argc = top_level ? 0 : argc_of[start];
+        int i = start;
+        if (instructs[i].code == VMALLOC || instructs[i].code == ENTER) {
+            if (is_target[i]) fail("Jump to VMALLOC", i);
+            if (!top_level) var_cnt = instructs[i].operand;
+            i++;
+        }
+        stack.clear();
+        max_depth = 0;
+        for (int d = 0; d < argc; d++) push(temp(d));
+        reg_function function{pc(), var_cnt, argc, 0};
+        bool reachable = true;
+        for (; i < end; i++) {
+            if (is_target[i]) {
+                if (reachable) {
+                    flush_all();
+                } else {
+                    if (depth_at[i] < 0) fail("Unknown operand stack depth", i);
+                    stack.clear();
+                    for (int d = 0; d < depth_at[i]; d++) push(temp(d));
+                    reachable = true;
+                }
+                if (depth_at[i] >= 0 && depth_at[i] != (int) stack.size()) fail("Inconsistent operand stack depth", i);
+                depth_at[i] = (int) stack.size();
+                last_def = -1;
+            } else if (!reachable) {
+                continue;
+            }
+            label[i] = pc();
+            if (instructs[i].code == VMALLOC || instructs[i].code == ENTER) fail("VMALLOC inside a function", i);
+            i = translate_instruct(i, reachable);
+        }
+        if (reachable) fail("Function without RET", end - 1);
+        function.frame_size = var_cnt + max_depth;
+        out.functions.push_back(function);
+    }
+
+public:
+    register_translator(const Program &_program, register_program &_out) : program(_program), out(_out) {}
+
+    // False if the program needs the stack engine, the reason is given then
+    bool translate(std::string &reason) {
+        const std::vector<instruct> &instructs = program.instructs;
+        int ins_cnt = program.size();
+        out = register_program();
+        label.assign(ins_cnt, -1);
+        depth_at.assign(ins_cnt, -1);
+        is_target.assign(ins_cnt, false);
+        argc_of.assign(ins_cnt, -1);
+        try {
+            if (!program.linked) throw untranslatable{"Program is not linked"};
+            std::vector<bool> called(ins_cnt, false);
+            for (int i = 0; i < ins_cnt; i++) {
+                if (Program::is_jump(instructs[i].code) && instructs[i].code != CALL) {
+                    is_target[instructs[i].operand] = true;
+                }
+                instruct_code code = instructs[i].code;
+                if (code != PUSH_ARGS && code != CALL_ARGS && code != TAIL_CALL) continue;
+                int k = instructs[i].operand;
+                int call = i + 2 * k + 1;
+                if (call >= ins_cnt || instructs[call].code != CALL) fail("PUSH without CALL", i);
+                int entry = instructs[call].operand;
+                if (entry == 0) fail("Call to the top level", call);
+                if (argc_of[entry] >= 0 && argc_of[entry] != k) fail("Function called with different argument counts", call);
+                argc_of[entry] = k;
+                called[call] = true;
+            }
+            for (int i = 0; i < ins_cnt; i++) {
+                if (instructs[i].code == CALL && !called[i]) fail("CALL without PUSH", i);
+            }
+            if (ins_cnt > 0 && instructs[0].code == VMALLOC) out.global_cnt = instructs[0].operand;
+            // functions are the regions between entries, the top level comes first
+            std::vector<int> entries{0};
+            for (int i = 1; i < ins_cnt; i++) {
+                if (argc_of[i] >= 0) entries.push_back(i);
+            }
+            for (int f = 0; f < (int) entries.size(); f++) {
+                translate_function(entries[f], f + 1 < (int) entries.size() ? entries[f + 1] : ins_cnt);
+            }
+            for (const auto &fixup : fixups) {
+                out.code[fixup.first].a = label[fixup.second];
+            }
+        } catch (const untranslatable &e) {
+            reason = e.reason;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Native code of one function of a register program, it can be entered at any of its instructions
+class jit_function {
+private:
+    typedef int (*entry_point)(slot *fp, slot *regs, const unsigned char *at);
+    unsigned char *code = nullptr;
+    size_t size = 0;
+    int first_pc;
+    std::vector<uint32_t> offsets; // Instruction -> its template
+
+public:
+    jit_function(const std::vector<unsigned char> &bytes, int _first_pc, std::vector<uint32_t> _offsets)
+            : size(bytes.size()), first_pc(_first_pc), offsets(std::move(_offsets)) {
+        // written before it is made executable, never both
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) panic("Cannot allocate native code");
+        memcpy(p, bytes.data(), size);
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) < 0) {
+            munmap(p, size);
+            panic("Cannot map native code");
+        }
+        code = static_cast<unsigned char *>(p);
+    }
+
+    jit_function(const jit_function &) = delete;
+
+    jit_function &operator=(const jit_function &) = delete;
+
+    ~jit_function() {
+        munmap(code, size);
+    }
+
+    // Runs from pc until an instruction the native code does not handle, which is returned
+    int run(slot *fp, slot *regs, int pc) const {
+        return reinterpret_cast<entry_point>(code)(fp, regs, code + offsets[pc - first_pc]);
+    }
+};
+
+#ifdef USE_JIT
+// Just enough x86-64 for the templates, memory operands are always [base + disp32]
+class x86_emitter {
+public:
+    enum reg {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R13 = 13
+    };
+    enum condition {
+        ALWAYS = -1, E = 0x4, NE = 0x5, L = 0xc, GE = 0xd, LE = 0xe, G = 0xf
+    };
+    std::vector<unsigned char> bytes;
+
+    int here() const {
+        return (int) bytes.size();
+    }
+
+    void emit(std::initializer_list<int> values) {
+        for (int b : values) bytes.push_back((unsigned char) b);
+    }
+
+    void dword(int32_t v) {
+        for (int i = 0; i < 4; i++) bytes.push_back((unsigned char) (v >> (8 * i)));
+    }
+
+    // op r, [base + disp], two byte opcodes are given as 0x0fxx (r is the opcode extension for one operand)
+    void op_mem(bool wide, int op, int r, int base, int32_t disp) {
+        int rex = 0x40 | (wide ? 8 : 0) | ((r >> 3) << 2) | (base >> 3);
+        if (rex != 0x40) bytes.push_back((unsigned char) rex);
+        if (op > 0xff) bytes.push_back((unsigned char) (op >> 8));
+        bytes.push_back((unsigned char) op);
+        bytes.push_back((unsigned char) (0x80 | ((r & 7) << 3) | (base & 7)));
+        if ((base & 7) == RSP) bytes.push_back(0x24);
+        dword(disp);
+    }
+
+    // rel32 jump, the position of its displacement is returned for bind()
+    int jump(condition cc) {
+        if (cc == ALWAYS) {
+            emit({0xe9});
+        } else {
+            emit({0x0f, 0x80 | cc});
+        }
+        dword(0);
+        return here() - 4;
+    }
+
+    void bind(int at, int target) {
+        int32_t rel = target - (at + 4);
+        memcpy(&bytes[at], &rel, sizeof(rel));
+    }
+};
+
+/*
+ * Baseline compiler: each register instruction becomes a fixed template working on the slots in memory, so the
+ * interpreter can take over at any instruction. Templates handle ints (and int arrays) only, other types and all
+ * other instructions leave the native code before any side effect, returning the instruction to interpret.
+ */
+class jit_compiler {
+private:
+    typedef x86_emitter x86;
+    x86 x;
+    std::vector<std::pair<int, int>> exits; // Displacement -> instruction to interpret
+    std::vector<std::pair<int, int>> branches; // Displacement -> jump target
+    static const int SLOT_SIZE = sizeof(slot);
+
+    static int base(int r) {
+        return r >= 0 ? x86::RBX : x86::R13;
+    }
+
+    static int disp(int r) {
+        return SLOT_SIZE * (r >= 0 ? r : ~r);
+    }
+
+    static int value(int r) {
+        return disp(r) + (int) offsetof(slot, int_val);
+    }
+
+    void exit_if(x86::condition cc, int pc) {
+        exits.emplace_back(x.jump(cc), pc);
+    }
+
+    void check_type(int r, int type) {
+        x.op_mem(false, 0x83, 7, base(r), disp(r));
+        x.emit({type});
+    }
+
+    void guard_int(int r, int pc) {
+        check_type(r, INT);
+        exit_if(x86::NE, pc);
+    }
+
+    // A register holding an array needs a decref when overwritten, which is left to the interpreter
+    void guard_scalar(int r, int pc) {
+        check_type(r, ARRAY);
+        exit_if(x86::E, pc);
+    }
+
+    void load(int reg, int r) {
+        x.op_mem(true, 0x8b, reg, base(r), value(r));
+    }
+
+    // dst = slot(rax)
+    void store_int(int r) {
+        x.op_mem(false, 0xc7, 0, base(r), disp(r));
+        x.dword(INT);
+        x.op_mem(true, 0x89, x86::RAX, base(r), value(r));
+    }
+
+    // rax = arr->elements with rcx = subscr, bounds and element type checked
+    void element_address(int arr, int subscr, int pc) {
+        load(x86::RAX, arr);
+        x.op_mem(false, 0x83, 7, x86::RAX, (int) offsetof(array, element_type));
+        x.emit({INT});
+        exit_if(x86::NE, pc);
+        x.op_mem(true, 0x63, x86::RCX, base(subscr), value(subscr));
+        x.emit({0x85, 0xc9}); // test ecx, ecx
+        exit_if(x86::L, pc);
+        x.op_mem(false, 0x3b, x86::RCX, x86::RAX, (int) offsetof(array, array_size));
+        exit_if(x86::GE, pc);
+        x.op_mem(true, 0x8b, x86::RAX, x86::RAX, (int) offsetof(array, elements));
+    }
+
+    static x86::condition condition_of(reg_code code) {
+        switch (code) {
+            case R_LT:
+                return x86::L;
+            case R_LE:
+                return x86::LE;
+            case R_GT:
+                return x86::G;
+            case R_GE:
+                return x86::GE;
+            case R_EQ:
+                return x86::E;
+            default:
+                return x86::NE;
+        }
+    }
+
+    void compile(const reg_instruct &ri, int pc) {
+        switch (ri.code) {
+            case R_MOVE:
+                guard_scalar(ri.b, pc);
+                guard_scalar(ri.a, pc);
+                x.op_mem(false, 0x0f10, 0, base(ri.b), disp(ri.b)); // movups xmm0
+                x.op_mem(false, 0x0f11, 0, base(ri.a), disp(ri.a));
+                break;
+            case R_ADD:
+            case R_SUB:
+            case R_MUL:
+            case R_AND:
+            case R_OR:
+            case R_XOR: {
+                guard_int(ri.b, pc);
+                guard_int(ri.c, pc);
+                guard_scalar(ri.a, pc);
+                load(x86::RAX, ri.b);
+                // bitwise operators work on unsigned ints, the 32 bit forms clear the upper half
+                bool wide = ri.code == R_ADD || ri.code == R_SUB || ri.code == R_MUL;
+                int op = ri.code == R_ADD ? 0x03 : ri.code == R_SUB ? 0x2b : ri.code == R_MUL ? 0x0faf
+                       : ri.code == R_AND ? 0x23 : ri.code == R_OR ? 0x0b : 0x33;
+                x.op_mem(wide, op, x86::RAX, base(ri.c), value(ri.c));
+                store_int(ri.a);
+                break;
+            }
+            case R_DIV:
+            case R_MOD:
+                guard_int(ri.b, pc);
+                guard_int(ri.c, pc);
+                guard_scalar(ri.a, pc);
+                // division by zero panics in the interpreter, and idiv would trap on the most negative int by -1
+                x.op_mem(true, 0x83, 7, base(ri.c), value(ri.c));
+                x.emit({0});
+                exit_if(x86::E, pc);
+                x.op_mem(true, 0x83, 7, base(ri.c), value(ri.c));
+                x.emit({0xff});
+                exit_if(x86::E, pc);
+                load(x86::RAX, ri.b);
+                x.emit({0x48, 0x99}); // cqo
+                x.op_mem(true, 0xf7, 7, base(ri.c), value(ri.c)); // idiv
+                if (ri.code == R_MOD) x.emit({0x48, 0x89, 0xd0}); // mov rax, rdx
+                store_int(ri.a);
+                break;
+            case R_LT:
+            case R_LE:
+            case R_GT:
+            case R_GE:
+            case R_EQ:
+            case R_NE:
+                guard_int(ri.b, pc);
+                guard_int(ri.c, pc);
+                guard_scalar(ri.a, pc);
+                load(x86::RAX, ri.b);
+                x.op_mem(true, 0x3b, x86::RAX, base(ri.c), value(ri.c));
+                x.emit({0x0f, 0x90 | condition_of(ri.code), 0xc0}); // setcc al
+                x.emit({0x0f, 0xb6, 0xc0}); // movzx eax, al
+                store_int(ri.a);
+                break;
+            case R_NOT:
+                guard_int(ri.b, pc);
+                guard_scalar(ri.a, pc);
+                x.op_mem(true, 0x83, 7, base(ri.b), value(ri.b));
+                x.emit({0});
+                x.emit({0x0f, 0x94, 0xc0}); // sete al
+                x.emit({0x0f, 0xb6, 0xc0});
+                store_int(ri.a);
+                break;
+            case R_NEG:
+                guard_int(ri.b, pc);
+                guard_scalar(ri.a, pc);
+                load(x86::RAX, ri.b);
+                x.emit({0x48, 0xf7, 0xd8}); // neg rax
+                store_int(ri.a);
+                break;
+            case R_INC:
+            case R_DEC:
+                guard_int(ri.a, pc);
+                x.op_mem(true, 0x83, ri.code == R_INC ? 0 : 5, base(ri.a), value(ri.a));
+                x.emit({1});
+                break;
+            case R_LOAD_ELEM:
+                check_type(ri.b, ARRAY);
+                exit_if(x86::NE, pc);
+                guard_int(ri.c, pc);
+                guard_scalar(ri.a, pc);
+                element_address(ri.b, ri.c, pc);
+                x.emit({0x48, 0x8b, 0x04, 0xc8}); // mov rax, [rax + rcx * 8]
+                store_int(ri.a);
+                break;
+            case R_STORE_ELEM:
+                check_type(ri.a, ARRAY);
+                exit_if(x86::NE, pc);
+                guard_int(ri.b, pc);
+                guard_int(ri.c, pc);
+                element_address(ri.a, ri.b, pc);
+                load(x86::RDX, ri.c);
+                x.emit({0x48, 0x89, 0x14, 0xc8}); // mov [rax + rcx * 8], rdx
+                break;
+            case R_JMP:
+                branches.emplace_back(x.jump(x86::ALWAYS), ri.a);
+                break;
+            case R_JMP_TRUE:
+            case R_JMP_FALSE:
+                // a condition of another type is never true, the interpreter takes it
+                guard_int(ri.b, pc);
+                x.op_mem(true, 0x83, 7, base(ri.b), value(ri.b));
+                x.emit({0});
+                branches.emplace_back(x.jump(ri.code == R_JMP_TRUE ? x86::NE : x86::E), ri.a);
+                break;
+            case R_JMP_UNLESS_LT:
+            case R_JMP_UNLESS_LE:
+            case R_JMP_UNLESS_GT:
+            case R_JMP_UNLESS_GE: {
+                static const x86::condition unless[] = {x86::GE, x86::G, x86::LE, x86::L};
+                guard_int(ri.b, pc);
+                guard_int(ri.c, pc);
+                load(x86::RAX, ri.b);
+                x.op_mem(true, 0x3b, x86::RAX, base(ri.c), value(ri.c));
+                branches.emplace_back(x.jump(unless[ri.code - R_JMP_UNLESS_LT]), ri.a);
+                break;
+            }
+            default:
+                // calls, I/O, allocations and the rest are interpreted
+                exit_if(x86::ALWAYS, pc);
+                break;
+        }
+    }
+
+public:
+    // Instructions [first, last) of a register program
+    std::unique_ptr<jit_function> compile(const std::vector<reg_instruct> &code, int first, int last) {
+        static_assert(sizeof(slot) == 16 && offsetof(slot, int_val) == 8, "Unexpected slot layout");
+        // entry(fp, regs, at): rbx = fp, r13 = regs, then jump to the template at
+        x.emit({0x53, 0x41, 0x55}); // push rbx, push r13
+        x.emit({0x48, 0x89, 0xfb, 0x49, 0x89, 0xf5}); // mov rbx, rdi, mov r13, rsi
+        x.emit({0xff, 0xe2}); // jmp rdx
+        std::vector<uint32_t> offsets;
+        for (int pc = first; pc < last; pc++) {
+            offsets.push_back((uint32_t) x.here());
+            compile(code[pc], pc);
+        }
+        for (const auto &branch : branches) {
+            x.bind(branch.first, (int) offsets[branch.second - first]);
+        }
+        // one exit stub per instruction: eax = pc, then the epilogue
+        int epilogue = x.here();
+        x.emit({0x41, 0x5d, 0x5b, 0xc3}); // pop r13, pop rbx, ret
+        std::unordered_map<int, int> stubs;
+        for (const auto &exit : exits) {
+            auto stub = stubs.find(exit.second);
+            if (stub == stubs.end()) {
+                stub = stubs.emplace(exit.second, x.here()).first;
+                x.emit({0xb8});
+                x.dword(exit.second);
+                x.bind(x.jump(x86::ALWAYS), epilogue);
+            }
+            x.bind(exit.first, stub->second);
+        }
+        return std::unique_ptr<jit_function>(new jit_function(x.bytes, first, std::move(offsets)));
+    }
+};
+#endif
+
+// Clock of the profiler, the time stamp counter where there is one
+#if defined(__x86_64__)
+#define PROFILE_UNIT "cycles"
+
+inline uint64_t profile_clock() {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define PROFILE_UNIT "ns"
+
+inline uint64_t profile_clock() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// Costs of a stack engine run by opcode, instruction and function, an instruction lasts until the next one starts
+class profiler {
+private:
+    struct opcode_stats {
+        uint64_t count = 0;
+        uint64_t time = 0;
+    };
+
+    struct function_stats {
+        uint64_t calls = 0;
+        uint64_t inclusive = 0; // Recursive calls are only counted in the outermost one
+        uint64_t exclusive = 0;
+        int active = 0;
+    };
+
+    // A running call, the function is -1 between PUSH and its CALL
+    struct activation {
+        int function;
+        uint64_t start;
+    };
+
+    std::vector<opcode_stats> opcodes;
+    std::vector<uint64_t> hits; // Instruction -> executions
+    std::vector<function_stats> functions; // Entry instruction -> its calls, the top level is 0
+    std::vector<activation> calls;
+    int last_ip = -1;
+    instruct_code last_code = NOOP;
+    uint64_t last = 0;
+
+    void enter(int function, uint64_t now) {
+        calls.push_back({function, now});
+        if (function >= 0) {
+            functions[function].calls++;
+            functions[function].active++;
+        }
+    }
+
+    void leave(uint64_t now) {
+        activation call = calls.back();
+        calls.pop_back();
+        if (call.function >= 0 && --functions[call.function].active == 0) {
+            functions[call.function].inclusive += now - call.start;
+        }
+    }
+
+    // The time since the last instruction started is its cost
+    void account(uint64_t now) {
+        if (last_ip < 0) return;
+        uint64_t delta = now - last;
+        opcodes[last_code].time += delta;
+        if (calls.back().function >= 0) functions[calls.back().function].exclusive += delta;
+    }
+
+    template<typename T>
+    std::vector<int> ranked(const std::vector<T> &stats, uint64_t T::*key) const {
+        std::vector<int> order;
+        for (int i = 0; i < (int) stats.size(); i++) {
+            if (stats[i].*key) order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&stats, key](int a, int b) {
+            return stats[a].*key > stats[b].*key;
+        });
+        return order;
+    }
+
+    std::vector<int> hot_instructions() const {
+        std::vector<int> order;
+        for (int i = 0; i < (int) hits.size(); i++) {
+            if (hits[i]) order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return hits[a] > hits[b]; });
+        return order;
+    }
+
+public:
+    void start(int ins_cnt) {
+        opcodes.assign(INSTRUCT_CODE_NUM, opcode_stats());
+        hits.assign(ins_cnt, 0);
+        functions.assign(ins_cnt, function_stats());
+        calls.clear();
+        last_ip = -1;
+        enter(0, profile_clock());
+    }
+
+    // Before the instruction at ip runs, depth is the number of frames then
+    void step(int ip, instruct_code code, int depth) {
+        uint64_t now = profile_clock();
+        account(now);
+        if (last_code == TAIL_CALL && depth + 1 == (int) calls.size()) {
+            // the frame was reused by the callee
+            leave(now);
+            enter(ip, now);
+        }
+        while ((int) calls.size() > depth + 1) leave(now);
+        while ((int) calls.size() < depth + 1) enter(last_code == CALL_ARGS || last_code == TAIL_CALL ? ip : -1, now);
+        if (last_code == CALL && calls.back().function < 0) {
+            // the frame was pushed by PUSH, the callee is known now
+            calls.back().function = ip;
+            functions[ip].calls++;
+            functions[ip].active++;
+        }
+        hits[ip]++;
+        opcodes[code].count++;
+        last_ip = ip;
+        last_code = code;
+        last = now;
+    }
+
+    // When the machine stops, the calls still running end here
+    void finish() {
+        uint64_t now = profile_clock();
+        account(now);
+        last_ip = -1;
+        while (!calls.empty()) leave(now);
+    }
+
+    // Tables sorted by cost, names are indexed by instruction code
+    void report(std::ostream &out, const Program &program, const std::string *names) const {
+        const int hot_limit = 20;
+        out << "<<<<<* Profile (" PROFILE_UNIT ") *>>>>>" << std::endl;
+        out << std::left << std::setw(28) << "Opcode" << std::right << std::setw(14) << "Count" << std::setw(18)
+            << "Time" << std::setw(10) << "Share" << std::setw(12) << "Per exec" << std::endl;
+        uint64_t total = 0;
+        for (const auto &op : opcodes) total += op.time;
+        for (int code : ranked(opcodes, &opcode_stats::time)) {
+            const opcode_stats &op = opcodes[code];
+            out << std::left << std::setw(28) << names[code] << std::right << std::setw(14) << op.count
+                << std::setw(18) << op.time << std::setw(9) << std::fixed << std::setprecision(2)
+                << (total ? 100.0 * op.time / total : 0.0) << "%" << std::setw(12) << std::setprecision(1)
+                << (double) op.time / op.count << std::endl;
+        }
+        out << std::left << std::setw(28) << "Address" << std::right << std::setw(14) << "Hits" << std::endl;
+        std::vector<int> hot = hot_instructions();
+        for (int k = 0; k < (int) hot.size() && k < hot_limit; k++) {
+            const instruct &ins = program.instructs[hot[k]];
+            std::string where = std::to_string(ins.address) + " " + names[ins.code];
+            out << std::left << std::setw(28) << where << std::right << std::setw(14) << hits[hot[k]] << std::endl;
+        }
+        out << std::left << std::setw(28) << "Function" << std::right << std::setw(14) << "Calls" << std::setw(18)
+            << "Inclusive" << std::setw(18) << "Exclusive" << std::endl;
+        for (int entry : ranked(functions, &function_stats::inclusive)) {
+            const function_stats &f = functions[entry];
+            std::string where = entry == 0 ? "top level" : "address " + std::to_string(program.instructs[entry].address);
+            out << std::left << std::setw(28) << where << std::right << std::setw(14) << f.calls << std::setw(18)
+                << f.inclusive << std::setw(18) << f.exclusive << std::endl;
+        }
+        out.unsetf(std::ios::floatfield);
+    }
+
+    // JSON if the path ends with .json, CSV otherwise
+    void dump(const std::string &path, const Program &program, const std::string *names) const {
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        if (!file) panic("Cannot open " + path);
+        bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        std::vector<int> hot = hot_instructions();
+        if (!json) {
+            file << "kind,key,count,time,exclusive" << std::endl;
+            for (int code : ranked(opcodes, &opcode_stats::time)) {
+                file << "opcode," << names[code] << "," << opcodes[code].count << "," << opcodes[code].time << ","
+                     << std::endl;
+            }
+            for (int i : hot) file << "address," << program.instructs[i].address << "," << hits[i] << ",," << std::endl;
+            for (int entry : ranked(functions, &function_stats::inclusive)) {
+                file << "function," << program.instructs[entry].address << "," << functions[entry].calls << ","
+                     << functions[entry].inclusive << "," << functions[entry].exclusive << std::endl;
+            }
+            return;
+        }
+        const char *separator = "";
+        file << "{\"unit\": \"" PROFILE_UNIT "\", \"opcodes\": [";
+        for (int code : ranked(opcodes, &opcode_stats::time)) {
+            file << separator << "{\"opcode\": \"" << names[code] << "\", \"count\": " << opcodes[code].count
+                 << ", \"time\": " << opcodes[code].time << "}";
+            separator = ", ";
+        }
+        separator = "";
+        file << "], \"addresses\": [";
+        for (int i : hot) {
+            file << separator << "{\"address\": " << program.instructs[i].address << ", \"opcode\": \""
+                 << names[program.instructs[i].code] << "\", \"hits\": " << hits[i] << "}";
+            separator = ", ";
+        }
+        separator = "";
+        file << "], \"functions\": [";
+        for (int entry : ranked(functions, &function_stats::inclusive)) {
+            file << separator << "{\"entry\": " << program.instructs[entry].address << ", \"top_level\": "
+                 << (entry == 0 ? "true" : "false") << ", \"calls\": " << functions[entry].calls
+                 << ", \"inclusive\": " << functions[entry].inclusive << ", \"exclusive\": "
+                 << functions[entry].exclusive << "}";
+            separator = ", ";
+        }
+        file << "]}" << std::endl;
+    }
+};
+
+// Set by the profiling timer, the sampling loop takes a sample at the next dispatch
+volatile std::sig_atomic_t sample_due = 0;
+
+void request_sample(int) {
+    sample_due = 1;
+}
+
+// Statistical profiler, a timer of CPU time asks for samples of the running call stack
+class sampler {
+private:
+    std::map<std::vector<int>, uint64_t> stacks; // Entries of the running functions and the instruction -> samples
+    uint64_t total = 0;
+    struct sigaction previous{};
+
+public:
+    // The timer is process wide, so only one machine samples at a time
+    void start(int interval_us) {
+        stacks.clear();
+        total = 0;
+        sample_due = 0;
+        struct sigaction action{};
+        action.sa_handler = request_sample;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &previous);
+        itimerval timer{};
+        timer.it_interval.tv_usec = interval_us;
+        timer.it_value.tv_usec = interval_us;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    void stop() {
+        itimerval timer{};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &previous, nullptr);
+    }
+
+    void record(std::vector<int> &&stack) {
+        sample_due = 0;
+        stacks[std::move(stack)]++;
+        total++;
+    }
+
+    uint64_t samples() const {
+        return total;
+    }
+
+    // Folded stacks, one "frame;frame;leaf count" line per stack, as read by flamegraph.pl and speedscope
+    void write(const std::string &path, const Program &program, const std::string *names) const {
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        if (!file) panic("Cannot open " + path);
+        for (const auto &sample : stacks) {
+            const std::vector<int> &stack = sample.first;
+            file << "top";
+            for (size_t i = 1; i + 1 < stack.size(); i++) {
+                if (stack[i] < 0) {
+                    file << ";func@?";
+                } else {
+                    file << ";func@" << program.instructs[stack[i]].address;
+                }
+            }
+            const instruct &leaf = program.instructs[stack.back()];
+            file << ";" << names[leaf.code] << "@" << leaf.address << " " << sample.second << std::endl;
+        }
+    }
+};
+
+// Virtual Machine
+class Machine {
+private:
+    std::shared_ptr<const Program> code;
+    std::vector<instruct> instructions; // Private copy of the code, rewritten by quickening
+    std::istream *in = &std::cin; // GETCH and PUTCH/PRINTK, the verbose debugger always uses the console
+    std::ostream *out = &std::cout;
+    output_buffer output{&std::cout};
+    T_VARIABLES globals{};
+    int var_cnt = 0;
+    frame *esp{}; // The last of frames, nullptr at the top level
+    std::vector<frame> frames; // Frames of the running calls, preallocated for INITIAL_FRAME_NUM nested calls
+    int ip{};
+    bool verbose = false;
+    bool evaluator = false;
+    std::string profile_path; // Profiling runs on the stack engine, the profile is also written here if not empty
+    bool profiling = false;
+    profiler profile;
+    std::string samples_path; // Folded stacks of the sampling profiler, no sampling if empty
+    sampler samples;
+    bool register_engine = false;
+    register_program registers; // Translated from the code when the register engine runs
+    bool jit = false;
+    std::vector<std::unique_ptr<jit_function>> native; // Compiled functions of the register program
+    std::vector<int> hotness; // Calls and backward jumps seen before a function is compiled
+    long long int n_ins = 0;
+    slot_stack stack{INITIAL_STACK_SIZE}; // Locals and operands of all frames
+    slot_stack global_operands{INITIAL_STACK_SIZE}; // Top-level operands, also used by STORE_GLOBAL and LOAD_GLOBAL
+    slot_stack *operands = &global_operands;
+    T_VARIABLES locals{}; // Locals of the current frame, a pointer into the stack
+    object_pool<array, 256> array_pool;
+    buffer_allocator array_buffers;
+    memory_stats memory;
+    bool memory_report = false; // Printed when the program halts
+    char *image{}; // Snapshot the machine was restored from, mapped copy-on-write
+    size_t image_size = 0;
+    uintptr_t image_elements = 0; // Array elements restored from the image stay in it
+    uintptr_t image_end = 0;
+    resource_limits limits;
+    long long instruction_budget = std::numeric_limits<long long>::max(); // Executions before limits.instructions
+    bool slicing = false; // Run by resume(), which returns when the slice is over or GETCH would block
+    bool input_closed = false;
+    dispatch_status status = YIELDED;
+
+public:
+    static std::unordered_map<std::string, instruct_code> string_inscode_mapping;
+    static std::unordered_map<std::string, instruct_code> internal_inscode_mapping;
+    static int inscode_param_cnt_mapping[200];
+    static std::string code_names[INSTRUCT_CODE_NUM]; // Instruction code -> name, for debugging output
+
+    static void load_name_code_mapping() {
+        string_inscode_mapping["CMALLOC"] = CMALLOC;
+        string_inscode_mapping["VMALLOC"] = VMALLOC;
+        string_inscode_mapping["CONSTANT"] = CONSTANT;
+        string_inscode_mapping["LOAD_CONSTANT"] = LOAD_CONSTANT;
+        string_inscode_mapping["POP_OP"] = POP_OP;
+        string_inscode_mapping["NOOP"] = NOOP;
+        string_inscode_mapping["LOAD_NULL"] = LOAD_NULL;
+        string_inscode_mapping["LOAD_NAME"] = LOAD_NAME;
+        string_inscode_mapping["LOAD_NAME_GLOBAL"] = LOAD_NAME_GLOBAL;
+        string_inscode_mapping["LOAD_INT"] = LOAD_INT;
+        string_inscode_mapping["LOAD_FLOAT"] = LOAD_FLOAT;
+        string_inscode_mapping["LOAD_CHAR"] = LOAD_CHAR;
+        string_inscode_mapping["STORE_NAME"] = STORE_NAME;
+        string_inscode_mapping["STORE_NAME_GLOBAL"] = STORE_NAME_GLOBAL;
+        string_inscode_mapping["STORE_NAME_NOPOP"] = STORE_NAME_NOPOP;
+        string_inscode_mapping["STORE_NAME_GLOBAL_NOPOP"] = STORE_NAME_GLOBAL_NOPOP;
+        string_inscode_mapping["JMP"] = JMP;
+        string_inscode_mapping["JMP_TRUE"] = JMP_TRUE;
+        string_inscode_mapping["JMP_FALSE"] = JMP_FALSE;
+        string_inscode_mapping["BINARY_OP"] = BINARY_OP;
+        string_inscode_mapping["UNARY_OP"] = UNARY_OP;
+        string_inscode_mapping["HALT"] = HALT;
+        string_inscode_mapping["RET"] = RET;
+        string_inscode_mapping["PUSH"] = PUSH;
+        string_inscode_mapping["CALL"] = CALL;
+        string_inscode_mapping["LOAD_GLOBAL"] = LOAD_GLOBAL;
+        string_inscode_mapping["STORE_GLOBAL"] = STORE_GLOBAL;
+        string_inscode_mapping["BUILD_ARR"] = BUILD_ARR;
+        string_inscode_mapping["TYPE_CVT"] = TYPE_CVT;
+        string_inscode_mapping["BINARY_SUBSCR"] = BINARY_SUBSCR;
+        string_inscode_mapping["STORE_SUBSCR"] = STORE_SUBSCR;
+        string_inscode_mapping["STORE_SUBSCR_INPLACE"] = STORE_SUBSCR_INPLACE;
+        string_inscode_mapping["STORE_SUBSCR_NOPOP"] = STORE_SUBSCR_NOPOP;
+        string_inscode_mapping["PRINTK"] = PRINTK;
+        string_inscode_mapping["PUTCH"] = PUTCH;
+        string_inscode_mapping["GETCH"] = GETCH;
+        string_inscode_mapping["SIZE_OF"] = SIZE_OF;
+        string_inscode_mapping["ARR_FILL"] = ARR_FILL;
+        string_inscode_mapping["ARR_COPY"] = ARR_COPY;
+        string_inscode_mapping["ARR_ADD"] = ARR_ADD;
+        string_inscode_mapping["ARR_MUL"] = ARR_MUL;
+        string_inscode_mapping["ARR_SUM"] = ARR_SUM;
+        string_inscode_mapping["ARR_MIN"] = ARR_MIN;
+        string_inscode_mapping["ARR_MAX"] = ARR_MAX;
+        string_inscode_mapping["ARR_DOT"] = ARR_DOT;
+        string_inscode_mapping["PUTS"] = PUTS;
+        // not accepted by the assembler, only used for debugging output
+        internal_inscode_mapping["INC_NAME"] = INC_NAME;
+        internal_inscode_mapping["DEC_NAME"] = DEC_NAME;
+        internal_inscode_mapping["INC_NAME_GLOBAL"] = INC_NAME_GLOBAL;
+        internal_inscode_mapping["DEC_NAME_GLOBAL"] = DEC_NAME_GLOBAL;
+        internal_inscode_mapping["INC_SUBSCR"] = INC_SUBSCR;
+        internal_inscode_mapping["DEC_SUBSCR"] = DEC_SUBSCR;
+        internal_inscode_mapping["PUSH_ARGS"] = PUSH_ARGS;
+        internal_inscode_mapping["CALL_ARGS"] = CALL_ARGS;
+        internal_inscode_mapping["ENTER"] = ENTER;
+        internal_inscode_mapping["TAIL_CALL"] = TAIL_CALL;
+        internal_inscode_mapping["ADD"] = ADD;
+        internal_inscode_mapping["SUB"] = SUB;
+        internal_inscode_mapping["MUL"] = MUL;
+        internal_inscode_mapping["MOD"] = MOD;
+        internal_inscode_mapping["DIV"] = DIV;
+        internal_inscode_mapping["AND"] = AND;
+        internal_inscode_mapping["OR"] = OR;
+        internal_inscode_mapping["SHL"] = SHL;
+        internal_inscode_mapping["SHR"] = SHR;
+        internal_inscode_mapping["XOR"] = XOR;
+        internal_inscode_mapping["LT"] = LT;
+        internal_inscode_mapping["LE"] = LE;
+        internal_inscode_mapping["GT"] = GT;
+        internal_inscode_mapping["GE"] = GE;
+        internal_inscode_mapping["EQ"] = EQ;
+        internal_inscode_mapping["NE"] = NE;
+        internal_inscode_mapping["NOT"] = NOT;
+        internal_inscode_mapping["NEG"] = NEG;
+        internal_inscode_mapping["CVT_INT"] = CVT_INT;
+        internal_inscode_mapping["CVT_FLOAT"] = CVT_FLOAT;
+        internal_inscode_mapping["CVT_CHAR"] = CVT_CHAR;
+        internal_inscode_mapping["ADD_INT_INT"] = ADD_INT_INT;
+        internal_inscode_mapping["SUB_INT_INT"] = SUB_INT_INT;
+        internal_inscode_mapping["MUL_INT_INT"] = MUL_INT_INT;
+        internal_inscode_mapping["DIV_INT_INT"] = DIV_INT_INT;
+        internal_inscode_mapping["MOD_INT_INT"] = MOD_INT_INT;
+        internal_inscode_mapping["LT_INT_INT"] = LT_INT_INT;
+        internal_inscode_mapping["LE_INT_INT"] = LE_INT_INT;
+        internal_inscode_mapping["GT_INT_INT"] = GT_INT_INT;
+        internal_inscode_mapping["GE_INT_INT"] = GE_INT_INT;
+        internal_inscode_mapping["EQ_INT_INT"] = EQ_INT_INT;
+        internal_inscode_mapping["NE_INT_INT"] = NE_INT_INT;
+        internal_inscode_mapping["ADD_FLOAT_FLOAT"] = ADD_FLOAT_FLOAT;
+        internal_inscode_mapping["SUB_FLOAT_FLOAT"] = SUB_FLOAT_FLOAT;
+        internal_inscode_mapping["MUL_FLOAT_FLOAT"] = MUL_FLOAT_FLOAT;
+        internal_inscode_mapping["DIV_FLOAT_FLOAT"] = DIV_FLOAT_FLOAT;
+        internal_inscode_mapping["LT_FLOAT_FLOAT"] = LT_FLOAT_FLOAT;
+        internal_inscode_mapping["LE_FLOAT_FLOAT"] = LE_FLOAT_FLOAT;
+        internal_inscode_mapping["GT_FLOAT_FLOAT"] = GT_FLOAT_FLOAT;
+        internal_inscode_mapping["GE_FLOAT_FLOAT"] = GE_FLOAT_FLOAT;
+        internal_inscode_mapping["ADD_LOCAL_IMM"] = ADD_LOCAL_IMM;
+        internal_inscode_mapping["SUB_LOCAL_IMM"] = SUB_LOCAL_IMM;
+        internal_inscode_mapping["ADD_GLOBAL_IMM"] = ADD_GLOBAL_IMM;
+        internal_inscode_mapping["SUB_GLOBAL_IMM"] = SUB_GLOBAL_IMM;
+        internal_inscode_mapping["CMP_LT_JMP_FALSE_LOCALS"] = CMP_LT_JMP_FALSE_LOCALS;
+        internal_inscode_mapping["CMP_LE_JMP_FALSE_LOCALS"] = CMP_LE_JMP_FALSE_LOCALS;
+        internal_inscode_mapping["CMP_GT_JMP_FALSE_LOCALS"] = CMP_GT_JMP_FALSE_LOCALS;
+        internal_inscode_mapping["CMP_GE_JMP_FALSE_LOCALS"] = CMP_GE_JMP_FALSE_LOCALS;
+        internal_inscode_mapping["CMP_LT_JMP_FALSE_GLOBALS"] = CMP_LT_JMP_FALSE_GLOBALS;
+        internal_inscode_mapping["CMP_LE_JMP_FALSE_GLOBALS"] = CMP_LE_JMP_FALSE_GLOBALS;
+        internal_inscode_mapping["CMP_GT_JMP_FALSE_GLOBALS"] = CMP_GT_JMP_FALSE_GLOBALS;
+        internal_inscode_mapping["CMP_GE_JMP_FALSE_GLOBALS"] = CMP_GE_JMP_FALSE_GLOBALS;
+        internal_inscode_mapping["LOAD_ELEM_LOCAL"] = LOAD_ELEM_LOCAL;
+        internal_inscode_mapping["LOAD_ELEM_GLOBAL"] = LOAD_ELEM_GLOBAL;
+        internal_inscode_mapping["BREAK"] = BREAK;
+        for (const auto &x : string_inscode_mapping) code_names[x.second] = x.first;
+        for (const auto &x : internal_inscode_mapping) code_names[x.second] = x.first;
+    }
+
+    static void load_param_mapping() {
+        inscode_param_cnt_mapping[VMALLOC] = 1;
+        inscode_param_cnt_mapping[CMALLOC] = 1;
+        inscode_param_cnt_mapping[POP_OP] = 0;
+        inscode_param_cnt_mapping[NOOP] = 0;
+        inscode_param_cnt_mapping[LOAD_NULL] = 0;
+        inscode_param_cnt_mapping[LOAD_CONSTANT] = 1;
+        inscode_param_cnt_mapping[LOAD_NAME] = 1;
+        inscode_param_cnt_mapping[LOAD_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[LOAD_INT] = 1;
+        inscode_param_cnt_mapping[LOAD_FLOAT] = 1;
+        inscode_param_cnt_mapping[LOAD_CHAR] = 1;
+        inscode_param_cnt_mapping[STORE_NAME] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_NOPOP] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[STORE_NAME_GLOBAL_NOPOP] = 1;
+        inscode_param_cnt_mapping[JMP] = 1;
+        inscode_param_cnt_mapping[JMP_TRUE] = 1;
+        inscode_param_cnt_mapping[JMP_FALSE] = 1;
+        inscode_param_cnt_mapping[BINARY_OP] = 1;
+        inscode_param_cnt_mapping[UNARY_OP] = 1;
+        inscode_param_cnt_mapping[HALT] = 0;
+        inscode_param_cnt_mapping[RET] = 0;
+        inscode_param_cnt_mapping[PUSH] = 0;
+        inscode_param_cnt_mapping[CALL] = 1;
+        inscode_param_cnt_mapping[LOAD_GLOBAL] = 0;
+        inscode_param_cnt_mapping[STORE_GLOBAL] = 0;
+        inscode_param_cnt_mapping[BUILD_ARR] = 1;
+        inscode_param_cnt_mapping[TYPE_CVT] = 1;
+        inscode_param_cnt_mapping[BINARY_SUBSCR] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR_INPLACE] = 0;
+        inscode_param_cnt_mapping[STORE_SUBSCR_NOPOP] = 0;
+        inscode_param_cnt_mapping[PRINTK] = 0;
+        inscode_param_cnt_mapping[PUTCH] = 0;
+        inscode_param_cnt_mapping[GETCH] = 0;
+        inscode_param_cnt_mapping[SIZE_OF] = 0;
+        inscode_param_cnt_mapping[ARR_FILL] = 0;
+        inscode_param_cnt_mapping[ARR_COPY] = 0;
+        inscode_param_cnt_mapping[ARR_ADD] = 0;
+        inscode_param_cnt_mapping[ARR_MUL] = 0;
+        inscode_param_cnt_mapping[ARR_SUM] = 0;
+        inscode_param_cnt_mapping[ARR_MIN] = 0;
+        inscode_param_cnt_mapping[ARR_MAX] = 0;
+        inscode_param_cnt_mapping[ARR_DOT] = 0;
+        inscode_param_cnt_mapping[PUTS] = 0;
+        inscode_param_cnt_mapping[INC_NAME] = 1;
+        inscode_param_cnt_mapping[DEC_NAME] = 1;
+        inscode_param_cnt_mapping[INC_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[DEC_NAME_GLOBAL] = 1;
+        inscode_param_cnt_mapping[INC_SUBSCR] = 0;
+        inscode_param_cnt_mapping[DEC_SUBSCR] = 0;
+        inscode_param_cnt_mapping[PUSH_ARGS] = 1;
+        inscode_param_cnt_mapping[CALL_ARGS] = 1;
+        inscode_param_cnt_mapping[ENTER] = 1;
+        inscode_param_cnt_mapping[TAIL_CALL] = 1;
+        inscode_param_cnt_mapping[ADD] = 0;
+        inscode_param_cnt_mapping[SUB] = 0;
+        inscode_param_cnt_mapping[MUL] = 0;
+        inscode_param_cnt_mapping[MOD] = 0;
+        inscode_param_cnt_mapping[DIV] = 0;
+        inscode_param_cnt_mapping[AND] = 0;
+        inscode_param_cnt_mapping[OR] = 0;
+        inscode_param_cnt_mapping[SHL] = 0;
+        inscode_param_cnt_mapping[SHR] = 0;
+        inscode_param_cnt_mapping[XOR] = 0;
+        inscode_param_cnt_mapping[LT] = 0;
+        inscode_param_cnt_mapping[LE] = 0;
+        inscode_param_cnt_mapping[GT] = 0;
+        inscode_param_cnt_mapping[GE] = 0;
+        inscode_param_cnt_mapping[EQ] = 0;
+        inscode_param_cnt_mapping[NE] = 0;
+        inscode_param_cnt_mapping[NOT] = 0;
+        inscode_param_cnt_mapping[NEG] = 0;
+        inscode_param_cnt_mapping[CVT_INT] = 0;
+        inscode_param_cnt_mapping[CVT_FLOAT] = 0;
+        inscode_param_cnt_mapping[CVT_CHAR] = 0;
+        inscode_param_cnt_mapping[ADD_INT_INT] = 0;
+        inscode_param_cnt_mapping[SUB_INT_INT] = 0;
+        inscode_param_cnt_mapping[MUL_INT_INT] = 0;
+        inscode_param_cnt_mapping[DIV_INT_INT] = 0;
+        inscode_param_cnt_mapping[MOD_INT_INT] = 0;
+        inscode_param_cnt_mapping[LT_INT_INT] = 0;
+        inscode_param_cnt_mapping[LE_INT_INT] = 0;
+        inscode_param_cnt_mapping[GT_INT_INT] = 0;
+        inscode_param_cnt_mapping[GE_INT_INT] = 0;
+        inscode_param_cnt_mapping[EQ_INT_INT] = 0;
+        inscode_param_cnt_mapping[NE_INT_INT] = 0;
+        inscode_param_cnt_mapping[ADD_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[SUB_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[MUL_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[DIV_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[LT_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[LE_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[GT_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[GE_FLOAT_FLOAT] = 0;
+        inscode_param_cnt_mapping[ADD_LOCAL_IMM] = 1;
+        inscode_param_cnt_mapping[SUB_LOCAL_IMM] = 1;
+        inscode_param_cnt_mapping[ADD_GLOBAL_IMM] = 1;
+        inscode_param_cnt_mapping[SUB_GLOBAL_IMM] = 1;
+        inscode_param_cnt_mapping[CMP_LT_JMP_FALSE_LOCALS] = 1;
+        inscode_param_cnt_mapping[CMP_LE_JMP_FALSE_LOCALS] = 1;
+        inscode_param_cnt_mapping[CMP_GT_JMP_FALSE_LOCALS] = 1;
+        inscode_param_cnt_mapping[CMP_GE_JMP_FALSE_LOCALS] = 1;
+        inscode_param_cnt_mapping[CMP_LT_JMP_FALSE_GLOBALS] = 1;
+        inscode_param_cnt_mapping[CMP_LE_JMP_FALSE_GLOBALS] = 1;
+        inscode_param_cnt_mapping[CMP_GT_JMP_FALSE_GLOBALS] = 1;
+        inscode_param_cnt_mapping[CMP_GE_JMP_FALSE_GLOBALS] = 1;
+        inscode_param_cnt_mapping[LOAD_ELEM_LOCAL] = 1;
+        inscode_param_cnt_mapping[LOAD_ELEM_GLOBAL] = 1;
+        // only used for assemble/disassemble
+        inscode_param_cnt_mapping[CONSTANT] = 3;
+    }
+
+    Machine() {
+        frames.reserve(INITIAL_FRAME_NUM);
+        reset();
+    }
+
+    ~Machine() {
+        reset();
+        unmap_image();
+    }
+
+    void enable_verbose() {
+        verbose = true;
+    }
+
+    void enable_evaluator() {
+        evaluator = true;
+    }
+
+    // The profile is printed after the evaluator report, and written as JSON or CSV to path unless it is empty
+    void enable_profiler(const std::string &path) {
+        evaluator = true;
+        profiling = true;
+        profile_path = path;
+    }
+
+    // Samples the call stack every SAMPLE_INTERVAL_US of CPU time, the profiler takes precedence
+    void enable_sampler(const std::string &path) {
+        samples_path = path;
+    }
+
+    // Peak usage of slots, frames and arrays, and the arrays still referenced once everything is released
+    void enable_memory_report() {
+        memory_report = true;
+    }
+
+    /*
+     * Image of a machine stopped by resume(): the program as quickened so far, globals, frames, operand stacks, the
+     * arrays they reference and ip. A machine restored from it maps the image copy-on-write and goes on at ip, on the
+     * stack engine, so machines restored from one image share its pages until they write them.
+     */
+    void save_snapshot(const std::string &path);
+
+    void restore_snapshot(const std::string &path);
+
+    // GETCH reads to the end of the input instead of waiting for more chars
+    void close_input() {
+        input_closed = true;
+    }
+
+    /*
+     * Runs at most n instructions of the loaded program, the program keeps its state in the machine between calls
+     * and the next call goes on where this one stopped. Slices run on the stack engine without the verbose debugger,
+     * profilers or reports, so thousands of machines can share a few threads. Also counts to executed_instructions().
+     */
+    dispatch_status resume(long long n) {
+        if (status == HALTED) return HALTED;
+        slicing = true;
+        long long slice_end = n_ins + std::max(n, 1LL);
+        instruction_budget = limits.instructions ? std::min(slice_end, limits.instructions) : slice_end;
+        status = HALTED;
+        try {
+            execute<false, true, false, false, false>();
+        } catch (...) {
+            output.flush();
+            throw;
+        }
+        if (status != YIELDED) output.flush();
+        return status;
+    }
+
+    /*
+     * A machine stopped by resume() as seen by the debugger. The instructions are the copy the machine runs, patching
+     * BREAK into one makes resume() stop with BREAKPOINT before it.
+     */
+    int next_instruction() const {
+        return ip + 1;
+    }
+
+    instruct &instruction(int index) {
+        return instructions[index];
+    }
+
+    int instruction_count() const {
+        return (int) instructions.size();
+    }
+
+    const std::vector<frame> &call_frames() const {
+        return frames;
+    }
+
+    int global_count() const {
+        return var_cnt;
+    }
+
+    const slot &global(int index) const {
+        return globals[index];
+    }
+
+    // Locals and operands of the frame being run, the top level has no locals
+    int local_count() const {
+        return esp == nullptr ? 0 : esp->var_cnt;
+    }
+
+    const slot &local(int index) const {
+        return stack.data[esp->base + index];
+    }
+
+    int operand_count() const {
+        return esp == nullptr ? global_operands.top + 1 : stack.top + 1 - esp->base - esp->var_cnt;
+    }
+
+    const slot &operand(int index) const {
+        return esp == nullptr ? global_operands.data[index] : stack.data[esp->base + esp->var_cnt + index];
+    }
+
+    // Exceeding a limit raises limit_exceeded, after which the machine can only be reset
+    void set_limits(const resource_limits &_limits) {
+        limits = _limits;
+        instruction_budget = limits.instructions ? limits.instructions : std::numeric_limits<long long>::max();
+        if (limits.stack_slots) {
+            stack.set_limit(limits.stack_slots);
+            global_operands.set_limit(limits.stack_slots);
+        }
+    }
+
+    // Programs the register engine cannot translate, the verbose debugger and the profilers still run on the stack engine
+    void enable_register_engine() {
+        register_engine = true;
+    }
+
+    // Hot functions of the register engine run as native code, where the platform has a JIT
+    void enable_jit() {
+        register_engine = true;
+        jit = true;
+    }
+
+    void redirect(std::istream &_in, std::ostream &_out) {
+        in = &_in;
+        out = &_out;
+        output.redirect(out);
+    }
+
+    // Flush the output at every line instead of only when it is full, before input and at the end
+    void enable_line_buffering() {
+        output.set_line_mode(true);
+    }
+
+    void reset() {
+        ip = -1;
+        status = YIELDED;
+        while (global_operands.top > -1) {
+            SLOT_DECREF(global_operands.data[global_operands.top], "Reset");
+            global_operands.top--;
+        }
+        while (esp != nullptr) {
+            pop_frame();
+        }
+        while (stack.top > -1) {
+            SLOT_DECREF(stack.data[stack.top], "Reset");
+            stack.top--;
+        }
+        release_globals();
+        // nothing references an array now, unless a reference count was never dropped
+        memory.leaked_arrays = memory.arrays;
+        memory.leaked_bytes = memory.array_bytes;
+    }
+
+    void release_globals() {
+        while (var_cnt > 0) {
+            var_cnt--;
+            SLOT_DECREF(globals[var_cnt], "Reset");
+        }
+        delete[] globals;
+        globals = nullptr;
+    }
+
+    bool in_snapshot(const void *elements) const {
+        auto p = reinterpret_cast<uintptr_t>(elements);
+        return p >= image_elements && p < image_end;
+    }
+
+    void unmap_image() {
+        if (image != nullptr) munmap(image, image_size);
+        image = nullptr;
+        image_size = 0;
+        image_elements = image_end = 0;
+    }
+
+    // BUILD_ARR, a zeroed array with one reference
+    array *build_array(basic_data_types type, int size) {
+        long long bytes = (long long) (sizeof(array) + array::element_size(type) * size);
+        if (limits.heap_bytes && memory.array_bytes + bytes > limits.heap_bytes) {
+            throw limit_exceeded(HEAP_LIMIT, "Heap limit of " + std::to_string(limits.heap_bytes) + " bytes exceeded");
+        }
+        void *elements = array_buffers.allocate(array::element_size(type) * size);
+        array *arr = array_pool.create(elements, size, type);
+        memory.array_built(arr);
+        return arr;
+    }
+
+    [[noreturn]] void call_depth_exceeded() {
+        throw limit_exceeded(CALL_DEPTH_LIMIT, "Call depth limit of " + std::to_string(limits.call_depth) + " exceeded");
+    }
+
+    // The budget ran out at the end of a slice, unless the instruction limit was reached
+    void end_slice() {
+        if (!slicing || (limits.instructions && n_ins > limits.instructions)) budget_exhausted();
+        status = YIELDED;
+    }
+
+    // GETCH of a slice, a closed input reads EOF
+    bool input_ready() const {
+        return input_closed || in->rdbuf()->in_avail() > 0;
+    }
+
+    [[noreturn]] void budget_exhausted() {
+        throw limit_exceeded(INSTRUCTION_LIMIT,
+                             "Instruction budget of " + std::to_string(limits.instructions) + " exhausted");
+    }
+
+    // Release the locals and operands of the current frame and return to its caller
+    void pop_frame() {
+        while (stack.top >= esp->base) {
+            SLOT_DECREF(stack.data[stack.top], "Return statement decref");
+            stack.top--;
+        }
+        frames.pop_back();
+        esp = frames.empty() ? nullptr : &frames.back();
+        operands = (esp == nullptr) ? &global_operands : &stack;
+        locals = (esp == nullptr) ? nullptr : stack.data + esp->base;
+    }
+
+    void push_frame(int base) {
+        if (limits.call_depth && (int) frames.size() >= limits.call_depth) call_depth_exceeded();
+        frames.emplace_back(base);
+        esp = &frames.back();
+        memory.frame_pushed(frames.size(), sizeof(frame));
+    }
+
+    // Frames of the running calls, when the top level makes a call its arguments are moved from global_operands
+    void push_call_frame(int argc) {
+        if (esp == nullptr) {
+            // top-level operands are the global operands, STORE_GLOBAL does nothing here
+            push_frame(stack.top + 1);
+            stack.reserve(argc);
+            for (int i = 0; i < argc; i++) {
+                stack.data[++stack.top] = global_operands.data[global_operands.top--];
+            }
+        } else {
+            push_frame(stack.top + 1 - argc);
+        }
+    }
+
+    // VMALLOC, operands already pushed (arguments) are moved above the locals
+    void allocate_locals(int n) {
+        if (!n) return;
+        if (esp == nullptr) {
+            release_globals();
+            globals = new slot[n];
+            var_cnt = n;
+            if (n > memory.peak_globals) memory.peak_globals = n;
+            return;
+        }
+        stack.reserve(n);
+        slot *base = stack.data + esp->base;
+        std::copy_backward(base, stack.data + stack.top + 1, stack.data + stack.top + 1 + n);
+        for (int i = 0; i < n; i++) base[i] = slot();
+        stack.top += n;
+        esp->var_cnt = n;
+        locals = base;
+    }
+
+    void grow_stack() {
+        operands->reserve(1);
+        if (esp != nullptr) locals = stack.data + esp->base;
+    }
+
+    // Take over a loaded program and link it
+    void load(Program program) {
+        program.link();
+        load(std::make_shared<const Program>(std::move(program)));
+    }
+
+    // Counted when the evaluator is on
+    long long int executed_instructions() const {
+        return n_ins;
+    }
+
+    // Run a linked program that may be shared with other machines, only its instructions are copied
+    void load(std::shared_ptr<const Program> program) {
+        if (!program->linked) panic("Program is not linked");
+        if (!program->malformed.empty()) panic(program->malformed);
+        code = std::move(program);
+        instructions = code->instructs;
+    }
+
+    void dispatch() {
+        if (verbose) {
+            std::cout << "SLang Virtual Machine Debugger (SVMDB)" << std::endl;
+            std::cout << "I am an opcode-level debugging assistant." << std::endl;
+            std::cout << "======================================" << std::endl;
+            std::cin.get();
+        }
+        clock_t start = 0, finish;
+        if (evaluator) {
+            start = clock();
+        }
+        bool on_registers = false;
+        bool sampling = !samples_path.empty() && !profiling && !verbose;
+        if (register_engine && !verbose && !profiling && !sampling) {
+            // a program stopped by resume() or restored from a snapshot goes on at ip
+            std::string reason = "the program already started";
+            on_registers = ip < 0 && register_translator(*code, registers).translate(reason);
+            if (!on_registers && evaluator) {
+                *out << "Register engine unavailable: " << reason << std::endl;
+            }
+        }
+        // the instruction budget is kept by counting, loops of native code would run past it
+        bool counting = evaluator || limits.instructions;
+        // verified code reserves its frames when it pushes them, a stack limit is only checked push by push
+        bool verified = code->verified && ip < 0 && !limits.stack_slots;
+        try {
+            // The fast loop has no per-instruction debugging or counting at all
+            if (verbose) {
+                execute<true, true, false, false, false>();
+            } else if (profiling) {
+                profile.start((int) instructions.size());
+                execute<false, true, true, false, false>();
+                profile.finish();
+            } else if (sampling) {
+                samples.start(SAMPLE_INTERVAL_US);
+                try {
+                    counting ? execute<false, true, false, true, false>() : execute<false, false, false, true, false>();
+                } catch (...) {
+                    samples.stop();
+                    throw;
+                }
+                samples.stop();
+            } else if (on_registers) {
+#ifdef USE_JIT
+                bool native_code = jit && !limits.instructions;
+#else
+                bool native_code = false;
+#endif
+                if (counting) {
+                    native_code ? execute_registers<true, true>() : execute_registers<true, false>();
+                } else {
+                    native_code ? execute_registers<false, true>() : execute_registers<false, false>();
+                }
+            } else if (counting) {
+                if (!verified && evaluator) {
+                    *out << "Bytecode not verified: " << (ip >= 0 ? "the program already started"
+                                                          : limits.stack_slots ? "a stack limit is set"
+                                                          : code->unverified) << std::endl;
+                }
+                verified ? execute<false, true, false, false, true>() : execute<false, true, false, false, false>();
+            } else {
+                verified ? execute<false, false, false, false, true>() : execute<false, false, false, false, false>();
+            }
+        } catch (...) {
+            // what the program printed comes before the error
+            output.flush();
+            throw;
+        }
+        output.flush();
+        if (evaluator) {
+            finish = clock();
+            double time_delta = (double) (finish - start) / CLOCKS_PER_SEC;
+            *out << "<<<<<* Performance evaluator *>>>>>" << std::endl;
+            *out << n_ins << " instructions executed in total" << std::endl;
+            *out << "Time consumotion(s): " << std::fixed << std::setprecision(8) << time_delta << std::endl;
+            *out << "MIPS: " << std::fixed << std::setprecision(8) << (double) n_ins / time_delta * 1e-6 << std::endl;
+            *out << "Array kernels: " << bulk.isa << std::endl;
+            *out << "Engine: " << (on_registers ? "registers" : "stack") << std::endl;
+            if (on_registers && jit) {
+#ifdef USE_JIT
+                int compiled = (int) std::count_if(native.begin(), native.end(),
+                                                   [](const std::unique_ptr<jit_function> &f) { return f != nullptr; });
+                *out << "JIT compiled functions: " << compiled << " (native instructions are not counted)" << std::endl;
+#else
+                *out << "JIT unavailable on this platform" << std::endl;
+#endif
+            }
+        }
+        if (profiling || sampling) {
+            if (profiling) {
+                profile.report(*out, *code, code_names);
+                if (!profile_path.empty()) profile.dump(profile_path, *code, code_names);
+            } else {
+                if (evaluator) *out << "Samples: " << samples.samples() << " written to " << samples_path << std::endl;
+                samples.write(samples_path, *code, code_names);
+            }
+        }
+        if (memory_report) {
+            report_memory();
+        }
+    }
+
+private:
+    // At HALT: the stacks are scanned for their high-water marks before reset() releases what is left
+    void report_memory() {
+        int stack_peak = stack.high_water();
+        int global_operands_peak = global_operands.high_water();
+        reset();
+        const char *type_names[VOID] = {"INT", "FLOAT", "CHAR"};
+        *out << "<<<<<* Memory *>>>>>" << std::endl;
+        *out << "Stack peak: " << stack_peak << " slots (" << stack_peak * sizeof(slot) << " bytes) of "
+             << stack.capacity << " reserved" << std::endl;
+        *out << "Global operands peak: " << global_operands_peak << " slots ("
+             << global_operands_peak * sizeof(slot) << " bytes) of " << global_operands.capacity << " reserved"
+             << std::endl;
+        *out << "Globals peak: " << memory.peak_globals << " slots (" << memory.peak_globals * sizeof(slot)
+             << " bytes)" << std::endl;
+        *out << "Frames peak: " << memory.peak_frames << " (" << memory.peak_frame_bytes << " bytes)" << std::endl;
+        *out << "Arrays built: " << memory.built << ", peak " << memory.peak_arrays << " live ("
+             << memory.peak_array_bytes << " bytes)" << std::endl;
+        for (int t = 0; t < VOID; t++) {
+            if (!memory.built_by_type[t]) continue;
+            *out << type_names[t] << " arrays built: " << memory.built_by_type[t] << ", peak "
+                 << memory.peak_by_type[t] << " live" << std::endl;
+        }
+        *out << "Array sizes:";
+        const char *separator = " ";
+        for (int b = 0; b < memory_stats::SIZE_BUCKETS; b++) {
+            if (!memory.sizes[b]) continue;
+            *out << separator;
+            if (b <= 1) {
+                *out << b;
+            } else {
+                *out << (1LL << (b - 1)) << "-" << (1LL << b) - 1;
+            }
+            *out << ": " << memory.sizes[b];
+            separator = ", ";
+        }
+        *out << std::endl;
+        *out << "Leaked arrays: " << memory.leaked_arrays << " (" << memory.leaked_bytes << " bytes)" << std::endl;
+    }
+
+    void trace(const instruct &ins) {
+        std::cout << "======================================" << std::endl;
+        std::cout << "#" << ins.address << " $ " << code_names[ins.code];
+        if (Machine::inscode_param_cnt_mapping[ins.code]) {
+            std::cout << " " << (Program::is_jump(ins.code) ? instructions[ins.operand].address : ins.operand);
+        }
+        std::cout << " > ";
+        std::cin.get();
+    }
+
+    // Operands of bulk array operations, their references are dropped by release_array() once done
+    array *pop_array() {
+        slot operand = OP_POP();
+        if (operand.type != ARRAY) {
+            panic("Array expected");
+        }
+        return operand.array_val;
+    }
+
+    void release_array(array *arr) {
+        slot operand(arr);
+        SLOT_DECREF(operand, "Bulk array operation");
     }
 
-    void enable_evaluator() {
-        evaluator = true;
+    // PUTS, the chars of the array up to the first zero
+    void puts_array(const slot &val) {
+        if (val.type != ARRAY || val.array_val->element_type != CHAR) panic("Char array expected");
+        const char_tp *chars = val.array_val->chars();
+        int n = val.array_val->array_size;
+        output.write(chars, (int) (std::find(chars, chars + n, 0) - chars));
     }
 
-    void reset() {
-        ip = -1;
-        ins_cnt = 0;
-        while (op_top > -1) {
-            SLOT_DECREF(global_operands[op_top--], "Reset");
-        }
-        esp = nullptr;
-        while (var_cnt--) {
-            SLOT_DECREF(globals[var_cnt], "Reset");
-        }
-        while (constant_cnt--) {
-            SLOT_DECREF(constants[constant_cnt], "Reset");
-        }
-        var_cnt = 0;
-        constant_cnt = 0;
+    // GETCH, the output so far is shown first, as a prompt
+    char_tp read_char() {
+        output.flush();
+        return (char_tp) in->rdbuf()->sbumpc();
     }
 
-    void add_instruct(instruct ins) {
-        instructs[ins_cnt++] = ins;
-        addrs[ins.address] = ins_cnt - 1;
+    static void check_same_shape(const array *a, const array *b) {
+        if (a->element_type != b->element_type) panic("Array type mismatch");
+        if (a->array_size != b->array_size) panic("Array size mismatch");
     }
 
-    void dispatch() {
-        if (verbose) {
-            std::cout << "SLang Virtual Machine Debugger (SVMDB)" << std::endl;
-            std::cout << "I am an opcode-level debugging assistant." << std::endl;
-            std::cout << "======================================" << std::endl;
-            std::cin.get();
-            Machine::load_name_code_mapping();
-            Machine::load_param_mapping();
+    // The top level, the functions of the running calls and the instruction at ip
+    void take_sample(int ip) {
+        std::vector<int> stack{0};
+        stack.reserve(frames.size() + 2);
+        for (const frame &f : frames) stack.push_back(f.function);
+        stack.push_back(ip);
+        samples.record(std::move(stack));
+    }
+
+    void jit_compile(int function) {
+#ifdef USE_JIT
+        int first = registers.functions[function].entry;
+        int last = function + 1 < (int) registers.functions.size() ? registers.functions[function + 1].entry
+                                                                   : (int) registers.code.size();
+        native[function] = jit_compiler().compile(registers.code, first, last);
+#endif
+    }
+
+    // Runs the translated program, the machine stack holds the absolute registers and then the frames
+    template<bool COUNTING, bool JIT>
+    void execute_registers() {
+#ifdef USE_COMPUTED_GOTO
+        // in the order of reg_code
+        static void *reg_targets[] = {
+            &&REG_TARGET_R_MOVE, &&REG_TARGET_R_ADD, &&REG_TARGET_R_SUB, &&REG_TARGET_R_MUL, &&REG_TARGET_R_MOD,
+            &&REG_TARGET_R_DIV, &&REG_TARGET_R_AND, &&REG_TARGET_R_OR, &&REG_TARGET_R_SHL, &&REG_TARGET_R_SHR,
+            &&REG_TARGET_R_XOR, &&REG_TARGET_R_LT, &&REG_TARGET_R_LE, &&REG_TARGET_R_GT, &&REG_TARGET_R_GE,
+            &&REG_TARGET_R_EQ, &&REG_TARGET_R_NE, &&REG_TARGET_R_NOT, &&REG_TARGET_R_NEG, &&REG_TARGET_R_CVT_INT,
+            &&REG_TARGET_R_CVT_FLOAT, &&REG_TARGET_R_CVT_CHAR, &&REG_TARGET_R_INC, &&REG_TARGET_R_DEC,
+            &&REG_TARGET_R_INC_ELEM, &&REG_TARGET_R_DEC_ELEM, &&REG_TARGET_R_LOAD_ELEM, &&REG_TARGET_R_STORE_ELEM,
+            &&REG_TARGET_R_BUILD_ARR, &&REG_TARGET_R_SIZE_OF, &&REG_TARGET_R_JMP, &&REG_TARGET_R_JMP_TRUE,
+            &&REG_TARGET_R_JMP_FALSE, &&REG_TARGET_R_JMP_UNLESS_LT, &&REG_TARGET_R_JMP_UNLESS_LE,
+            &&REG_TARGET_R_JMP_UNLESS_GT, &&REG_TARGET_R_JMP_UNLESS_GE, &&REG_TARGET_R_CALL, &&REG_TARGET_R_TAIL_CALL,
+            &&REG_TARGET_R_RET,
+            &&REG_TARGET_R_HALT, &&REG_TARGET_R_PRINTK, &&REG_TARGET_R_PUTCH, &&REG_TARGET_R_PUTS,
+            &&REG_TARGET_R_GETCH
+        };
+        static_assert(sizeof(reg_targets) / sizeof(void *) == REG_CODE_NUM, "Missing register targets");
+#endif
+        const reg_instruct *const prog = registers.code.data();
+        const reg_function *const functions = registers.functions.data();
+        std::vector<reg_frame> calls;
+        int base = registers.frame_base();
+        int frame_size = functions[0].frame_size;
+        stack.reserve(base + frame_size);
+        for (int i = 0; i < registers.global_cnt; i++) stack.data[++stack.top] = slot();
+        for (const slot &constant : registers.constants) stack.data[++stack.top] = constant;
+        for (int i = 0; i < frame_size; i++) stack.data[++stack.top] = slot();
+        slot *regs = stack.data;
+        slot *fp = regs + base;
+        int pc = functions[0].entry;
+        int function = 0;
+        const reg_instruct *ri;
+        if (JIT) {
+            native.clear();
+            native.resize(registers.functions.size());
+            hotness.assign(registers.functions.size(), 0);
         }
-        clock_t start = 0, finish;
-        if (evaluator) {
-            start = clock();
+#ifndef USE_COMPUTED_GOTO
+        reg_dispatch:
+#endif
+        COUNT_INSTRUCTION;
+        ri = &prog[pc++];
+        switch (ri->code) {
+            REG_TARGET(R_MOVE): {
+                slot val = REG(ri->b);
+                SLOT_INCREF(val, "Register copy");
+                REG_SET(ri->a, val);
+                REG_DISPATCH;
+            }
+            REG_BINARY_OP(R_ADD, +)
+            REG_BINARY_OP(R_SUB, -)
+            REG_BINARY_OP(R_MUL, *)
+            REG_TARGET(R_MOD):
+            REG_TARGET(R_DIV):
+            REG_TARGET(R_AND):
+            REG_TARGET(R_OR):
+            REG_TARGET(R_SHL):
+            REG_TARGET(R_SHR):
+            REG_TARGET(R_XOR): {
+                REG_SET(ri->a, register_binary(ri->code, REG(ri->b), REG(ri->c)));
+                REG_DISPATCH;
+            }
+            REG_BINARY_OP(R_LT, <)
+            REG_BINARY_OP(R_LE, <=)
+            REG_BINARY_OP(R_GT, >)
+            REG_BINARY_OP(R_GE, >=)
+            REG_BINARY_OP(R_EQ, ==)
+            REG_BINARY_OP(R_NE, !=)
+            REG_TARGET(R_NOT): {
+                const slot &operand = REG(ri->b);
+                if (operand.type != INT) {
+                    panic("Unsupported unary operator");
+                }
+                REG_SET(ri->a, slot((int_tp) (operand.int_val ? 0 : 1)));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_NEG): {
+                const slot &operand = REG(ri->b);
+                if (operand.type == INT) {
+                    REG_SET(ri->a, slot(-operand.int_val));
+                } else if (operand.type == FLOAT) {
+                    REG_SET(ri->a, slot(-operand.float_val));
+                } else {
+                    panic("Unsupported unary operator");
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_CVT_INT): {
+                const slot &op = REG(ri->b);
+                if (op.type == INT) {
+                    REG_SET(ri->a, op);
+                } else if (op.type == FLOAT) {
+                    REG_SET(ri->a, slot((int_tp) op.float_val));
+                } else if (op.type == CHAR) {
+                    REG_SET(ri->a, slot((int_tp) op.char_val));
+                } else {
+                    panic("Unsupported type conversion");
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_CVT_FLOAT): {
+                const slot &op = REG(ri->b);
+                if (op.type == FLOAT) {
+                    REG_SET(ri->a, op);
+                } else if (op.type == INT) {
+                    REG_SET(ri->a, slot((float_tp) op.int_val));
+                } else if (op.type == CHAR) {
+                    REG_SET(ri->a, slot((float_tp) op.char_val));
+                } else {
+                    panic("Unsupported type conversion");
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_CVT_CHAR): {
+                const slot &op = REG(ri->b);
+                if (op.type == CHAR) {
+                    REG_SET(ri->a, op);
+                } else if (op.type == INT) {
+                    REG_SET(ri->a, slot((char_tp) op.int_val));
+                } else if (op.type == FLOAT) {
+                    REG_SET(ri->a, slot((char_tp) op.float_val));
+                } else {
+                    panic("Unsupported type conversion");
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_INC):
+            REG_TARGET(R_DEC): {
+                slot &var = REG(ri->a);
+                int delta = ri->code == R_INC ? 1 : -1;
+                if (var.type == INT) {
+                    var.int_val += delta;
+                } else if (var.type == FLOAT) {
+                    var.float_val += delta;
+                } else if (var.type == CHAR) {
+                    var.char_val = (char_tp) (var.char_val + delta);
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_INC_ELEM):
+            REG_TARGET(R_DEC_ELEM): {
+                const slot &target = REG(ri->a);
+                int subscr = (int) REG(ri->b).int_val;
+                if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
+                    panic("Array index out of bound");
+                }
+                array *arr = target.array_val;
+                int delta = ri->code == R_INC_ELEM ? 1 : -1;
+                if (arr->element_type == INT) {
+                    arr->ints()[subscr] += delta;
+                } else if (arr->element_type == FLOAT) {
+                    arr->floats()[subscr] += delta;
+                } else {
+                    arr->chars()[subscr] = (char_tp) (arr->chars()[subscr] + delta);
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_LOAD_ELEM): {
+                const slot &target = REG(ri->b);
+                int subscr = (int) REG(ri->c).int_val;
+                if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
+                    panic("Array index out of bound");
+                }
+                REG_SET(ri->a, target.array_val->get(subscr));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_STORE_ELEM): {
+                const slot &target = REG(ri->a);
+                int subscr = (int) REG(ri->b).int_val;
+                if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
+                    panic("Array index out of bound");
+                }
+                target.array_val->set(subscr, REG(ri->c));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_BUILD_ARR): {
+                basic_data_types type = VOID;
+                if (ri->c == 0) {
+                    type = INT;
+                } else if (ri->c == 1) {
+                    type = FLOAT;
+                } else if (ri->c == 2) {
+                    type = CHAR;
+                } else {
+                    panic("Unexpected type");
+                }
+                if (REG(ri->b).type == ARRAY) {
+                    panic("Array size must be a scalar");
+                }
+                int val = (int) scalar_as<int_tp>(REG(ri->b));
+                if (val < 0) {
+                    panic("Negative array size");
+                }
+                REG_SET(ri->a, slot(build_array(type, val)));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_SIZE_OF): {
+                const slot &element = REG(ri->b);
+                int size = element.type != ARRAY ? 1 : element.array_val->array_size;
+                REG_SET(ri->a, slot((int_tp) size));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_JMP): {
+                REG_JUMP(ri->a);
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_JMP_TRUE): {
+                if (REG(ri->b).truth()) REG_JUMP(ri->a);
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_JMP_FALSE): {
+                if (!REG(ri->b).truth()) REG_JUMP(ri->a);
+                REG_DISPATCH;
+            }
+            REG_COMPARE_JMP(R_JMP_UNLESS_LT, R_LT, <)
+            REG_COMPARE_JMP(R_JMP_UNLESS_LE, R_LE, <=)
+            REG_COMPARE_JMP(R_JMP_UNLESS_GT, R_GT, >)
+            REG_COMPARE_JMP(R_JMP_UNLESS_GE, R_GE, >=)
+            REG_TARGET(R_CALL): {
+                const reg_function &callee = functions[ri->a];
+                int callee_base = base + frame_size;
+                stack.reserve(callee.frame_size);
+                regs = stack.data;
+                fp = regs + base;
+                slot *callee_fp = regs + callee_base;
+                for (int i = 0; i < callee.frame_size; i++) callee_fp[i] = slot();
+                stack.top = callee_base + callee.frame_size - 1;
+                // arguments are moved with their references, in reverse from the top level like LOAD_GLOBAL does
+                slot *args = fp + ri->b;
+                for (int i = 0; i < callee.argc; i++) {
+                    slot &arg = args[ri->c ? callee.argc - 1 - i : i];
+                    callee_fp[callee.var_cnt + i] = arg;
+                    arg = slot();
+                }
+                if (limits.call_depth && (int) calls.size() >= limits.call_depth) call_depth_exceeded();
+                calls.push_back({pc, base, frame_size, ri->b, function});
+                memory.frame_pushed(calls.size(), sizeof(reg_frame));
+                base = callee_base;
+                frame_size = callee.frame_size;
+                fp = callee_fp;
+                pc = callee.entry;
+                function = ri->a;
+                if (JIT) {
+                    if (native[function] == nullptr && ++hotness[function] == JIT_THRESHOLD) jit_compile(function);
+                    REG_JIT_ENTER;
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_TAIL_CALL): {
+                // the callee takes over the frame, keeping only the arguments
+                const reg_function &callee = functions[ri->a];
+                int from = ri->b, to = callee.var_cnt;
+                for (int i = 0; i < frame_size; i++) {
+                    if (i < from || i >= from + callee.argc) SLOT_DECREF(fp[i], "Tail call decref");
+                }
+                if (callee.frame_size > frame_size) stack.reserve(callee.frame_size - frame_size);
+                regs = stack.data;
+                fp = regs + base;
+                if (to < from) {
+                    std::copy(fp + from, fp + from + callee.argc, fp + to);
+                } else {
+                    std::copy_backward(fp + from, fp + from + callee.argc, fp + to + callee.argc);
+                }
+                for (int i = 0; i < callee.frame_size; i++) {
+                    if (i < to || i >= to + callee.argc) fp[i] = slot();
+                }
+                stack.top = base + callee.frame_size - 1;
+                frame_size = callee.frame_size;
+                pc = callee.entry;
+                function = ri->a;
+                if (JIT) {
+                    if (native[function] == nullptr && ++hotness[function] == JIT_THRESHOLD) jit_compile(function);
+                    REG_JIT_ENTER;
+                }
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_RET): {
+                slot ret = REG(ri->a);
+                SLOT_INCREF(ret, "Return value");
+                for (int i = 0; i < frame_size; i++) {
+                    SLOT_DECREF(fp[i], "Return statement decref");
+                }
+                stack.top = base - 1;
+                reg_frame caller = calls.back();
+                calls.pop_back();
+                pc = caller.return_pc;
+                base = caller.base;
+                frame_size = caller.frame_size;
+                fp = regs + base;
+                function = caller.function;
+                slot &result = fp[caller.result];
+                SLOT_DECREF(result, "Return value override");
+                result = ret;
+                if (JIT) REG_JIT_ENTER;
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_HALT): {
+                return;
+            }
+            REG_TARGET(R_PRINTK): {
+                output.print(REG(ri->a));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_PUTCH): {
+                output.put(REG(ri->a).put_char());
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_PUTS): {
+                puts_array(REG(ri->a));
+                REG_DISPATCH;
+            }
+            REG_TARGET(R_GETCH): {
+                REG_SET(ri->a, slot(read_char()));
+                REG_DISPATCH;
+            }
+            default: {
+                panic("Unexpected instruction");
+            }
         }
+    }
+
+    // VERIFIED code has a frame reserved for all its operands when it is pushed, pushes do not check the capacity
+    template<bool VERBOSE, bool COUNTING, bool PROFILING, bool SAMPLING, bool VERIFIED>
+    void execute() {
+#ifdef USE_COMPUTED_GOTO
+        // in the order of instruct_code
+        static void *opcode_targets[] = {
+            &&unknown_opcode, &&TARGET_VMALLOC, &&unknown_opcode, &&TARGET_NOOP, &&TARGET_POP_OP, &&TARGET_TYPE_CVT,
+            &&TARGET_LOAD_NULL, &&TARGET_LOAD_CONSTANT, &&TARGET_LOAD_NAME, &&TARGET_LOAD_NAME_GLOBAL,
+            &&TARGET_LOAD_INT, &&TARGET_LOAD_FLOAT, &&TARGET_LOAD_CHAR, &&TARGET_BINARY_SUBSCR,
+            &&TARGET_STORE_SUBSCR, &&TARGET_STORE_SUBSCR_INPLACE, &&TARGET_STORE_SUBSCR_NOPOP, &&TARGET_STORE_NAME,
+            &&TARGET_STORE_NAME_GLOBAL, &&TARGET_STORE_NAME_NOPOP, &&TARGET_STORE_NAME_GLOBAL_NOPOP,
+            &&TARGET_BUILD_ARR, &&TARGET_SIZE_OF, &&TARGET_BINARY_OP, &&TARGET_UNARY_OP, &&TARGET_JMP,
+            &&TARGET_JMP_TRUE, &&TARGET_JMP_FALSE, &&TARGET_PUSH, &&TARGET_RET, &&TARGET_CALL, &&TARGET_LOAD_GLOBAL,
+            &&TARGET_STORE_GLOBAL, &&TARGET_HALT, &&TARGET_PRINTK, &&TARGET_PUTCH, &&TARGET_GETCH,
+            &&TARGET_ARR_FILL, &&TARGET_ARR_COPY, &&TARGET_ARR_ADD, &&TARGET_ARR_MUL, &&TARGET_ARR_SUM,
+            &&TARGET_ARR_MIN, &&TARGET_ARR_MAX, &&TARGET_ARR_DOT, &&TARGET_PUTS, &&TARGET_INC_NAME,
+            &&TARGET_DEC_NAME, &&TARGET_INC_NAME_GLOBAL, &&TARGET_DEC_NAME_GLOBAL, &&TARGET_INC_SUBSCR,
+            &&TARGET_DEC_SUBSCR, &&TARGET_PUSH_ARGS, &&TARGET_CALL_ARGS, &&TARGET_ENTER,
+            &&TARGET_TAIL_CALL,
+            &&TARGET_ADD, &&TARGET_SUB, &&TARGET_MUL, &&TARGET_MOD, &&TARGET_DIV, &&TARGET_AND, &&TARGET_OR,
+            &&TARGET_SHL, &&TARGET_SHR, &&TARGET_XOR, &&TARGET_LT, &&TARGET_LE, &&TARGET_GT, &&TARGET_GE,
+            &&TARGET_EQ, &&TARGET_NE, &&TARGET_NOT, &&TARGET_NEG, &&TARGET_CVT_INT, &&TARGET_CVT_FLOAT,
+            &&TARGET_CVT_CHAR,
+            &&TARGET_ADD_INT_INT, &&TARGET_SUB_INT_INT, &&TARGET_MUL_INT_INT, &&TARGET_DIV_INT_INT,
+            &&TARGET_MOD_INT_INT, &&TARGET_LT_INT_INT, &&TARGET_LE_INT_INT, &&TARGET_GT_INT_INT,
+            &&TARGET_GE_INT_INT, &&TARGET_EQ_INT_INT, &&TARGET_NE_INT_INT, &&TARGET_ADD_FLOAT_FLOAT,
+            &&TARGET_SUB_FLOAT_FLOAT, &&TARGET_MUL_FLOAT_FLOAT, &&TARGET_DIV_FLOAT_FLOAT, &&TARGET_LT_FLOAT_FLOAT,
+            &&TARGET_LE_FLOAT_FLOAT, &&TARGET_GT_FLOAT_FLOAT, &&TARGET_GE_FLOAT_FLOAT,
+            &&TARGET_ADD_LOCAL_IMM, &&TARGET_SUB_LOCAL_IMM, &&TARGET_ADD_GLOBAL_IMM, &&TARGET_SUB_GLOBAL_IMM,
+            &&TARGET_CMP_LT_JMP_FALSE_LOCALS, &&TARGET_CMP_LE_JMP_FALSE_LOCALS, &&TARGET_CMP_GT_JMP_FALSE_LOCALS, &&TARGET_CMP_GE_JMP_FALSE_LOCALS,
+            &&TARGET_CMP_LT_JMP_FALSE_GLOBALS, &&TARGET_CMP_LE_JMP_FALSE_GLOBALS, &&TARGET_CMP_GT_JMP_FALSE_GLOBALS, &&TARGET_CMP_GE_JMP_FALSE_GLOBALS,
+            &&TARGET_LOAD_ELEM_LOCAL, &&TARGET_LOAD_ELEM_GLOBAL, &&TARGET_BREAK
+        };
+        static_assert(sizeof(opcode_targets) / sizeof(void *) == INSTRUCT_CODE_NUM, "Missing opcode targets");
+#endif
+        instruct *const instructs = instructions.data();
+        const slot *const constants = code->constants.data();
+        const int ins_cnt = (int) instructions.size();
+        const int *const frame_slots = code->frame_slots.data();
+        int ip = this->ip;
+        instruct *ins;
+        if (VERIFIED) global_operands.reserve(frame_slots[0]);
         full_dispatch:
         {
-            operands = (esp == nullptr) ? &global_operands : &(esp->local_operands);
-            op_top_ptr = (esp == nullptr) ? &op_top : &(esp->op_top);
+            operands = (esp == nullptr) ? &global_operands : &stack;
+            locals = (esp == nullptr) ? nullptr : stack.data + esp->base;
 
+#ifndef USE_COMPUTED_GOTO
             dispatch:
+#endif
             {
-                n_ins++;
-                instruct ins = instructs[++ip];
-                if (verbose) {
-                    std::cout << "======================================" << std::endl;
-                    std::string code_name_mapping[200];
-                    for (const auto& x : Machine::string_inscode_mapping) {
-                        code_name_mapping[x.second] = x.first;
-                    }
-                    std::cout << "#" << ins.address << " $ " << code_name_mapping[ins.code];
-                    if (Machine::inscode_param_cnt_mapping[ins.code]) {
-                        std::cout << " " << ins.operand;
-                    }
-                    std::cout << " > ";
-                    std::cin.get();
-                }
-                switch (ins.code) {
-                    case VMALLOC: {
-                        if (ins.operand) {
-                            if (esp == nullptr) {
-                                globals = new slot *[ins.operand];
-                                for (int i = 0; i < ins.operand; i++) globals[i] = nullptr;
-                                var_cnt = ins.operand;
-                            } else {
-                                esp->locals = new slot *[ins.operand];
-                                for (int i = 0; i < ins.operand; i++) esp->locals[i] = nullptr;
-                                esp->var_cnt = ins.operand;
-                            }
+                COUNT_OR_YIELD;
+                ins = &instructs[++ip];
+                if (PROFILING) profile.step(ip, ins->code, (int) frames.size());
+                if (SAMPLING && sample_due) take_sample(ip);
+                if (VERBOSE) trace(*ins);
+#ifndef USE_COMPUTED_GOTO
+                dispatch_again:
+#endif
+                switch (ins->code) {
+                    TARGET(VMALLOC): {
+                        allocate_locals(ins->operand);
+                        DISPATCH;
+                    }
+
+                    TARGET(ENTER): {
+                        // VMALLOC n, STORE_NAME k - 1, ..., STORE_NAME 0 at a function entry, bound by link()
+                        int k = ins[1].code == STORE_NAME ? ins[1].operand + 1 : 0;
+                        if (esp == nullptr || stack.top + 1 - esp->base != k) {
+                            // not called with k arguments
+                            allocate_locals(ins->operand);
+                            DISPATCH;
+                        }
+                        // the arguments already are the first k locals, a verified frame was reserved by its call
+                        if (!VERIFIED) stack.reserve(ins->operand - k);
+                        for (int i = k; i < ins->operand; i++) stack.data[++stack.top] = slot();
+                        esp->var_cnt = ins->operand;
+                        locals = stack.data + esp->base;
+                        ip += k;
+                        if (VERBOSE) {
+                            std::cout << "Allocated " << ins->operand << " locals, the first " << k
+                                      << " are the arguments." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case NOOP:
+                    TARGET(NOOP):
                         DISPATCH;
 
-                    case POP_OP: {
-                        slot *op = OP_POP();
+                    TARGET(POP_OP): {
+                        slot op = OP_POP();
                         SLOT_DECREF(op, "Operand is poped from the stack");
                         DISPATCH;
                     }
 
-                    case TYPE_CVT: {
-                        slot *op = OP_POP();
-                        slot *res = nullptr;
-                        switch (ins.operand) {
-                            // INT
-                            case 0:
-                                if (op->type == INT) {
-                                    res = new slot((int_tp) op->int_val);
-                                } else if (op->type == FLOAT) {
-                                    res = new slot((int_tp) op->float_val);
-                                }
-                                break;
-                            // FLOAT
-                            case 1:
-                                if (op->type == INT) {
-                                    res = new slot((float_tp) op->int_val);
-                                } else if (op->type == FLOAT) {
-                                    res = new slot((float_tp) op->float_val);
-                                }
-                                break;
-                            // CHAR
-                            case 2:
-                                res = new slot((char_tp) op->char_val);
-                                break;
+                    TARGET(TYPE_CVT): {
+                        panic("Unsupported type conversion");
+                    }
+
+                    TARGET(CVT_INT): {
+                        slot &op = OP_TOP();
+                        if (op.type == INT) {
+                        } else if (op.type == FLOAT) {
+                            op = slot((int_tp) op.float_val);
+                        } else if (op.type == CHAR) {
+                            op = slot((int_tp) op.char_val);
+                        } else {
+                            panic("Unsupported type conversion");
+                        }
+                        DISPATCH;
+                    }
+
+                    TARGET(CVT_FLOAT): {
+                        slot &op = OP_TOP();
+                        if (op.type == FLOAT) {
+                        } else if (op.type == INT) {
+                            op = slot((float_tp) op.int_val);
+                        } else if (op.type == CHAR) {
+                            op = slot((float_tp) op.char_val);
+                        } else {
+                            panic("Unsupported type conversion");
+                        }
+                        DISPATCH;
+                    }
+
+                    TARGET(CVT_CHAR): {
+                        slot &op = OP_TOP();
+                        if (op.type == CHAR) {
+                        } else if (op.type == INT) {
+                            op = slot((char_tp) op.int_val);
+                        } else if (op.type == FLOAT) {
+                            op = slot((char_tp) op.float_val);
+                        } else {
+                            panic("Unsupported type conversion");
                         }
-                        OP_PUSH(res);
-                        SLOT_DECREF(op, "Convert type");
                         DISPATCH;
                     }
 
-                    case PUSH: {
-                        auto *tmp = new frame(esp != nullptr ? esp : nullptr);
-                        esp = tmp;
-                        if (verbose) {
+                    TARGET(PUSH): {
+                        push_frame(stack.top + 1);
+                        if (VERBOSE) {
                             std::cout << "Frame is pushed into the control stack." << std::endl;
                         }
                         FULL_DISPATCH;
                     }
 
-                    case CALL: {
+                    TARGET(PUSH_ARGS): {
+                        // STORE_GLOBAL * k, PUSH, LOAD_GLOBAL * k, bound by link()
+                        push_call_frame(ins->operand);
+                        ip += 2 * ins->operand;
+                        if (VERBOSE) {
+                            std::cout << "Frame is pushed into the control stack, sharing " << ins->operand
+                                      << " arguments with the caller." << std::endl;
+                        }
+                        FULL_DISPATCH;
+                    }
+
+                    TARGET(TAIL_CALL): {
+                        // CALL_ARGS k, RET: the callee takes over the frame and returns to the caller directly
+                        if (esp != nullptr) {
+                            int call = ip + 2 * ins->operand + 1;
+                            slot *base = stack.data + esp->base;
+                            slot *args = stack.data + stack.top + 1 - ins->operand;
+                            for (slot *s = base; s < args; s++) SLOT_DECREF(*s, "Tail call decref");
+                            std::copy(args, args + ins->operand, base);
+                            stack.top = esp->base + ins->operand - 1;
+                            if (VERIFIED) stack.reserve(frame_slots[instructs[call].operand] - ins->operand);
+                            esp->var_cnt = 0;
+                            esp->function = instructs[call].operand;
+                            ip = instructs[call].operand - 1;
+                            if (VERBOSE) {
+                                std::cout << "Frame is reused for the tail call, sharing " << ins->operand
+                                          << " arguments with the caller. Call subroutine defined at address "
+                                          << instructs[ip + 1].address << ", with return address "
+                                          << (esp->return_ip < ins_cnt ? instructs[esp->return_ip].address : -1) << "."
+                                          << std::endl;
+                            }
+                            FULL_DISPATCH;
+                        }
+                        // the top level has no frame to reuse, it makes a plain call
+                        [[fallthrough]];
+                    }
+                    TARGET(CALL_ARGS): {
+                        // PUSH_ARGS k and the CALL after it in one dispatch, bound by link()
+                        int call = ip + 2 * ins->operand + 1;
+                        push_call_frame(ins->operand);
+                        if (VERIFIED) stack.reserve(frame_slots[instructs[call].operand] - ins->operand);
+                        esp->return_ip = call + 1;
+                        esp->function = instructs[call].operand;
+                        ip = instructs[call].operand - 1;
+                        if (VERBOSE) {
+                            std::cout << "Frame is pushed into the control stack, sharing " << ins->operand
+                                      << " arguments with the caller. Call subroutine defined at address "
+                                      << instructs[ip + 1].address << ", with return address "
+                                      << (call < ins_cnt - 1 ? instructs[call + 1].address : -1) << "." << std::endl;
+                        }
+                        FULL_DISPATCH;
+                    }
+
+                    TARGET(CALL): {
+                        if (VERIFIED) {
+                            stack.reserve(frame_slots[ins->operand] - (stack.top + 1 - esp->base));
+                            locals = stack.data + esp->base;
+                        }
                         esp->return_ip = ip + 1;
-                        if (verbose) {
-                            std::cout << "Call subroutine defined at address " << ins.operand
+                        esp->function = ins->operand;
+                        if (VERBOSE) {
+                            std::cout << "Call subroutine defined at address " << instructs[ins->operand].address
                                       << ", with return address "
                                       << (ip < ins_cnt - 1 ? instructs[ip + 1].address : -1) << "." << std::endl;
                         }
-                        ip = addrs[ins.operand] - 1;
+                        ip = ins->operand - 1;
                         DISPATCH;
                     }
 
-                    case RET: {
+                    TARGET(RET): {
                         int to_ip = esp->return_ip - 1;
                         ip = to_ip;
-                        slot *ret;
-                        if (esp->caller == nullptr) {
-                            ret = global_operands[++op_top] = OP_POP();
-                        } else {
-                            ret = esp->caller->local_operands[++esp->caller->op_top] = OP_POP();
-                        }
-                        // 此处不需要对ret进行减引用，因为ret此会在进入了函数之后被减一次
-                        if (verbose) {
+                        // the return value is moved to the caller, its reference goes along with it
+                        slot ret = OP_POP();
+                        if (VERBOSE) {
                             std::cout << "Frame is poped from the control stack. Return to instruct address "
                                       << (to_ip < ins_cnt - 1 ? instructs[to_ip + 1].address : -1)
-                                      << " with return value " << ret->as_string() << "." << std::endl;
-                        }
-                        while (esp->op_top > -1) {
-                            SLOT_DECREF(esp->local_operands[esp->op_top], "Return statement op decref");
-                        }
-                        while (esp->var_cnt--) {
-                            SLOT_DECREF(esp->locals[esp->var_cnt], "Return statement var decref");
+                                      << " with return value " << ret.as_string() << "." << std::endl;
                         }
-                        delete esp->locals;
-                        frame *tmp = esp->caller;
-                        delete esp;
-                        esp = tmp;
+                        pop_frame();
+                        OP_PUSH(ret);
                         FULL_DISPATCH;
                     }
 
-                    case LOAD_NULL: {
-                        slot* slt = new slot();
-                        OP_PUSH(slt);
-                        if (verbose) {
+                    TARGET(LOAD_NULL): {
+                        OP_PUSH(slot());
+                        if (VERBOSE) {
                             std::cout << "NULL value (type: void) was loaded to operand stack." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case LOAD_INT: {
-                        slot *created = new slot((int_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Int value " << ins.operand << " was loaded to operand stack." << std::endl;
+                    TARGET(LOAD_INT): {
+                        OP_PUSH(slot((int_tp) ins->operand));
+                        if (VERBOSE) {
+                            std::cout << "Int value " << ins->operand << " was loaded to operand stack." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case LOAD_FLOAT: {
-                        slot *created = new slot((float_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Float value " << ins.operand << " was loaded to operand stack." << std::endl;
+                    TARGET(LOAD_FLOAT): {
+                        OP_PUSH(slot((float_tp) ins->operand));
+                        if (VERBOSE) {
+                            std::cout << "Float value " << ins->operand << " was loaded to operand stack." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case SIZE_OF: {
-                        slot *element = OP_POP();
-                        SLOT_DECREF(element, "Size of calculate");
+                    TARGET(SIZE_OF): {
+                        slot element = OP_POP();
                         int size;
-                        if (element->type != ARRAY) size = 1;
-                        else size = element->array_size;
-                        OP_PUSH(new slot((int_tp) size));
+                        if (element.type != ARRAY) size = 1;
+                        else size = element.array_val->array_size;
+                        SLOT_DECREF(element, "Size of calculate");
+                        OP_PUSH(slot((int_tp) size));
                         DISPATCH;
                     }
 
-                    case LOAD_CHAR: {
-                        slot *created = new slot((char_tp) ins.operand);
-                        OP_PUSH(created);
-                        if (verbose) {
-                            std::cout << "Char value " << ins.operand << " was loaded to operand stack." << std::endl;
+                    TARGET(LOAD_CHAR): {
+                        OP_PUSH(slot((char_tp) ins->operand));
+                        if (VERBOSE) {
+                            std::cout << "Char value " << ins->operand << " was loaded to operand stack." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case LOAD_CONSTANT: {
-                        slot *constant = constants[ins.operand];
-                        OP_PUSH(constant);
-                        SLOT_INCREF(constant, "LOAD_CONSTANT");
-                        if (verbose) {
-                            std::cout << "Constant value " << constants[ins.operand]->as_string()
+                    TARGET(LOAD_CONSTANT): {
+                        // constants are always scalars, no reference to take
+                        OP_PUSH(constants[ins->operand]);
+                        if (VERBOSE) {
+                            std::cout << "Constant value " << constants[ins->operand].as_string()
                                       << " was loaded to operand stack." << std::endl;
                         }
                         DISPATCH;
                     }
 
-                    case LOAD_NAME: {
-                        slot *var = esp->locals[ins.operand];
-                        OP_PUSH(var);
+                    TARGET(LOAD_NAME): {
+                        slot var = locals[ins->operand];
                         SLOT_INCREF(var, "LOAD_NAME");
-                        if (verbose) {
-                            std::cout << "Loaded name " << ins.operand << "." << std::endl;
+                        OP_PUSH(var);
+                        if (VERBOSE) {
+                            std::cout << "Loaded name " << ins->operand << "." << std::endl;
                         }
                         DISPATCH;
                     }
-                    case LOAD_NAME_GLOBAL: {
-                        slot *var = globals[ins.operand];
-                        OP_PUSH(var);
+                    TARGET(LOAD_NAME_GLOBAL): {
+                        slot var = globals[ins->operand];
                         SLOT_INCREF(var, "LOAD_NAME_GLOBAL");
-                        if (verbose) {
-                            std::cout << "Loaded global name " << ins.operand << "." << std::endl;
+                        OP_PUSH(var);
+                        if (VERBOSE) {
+                            std::cout << "Loaded global name " << ins->operand << "." << std::endl;
                         }
                         DISPATCH;
                     }
-                    case STORE_NAME:
-                    case STORE_NAME_NOPOP: {
+                    TARGET(STORE_NAME):
+                    TARGET(STORE_NAME_NOPOP): {
                         // 千万注意！原来的需要DECREF
-                        if (esp->locals[ins.operand] != nullptr) {
-                            SLOT_DECREF(esp->locals[ins.operand], "Store override");
-                        }
-                        if (ins.code == STORE_NAME) {
-                            esp->locals[ins.operand] = OP_POP();
+                        SLOT_DECREF(locals[ins->operand], "Store override");
+                        if (ins->code == STORE_NAME) {
+                            locals[ins->operand] = OP_POP();
                         } else {
-                            esp->locals[ins.operand] = OP_TOP();
+                            locals[ins->operand] = OP_TOP();
+                            SLOT_INCREF(locals[ins->operand], "STORE_NAME_NOPOP");
                         }
-                        SLOT_INCREF(esp->locals[ins.operand], "STORE_NAME[_NOPOP]");
-                        if (verbose) {
-                            std::cout << "Stored " << esp->locals[ins.operand]->as_string() << " to name " << ins.operand << " in locals."
+                        if (VERBOSE) {
+                            std::cout << "Stored " << locals[ins->operand].as_string() << " to name " << ins->operand << " in locals."
                                       << std::endl;
                         }
                         DISPATCH;
                     }
-                    case STORE_NAME_GLOBAL:
-                    case STORE_NAME_GLOBAL_NOPOP: {
+                    TARGET(STORE_NAME_GLOBAL):
+                    TARGET(STORE_NAME_GLOBAL_NOPOP): {
                         // 千万注意！原来的需要DECREF
-                        if (globals[ins.operand] != nullptr) {
-                            SLOT_DECREF(globals[ins.operand], "Store global override");
-                        }
-                        if (ins.code == STORE_NAME_GLOBAL) {
-                            globals[ins.operand] = OP_POP();
+                        SLOT_DECREF(globals[ins->operand], "Store global override");
+                        if (ins->code == STORE_NAME_GLOBAL) {
+                            globals[ins->operand] = OP_POP();
                         } else {
-                            globals[ins.operand] = OP_TOP();
+                            globals[ins->operand] = OP_TOP();
+                            SLOT_INCREF(globals[ins->operand], "STORE_NAME_GLOBAL_NOPOP");
                         }
-                        SLOT_INCREF(globals[ins.operand], "STORE_NAME_GLOBAL[_NOPOP]");
-                        if (verbose) {
-                            std::cout << "Stored " << globals[ins.operand]->as_string() << " to name " << ins.operand << " in globals."
+                        if (VERBOSE) {
+                            std::cout << "Stored " << globals[ins->operand].as_string() << " to name " << ins->operand << " in globals."
                                       << std::endl;
                         }
                         DISPATCH;
                     }
-                    case JMP: {
-                        ip = addrs[ins.operand] - 1;
-                        if (verbose) {
-                            std::cout << "Jumped to instruction address " << ins.operand << "." << std::endl;
+                    TARGET(JMP): {
+                        ip = ins->operand - 1;
+                        if (VERBOSE) {
+                            std::cout << "Jumped to instruction address " << instructs[ins->operand].address << "." << std::endl;
                         }
                         DISPATCH;
                     }
-                    case JMP_TRUE: {
-                        slot *o = OP_POP();
-                        if (o->int_val) {
-                            ip = addrs[ins.operand] - 1;
-                            if (verbose) {
-                                std::cout << "The condition is true, jumped to instruction address " << ins.operand
+                    TARGET(JMP_TRUE): {
+                        slot o = OP_POP();
+                        if (o.truth()) {
+                            ip = ins->operand - 1;
+                            if (VERBOSE) {
+                                std::cout << "The condition is true, jumped to instruction address " << instructs[ins->operand].address
                                           << "."
                                           << std::endl;
                             }
@@ -675,347 +4744,444 @@ public:
                         SLOT_DECREF(o, "Jmp true instruct poped op from the stack");
                         DISPATCH;
                     }
-                    case JMP_FALSE: {
-                        slot *o = OP_POP();
-                        if (!o->int_val) {
-                            ip = addrs[ins.operand] - 1;
-                            if (verbose) {
-                                std::cout << "The condition is false, jumped to instruction address " << ins.operand
+                    TARGET(JMP_FALSE): {
+                        slot o = OP_POP();
+                        if (!o.truth()) {
+                            ip = ins->operand - 1;
+                            if (VERBOSE) {
+                                std::cout << "The condition is false, jumped to instruction address " << instructs[ins->operand].address
                                           << "." << std::endl;
                             }
                         }
                         SLOT_DECREF(o, "Jmp false instruct poped op from the stack");
                         DISPATCH;
                     }
-                    case UNARY_OP: {
-                        slot *operand = OP_POP();
-
-                        if (ins.operand == 0 || ins.operand == 1) {
-                            slot *res = nullptr;
-                            // NOT
-                            if (ins.operand == 0) {
-                                if (operand->type == INT) {
-                                    res = new slot((int_tp) (operand->int_val ? 0 : 1));
-                                }
-                            }
-                            // NEGATIVE
-                            if (ins.operand == 1) {
-                                if (operand->type == INT) {
-                                    res = new slot(-operand->int_val);
-                                } else if (operand->type == FLOAT) {
-                                    res = new slot(-operand->float_val);
-                                }
-                            }
-
-                            if (res == nullptr) {
-                                panic("Unsupported unary operator");
-                            }
-
-                            OP_PUSH(res);
-                            if (verbose) {
-                                std::cout << "Pop " << operand->as_string() << ", calculate with unary operator "
-                                          << ins.operand << ". Result " << res->as_string()
-                                          << " is pushed into the stack." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Unary-op for the operand, decref it");
-                            DISPATCH;
-                        }
-
-                        // SELF INCREMENT BY ONE
-                        if (ins.operand == 2) {
-                            operand->int_val++;
-                            if (verbose) {
-                                std::cout << "Increased the loaded variable by one." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Increased by one");
-                            DISPATCH;
+                    TARGET(INC_NAME):
+                    TARGET(DEC_NAME):
+                    TARGET(INC_NAME_GLOBAL):
+                    TARGET(DEC_NAME_GLOBAL): {
+                        // LOAD_NAME[_GLOBAL] + UNARY_OP 2/3, bound by link()
+                        slot &var = (ins->code == INC_NAME || ins->code == DEC_NAME) ? locals[ins->operand]
+                                                                                  : globals[ins->operand];
+                        int delta = (ins->code == INC_NAME || ins->code == INC_NAME_GLOBAL) ? 1 : -1;
+                        if (var.type == INT) {
+                            var.int_val += delta;
+                        } else if (var.type == FLOAT) {
+                            var.float_val += delta;
+                        } else if (var.type == CHAR) {
+                            var.char_val = (char_tp) (var.char_val + delta);
                         }
-                        // SELF DECREASEMENT BY ONE
-                        if (ins.operand == 3) {
-                            operand->int_val--;
-                            if (verbose) {
-                                std::cout << "Decreased the loaded variable by one." << std::endl;
-                            }
-                            SLOT_DECREF(operand, "Decreased by one");
-                            DISPATCH;
+                        if (VERBOSE) {
+                            std::cout << (delta > 0 ? "Increased" : "Decreased") << " the loaded variable by one."
+                                      << std::endl;
                         }
+                        DISPATCH;
                     }
-                    case BINARY_OP: {
-                        slot *right = OP_POP();
-                        slot *left = OP_POP();
-
-                        slot *res = nullptr;
-                        // +
-                        if (ins.operand == 0) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val + right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val + right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val + right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val + right->float_val);
-                            }
-                        }
-
-                            // -
-                        else if (ins.operand == 1) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val - right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val - right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val - right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val - right->float_val);
-                            }
-                        }
-
-                            // *
-                        else if (ins.operand == 2) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val * right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val * right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val * right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val * right->float_val);
-                            }
-                        }
-
-                            // %
-                        else if (ins.operand == 3) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val % right->int_val);
-                            }
-                        }
-
-                            // /
-                        else if (ins.operand == 4) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val / right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val / right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val / right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val / right->float_val);
-                            }
-                        }
-
-                            // &
-                        else if (ins.operand == 5) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val & (unsigned int) right->int_val));
-                            }
+                    TARGET(INC_SUBSCR):
+                    TARGET(DEC_SUBSCR): {
+                        // BINARY_SUBSCR + UNARY_OP 2/3, bound by link()
+                        slot source = OP_POP();
+                        slot target = OP_POP();
+                        int subscr = (int) source.int_val;
+                        if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
+                            panic("Array index out of bound");
                         }
-
-                            // |
-                        else if (ins.operand == 6) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val | (unsigned int) right->int_val));
-                            }
+                        array *arr = target.array_val;
+                        int delta = ins->code == INC_SUBSCR ? 1 : -1;
+                        if (arr->element_type == INT) {
+                            arr->ints()[subscr] += delta;
+                        } else if (arr->element_type == FLOAT) {
+                            arr->floats()[subscr] += delta;
+                        } else {
+                            arr->chars()[subscr] = (char_tp) (arr->chars()[subscr] + delta);
                         }
-
-                            // <<
-                        else if (ins.operand == 7) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val << (unsigned int) right->int_val));
-                            }
+                        if (VERBOSE) {
+                            std::cout << (delta > 0 ? "Increased" : "Decreased") << " element with index " << subscr
+                                      << " of the array by one." << std::endl;
                         }
-
-                            // >>
-                        else if (ins.operand == 8) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val >> (unsigned int) right->int_val));
-                            }
+                        SLOT_DECREF(target, "Inc/Dec-subscr array decref");
+                        DISPATCH;
+                    }
+                    TARGET(UNARY_OP): {
+                        // UNARY_OP 2/3 is left by link() where the variable it increases cannot be known
+                        if (ins->operand == 2 || ins->operand == 3) panic("Increase of an unknown variable");
+                        panic("Unsupported unary operator");
+                    }
+                    TARGET(NOT): {
+                        slot operand = OP_TOP();
+                        if (operand.type != INT) {
+                            panic("Unsupported unary operator");
                         }
-
-
-                            // ^
-                        else if (ins.operand == 9) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot((int_tp) ((unsigned int) left->int_val ^ (unsigned int) right->int_val));
-                            }
+                        OP_TOP() = slot((int_tp) (operand.int_val ? 0 : 1));
+                        TRACE_UNARY_OP(operand);
+                        DISPATCH;
+                    }
+                    TARGET(NEG): {
+                        slot operand = OP_TOP();
+                        if (operand.type == INT) {
+                            OP_TOP() = slot(-operand.int_val);
+                        } else if (operand.type == FLOAT) {
+                            OP_TOP() = slot(-operand.float_val);
+                        } else {
+                            panic("Unsupported unary operator");
                         }
-
-                            // <
-                        else if (ins.operand == 10) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val < right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val < right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val < right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val < right->float_val);
-                            }
+                        TRACE_UNARY_OP(operand);
+                        DISPATCH;
+                    }
+                    TARGET(BINARY_OP): {
+                        panic("Unsupported binary operator");
+                    }
+                    // +
+                    TARGET(ADD): {
+                        NUMERIC_BINARY_OP(+, ADD);
+                        DISPATCH;
+                    }
+                    // -
+                    TARGET(SUB): {
+                        NUMERIC_BINARY_OP(-, SUB);
+                        DISPATCH;
+                    }
+                    // *
+                    TARGET(MUL): {
+                        NUMERIC_BINARY_OP(*, MUL);
+                        DISPATCH;
+                    }
+                    // %
+                    TARGET(MOD): {
+                        slot right = OP_POP();
+                        slot left = OP_TOP();
+                        if (left.type != INT || right.type != INT) {
+                            panic("Unsupported binary operator");
                         }
-
-                            // <=
-                        else if (ins.operand == 11) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val <= right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val <= right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val <= right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val <= right->float_val);
-                            }
+                        if (right.int_val == 0) {
+                            panic("Division by zero");
                         }
-
-                            // >
-                        else if (ins.operand == 12) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val > right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val > right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val > right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val > right->float_val);
+                        OP_TOP() = slot(int_mod(left.int_val, right.int_val));
+                        QUICKEN(MOD_INT_INT);
+                        TRACE_BINARY_OP(left, right);
+                        DISPATCH;
+                    }
+                    // /
+                    TARGET(DIV): {
+                        slot right = OP_POP();
+                        slot left = OP_TOP();
+                        if (left.type == INT && right.type == INT) {
+                            if (right.int_val == 0) {
+                                panic("Division by zero");
                             }
+                            OP_TOP() = slot(int_div(left.int_val, right.int_val));
+                            QUICKEN(DIV_INT_INT);
+                        } else if (IS_NUMBER(left) && IS_NUMBER(right)) {
+                            OP_TOP() = slot(AS_FLOAT(left) / AS_FLOAT(right));
+                            if (FLOAT_FLOAT) QUICKEN(DIV_FLOAT_FLOAT);
+                        } else {
+                            panic("Unsupported binary operator");
                         }
-
-                            // >=
-                        else if (ins.operand == 13) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val >= right->int_val);
-                            } else if (left->type == INT && right->type == FLOAT) {
-                                res = new slot(left->int_val >= right->float_val);
-                            } else if (left->type == FLOAT && right->type == INT) {
-                                res = new slot(left->float_val >= right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val >= right->float_val);
-                            }
+                        TRACE_BINARY_OP(left, right);
+                        DISPATCH;
+                    }
+                    // &
+                    TARGET(AND): {
+                        INTEGER_BINARY_OP(&);
+                        DISPATCH;
+                    }
+                    // |
+                    TARGET(OR): {
+                        INTEGER_BINARY_OP(|);
+                        DISPATCH;
+                    }
+                    // <<
+                    TARGET(SHL): {
+                        INTEGER_BINARY_OP(<<);
+                        DISPATCH;
+                    }
+                    // >>
+                    TARGET(SHR): {
+                        INTEGER_BINARY_OP(>>);
+                        DISPATCH;
+                    }
+                    // ^
+                    TARGET(XOR): {
+                        INTEGER_BINARY_OP(^);
+                        DISPATCH;
+                    }
+                    // <
+                    TARGET(LT): {
+                        COMPARE_BINARY_OP(<, LT);
+                        DISPATCH;
+                    }
+                    // <=
+                    TARGET(LE): {
+                        COMPARE_BINARY_OP(<=, LE);
+                        DISPATCH;
+                    }
+                    // >
+                    TARGET(GT): {
+                        COMPARE_BINARY_OP(>, GT);
+                        DISPATCH;
+                    }
+                    // >=
+                    TARGET(GE): {
+                        COMPARE_BINARY_OP(>=, GE);
+                        DISPATCH;
+                    }
+                    // ==
+                    TARGET(EQ): {
+                        EQUALITY_BINARY_OP(==, EQ, false);
+                        DISPATCH;
+                    }
+                    // !=
+                    TARGET(NE): {
+                        EQUALITY_BINARY_OP(!=, NE, true);
+                        DISPATCH;
+                    }
+                    // Quickened operators
+                    TARGET(ADD_INT_INT): {
+                        GUARDED_BINARY_OP(ADD, INT_INT, left.int_val + right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(SUB_INT_INT): {
+                        GUARDED_BINARY_OP(SUB, INT_INT, left.int_val - right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(MUL_INT_INT): {
+                        GUARDED_BINARY_OP(MUL, INT_INT, left.int_val * right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(DIV_INT_INT): {
+                        GUARDED_BINARY_OP(DIV, INT_INT && right.int_val != 0, int_div(left.int_val, right.int_val));
+                        DISPATCH;
+                    }
+                    TARGET(MOD_INT_INT): {
+                        GUARDED_BINARY_OP(MOD, INT_INT && right.int_val != 0, int_mod(left.int_val, right.int_val));
+                        DISPATCH;
+                    }
+                    TARGET(LT_INT_INT): {
+                        GUARDED_BINARY_OP(LT, INT_INT, left.int_val < right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(LE_INT_INT): {
+                        GUARDED_BINARY_OP(LE, INT_INT, left.int_val <= right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(GT_INT_INT): {
+                        GUARDED_BINARY_OP(GT, INT_INT, left.int_val > right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(GE_INT_INT): {
+                        GUARDED_BINARY_OP(GE, INT_INT, left.int_val >= right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(EQ_INT_INT): {
+                        GUARDED_BINARY_OP(EQ, INT_INT, left.int_val == right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(NE_INT_INT): {
+                        GUARDED_BINARY_OP(NE, INT_INT, left.int_val != right.int_val);
+                        DISPATCH;
+                    }
+                    TARGET(ADD_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(ADD, FLOAT_FLOAT, left.float_val + right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(SUB_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(SUB, FLOAT_FLOAT, left.float_val - right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(MUL_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(MUL, FLOAT_FLOAT, left.float_val * right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(DIV_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(DIV, FLOAT_FLOAT, left.float_val / right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(LT_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(LT, FLOAT_FLOAT, left.float_val < right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(LE_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(LE, FLOAT_FLOAT, left.float_val <= right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(GT_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(GT, FLOAT_FLOAT, left.float_val > right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(GE_FLOAT_FLOAT): {
+                        GUARDED_BINARY_OP(GE, FLOAT_FLOAT, left.float_val >= right.float_val);
+                        DISPATCH;
+                    }
+                    TARGET(ADD_LOCAL_IMM):
+                    TARGET(SUB_LOCAL_IMM):
+                    TARGET(ADD_GLOBAL_IMM):
+                    TARGET(SUB_GLOBAL_IMM): {
+                        // LOAD_NAME x, LOAD_INT k, ADD/SUB, STORE_NAME y
+                        slot *vars = (ins->code == ADD_LOCAL_IMM || ins->code == SUB_LOCAL_IMM) ? locals : globals;
+                        slot x = vars[ins->operand];
+                        int_tp k = (ins->code == ADD_LOCAL_IMM || ins->code == ADD_GLOBAL_IMM) ? ins[1].operand
+                                                                                               : -(int_tp) ins[1].operand;
+                        slot res;
+                        if (x.type == INT) {
+                            res = slot(x.int_val + k);
+                        } else if (x.type == FLOAT) {
+                            res = slot(x.float_val + (float_tp) k);
+                        } else {
+                            FUSED_FALLBACK(vars);
                         }
-
-                        // ==
-                        else if (ins.operand == 14) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val == right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val == right->float_val);
-                            } else if (left->type == CHAR && right->type == CHAR) {
-                                res = new slot(left->char_val == right->char_val);
-                            } else {
-                                res = new slot(false);
-                            }
+                        slot &y = vars[ins[3].operand];
+                        SLOT_DECREF(y, "Store override");
+                        y = res;
+                        if (VERBOSE) {
+                            std::cout << "Stored " << res.as_string() << " to name " << ins[3].operand << "." << std::endl;
                         }
-
-                            // !=
-                        else if (ins.operand == 15) {
-                            if (left->type == INT && right->type == INT) {
-                                res = new slot(left->int_val != right->int_val);
-                            } else if (left->type == FLOAT && right->type == FLOAT) {
-                                res = new slot(left->float_val != right->float_val);
-                            } else if (left->type == CHAR && right->type == CHAR) {
-                                res = new slot(left->char_val != right->char_val);
-                            } else {
-                                res = new slot(true);
-                            }
+                        ip += 3;
+                        DISPATCH;
+                    }
+                    FUSED_COMPARE_JMP_FALSE(CMP_LT_JMP_FALSE_LOCALS, CMP_LT_JMP_FALSE_GLOBALS, <)
+                    FUSED_COMPARE_JMP_FALSE(CMP_LE_JMP_FALSE_LOCALS, CMP_LE_JMP_FALSE_GLOBALS, <=)
+                    FUSED_COMPARE_JMP_FALSE(CMP_GT_JMP_FALSE_LOCALS, CMP_GT_JMP_FALSE_GLOBALS, >)
+                    FUSED_COMPARE_JMP_FALSE(CMP_GE_JMP_FALSE_LOCALS, CMP_GE_JMP_FALSE_GLOBALS, >=)
+                    TARGET(LOAD_ELEM_LOCAL):
+                    TARGET(LOAD_ELEM_GLOBAL): {
+                        // LOAD_NAME a, LOAD_NAME i, BINARY_SUBSCR, the array is read in place without a reference
+                        slot *vars = ins->code == LOAD_ELEM_LOCAL ? locals : globals;
+                        slot target = vars[ins->operand];
+                        if (target.type != ARRAY) {
+                            FUSED_FALLBACK(vars);
                         }
-
-                        if (res == nullptr) {
-                            panic("Unsupported binary operator");
+                        int subscr = (int) vars[ins[1].operand].int_val;
+                        if (subscr < 0 || subscr >= target.array_val->array_size) {
+                            panic("Array index out of bound");
                         }
-
-                        OP_PUSH(res);
-                        if (verbose) {
-                            std::cout << "Pop " << left->as_string() << " and " << right->as_string()
-                                      << ", calculate with binary operator " << ins.operand << ". Result "
-                                      << res->as_string() << " is pushed into the stack." << std::endl;
+                        OP_PUSH(target.array_val->get(subscr));
+                        if (VERBOSE) {
+                            std::cout << "Loaded element with index " << subscr << " of the array." << std::endl;
                         }
-                        SLOT_DECREF(left, "Bin-Op Left operand decref");
-                        SLOT_DECREF(right, "Bin-Op Right operand decref");
+                        ip += 2;
                         DISPATCH;
                     }
-                    case HALT: {
-                        if (verbose) {
+                    TARGET(HALT): {
+                        if (VERBOSE) {
                             std::cout << "Program received HALT signal, terminating..." << std::endl;
                         }
-                        goto finish;
+                        this->ip = ip;
+                        return;
+                    }
+                    TARGET(BREAK): {
+                        // the debugger puts back the instruction it replaced before it resumes the machine
+                        status = BREAKPOINT;
+                        n_ins--;
+                        this->ip = ip - 1;
+                        return;
                     }
-                    case PRINTK: {
-                        slot *slot = OP_POP();
-                        std::cout << slot->as_string() << std::endl;
+                    TARGET(PRINTK): {
+                        slot slot = OP_POP();
+                        output.print(slot);
+                        // the debugger writes to the console directly
+                        if (VERBOSE) output.flush();
                         SLOT_DECREF(slot, "Printk");
                         DISPATCH;
                     }
-                    case PUTCH: {
-                        slot *slot = OP_POP();
+                    TARGET(PUTCH): {
+                        slot slot = OP_POP();
+                        output.put(slot.put_char());
+                        if (VERBOSE) output.flush();
                         SLOT_DECREF(slot, "Putch");
-                        std::cout << slot->char_val;
                         DISPATCH;
                     }
-                    case GETCH: {
-                        OP_PUSH(new slot((char_tp) getchar()));
+                    TARGET(PUTS): {
+                        slot slot = OP_POP();
+                        puts_array(slot);
+                        if (VERBOSE) {
+                            output.flush();
+                            std::cout << "Wrote the chars of " << slot.as_string() << "." << std::endl;
+                        }
+                        SLOT_DECREF(slot, "Puts");
+                        DISPATCH;
+                    }
+                    TARGET(GETCH): {
+                        if (slicing && !input_ready()) {
+                            // run again by the next slice
+                            status = WAITING_INPUT;
+                            n_ins--;
+                            this->ip = ip - 1;
+                            return;
+                        }
+                        OP_PUSH(slot(read_char()));
                         DISPATCH;
                     }
-                    case STORE_GLOBAL: {
-                        slot *val = OP_POP();
-                        global_operands[++op_top] = val;
-                        if (verbose) {
-                            std::cout << "Pushed local value " << val->as_string() << " into global operands."
+                    TARGET(STORE_GLOBAL): {
+                        slot val = OP_POP();
+                        global_operands.reserve(1);
+                        global_operands.data[++global_operands.top] = val;
+                        if (VERBOSE) {
+                            std::cout << "Pushed local value " << val.as_string() << " into global operands."
                                       << std::endl;
                         }
                         DISPATCH;
                     }
-                    case LOAD_GLOBAL: {
-                        slot *val = global_operands[op_top];
-                        op_top--;
-                        OP_PUSH(val);
-                        if (verbose) {
-                            std::cout << "Pushed global value " << val->as_string() << " into local operands."
+                    TARGET(LOAD_GLOBAL): {
+                        slot val = global_operands.data[global_operands.top--];
+                        // the operands of a frame pushed are not reserved before its CALL
+                        if (operands->top + 1 == operands->capacity) grow_stack();
+                        operands->data[++operands->top] = val;
+                        if (VERBOSE) {
+                            std::cout << "Pushed global value " << val.as_string() << " into local operands."
                                       << std::endl;
                         }
                         DISPATCH;
                     }
-                    case BUILD_ARR: {
+                    TARGET(BUILD_ARR): {
                         basic_data_types type = VOID;
-                        if (ins.operand == 0) {
+                        if (ins->operand == 0) {
                             type = INT;
-                        } else if (ins.operand == 1) {
+                        } else if (ins->operand == 1) {
                             type = FLOAT;
-                        } else if (ins.operand == 2) {
+                        } else if (ins->operand == 2) {
                             type = CHAR;
                         } else {
                             panic("Unexpected type");
                         }
-                        int val = OP_POP()->int_val;
-                        slot *tmp = new slot(val, type);
-                        OP_PUSH(tmp);
-                        if (verbose) {
-                            std::cout << "Built array " << ins.operand << "[" << val << "]." << std::endl;
+                        slot size = OP_POP();
+                        if (size.type == ARRAY) {
+                            // the popped size was a reference of its own
+                            SLOT_DECREF(size, "Array size");
+                            panic("Array size must be a scalar");
+                        }
+                        int val = (int) scalar_as<int_tp>(size);
+                        if (val < 0) {
+                            panic("Negative array size");
+                        }
+                        OP_PUSH(slot(build_array(type, val)));
+                        if (VERBOSE) {
+                            std::cout << "Built array " << ins->operand << "[" << val << "]." << std::endl;
                         }
                         DISPATCH;
                     }
-                    case BINARY_SUBSCR: {
+                    TARGET(BINARY_SUBSCR): {
                         /*
                          * e.g.
                          * LOAD_NAME a
                          * LOAD_INT 4
                          * BINARY_SUBSCR
                          */
-                        slot *source = OP_POP();
-                        slot *target = OP_POP();
-                        int subscr = source->int_val;
-                        if (subscr < 0 || subscr >= target->array_size) {
+                        slot source = OP_POP();
+                        slot target = OP_POP();
+                        int subscr = (int) source.int_val;
+                        if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
                             panic("Array index out of bound");
                         }
-                        slot *fresh = OP_PUSH(*(target->array_val + subscr));
-                        if (verbose) {
+                        OP_PUSH(target.array_val->get(subscr));
+                        if (VERBOSE) {
                             std::cout << "Loaded element with index " << subscr << " of the array." << std::endl;
                         }
-                        SLOT_DECREF(source, "Binary-subscr array index decref");
-                        SLOT_INCREF(fresh, "Array value is referenced");
+                        SLOT_DECREF(target, "Binary-subscr array decref");
                         DISPATCH;
                     }
-                    case STORE_SUBSCR:
-                    case STORE_SUBSCR_INPLACE:
-                    case STORE_SUBSCR_NOPOP: {
+                    TARGET(STORE_SUBSCR):
+                    TARGET(STORE_SUBSCR_INPLACE):
+                    TARGET(STORE_SUBSCR_NOPOP): {
                         /*
                          * e.g.
                          * LOAD_NAME a
@@ -1023,190 +5189,1456 @@ public:
                          * LOAD_INT 5
                          * a[4] = 5;
                          */
-                        slot *val = OP_POP();
-                        slot *p_subscr = OP_POP();
-                        int subscr = p_subscr->int_val;
-                        slot *target = OP_TOP();
-                        if (subscr < 0 || subscr >= target->array_size) {
+                        slot val = OP_POP();
+                        slot p_subscr = OP_POP();
+                        int subscr = (int) p_subscr.int_val;
+                        slot target = OP_TOP();
+                        if (target.type != ARRAY || subscr < 0 || subscr >= target.array_val->array_size) {
                             panic("Array index out of bound");
                         }
-                        SLOT_DECREF(target->array_val[subscr], "Array element store subscr");
-                        target->array_val[subscr] = val;
-                        if (verbose) {
+                        target.array_val->set(subscr, val);
+                        if (VERBOSE) {
                             std::cout << "Changed element with index " << subscr << " of the array to "
-                                      << val->as_string() << "." << std::endl;
+                                      << val.as_string() << "." << std::endl;
                         }
 
-                        if (ins.code != STORE_SUBSCR_INPLACE) {
-                            OP_POP();
+                        if (ins->code != STORE_SUBSCR_INPLACE) {
+                            operands->top--;
+                            SLOT_DECREF(target, "Poped target array");
                         }
-                        if (ins.code == STORE_SUBSCR_NOPOP) {
+                        if (ins->code == STORE_SUBSCR_NOPOP) {
                             OP_PUSH(val);
                         }
-                        SLOT_DECREF(p_subscr, "Poped target subscr");
                         DISPATCH;
                     }
-                    default: {
+                    TARGET(ARR_FILL): {
+                        slot val = OP_POP();
+                        array *arr = pop_array();
+                        if (arr->element_type == INT) {
+                            std::fill_n(arr->ints(), arr->array_size, scalar_as<int_tp>(val));
+                        } else if (arr->element_type == FLOAT) {
+                            std::fill_n(arr->floats(), arr->array_size, scalar_as<float_tp>(val));
+                        } else {
+                            std::fill_n(arr->chars(), arr->array_size, scalar_as<char_tp>(val));
+                        }
+                        if (VERBOSE) {
+                            std::cout << "Filled the array with " << val.as_string() << "." << std::endl;
+                        }
+                        release_array(arr);
+                        DISPATCH;
+                    }
+                    TARGET(ARR_COPY): {
+                        array *src = pop_array();
+                        array *dst = pop_array();
+                        check_same_shape(dst, src);
+                        memmove(dst->elements, src->elements, dst->bytes());
+                        if (VERBOSE) {
+                            std::cout << "Copied " << src->array_size << " elements between arrays." << std::endl;
+                        }
+                        release_array(src);
+                        release_array(dst);
+                        DISPATCH;
+                    }
+                    TARGET(ARR_ADD):
+                    TARGET(ARR_MUL): {
+                        // dst = a + b or a * b, elementwise
+                        array *b = pop_array();
+                        array *a = pop_array();
+                        array *dst = pop_array();
+                        check_same_shape(dst, a);
+                        check_same_shape(dst, b);
+                        bool add = ins->code == ARR_ADD;
+                        int n = dst->array_size;
+                        if (dst->element_type == INT) {
+                            (add ? bulk.add_int : bulk.mul_int)(dst->ints(), a->ints(), b->ints(), n);
+                        } else if (dst->element_type == FLOAT) {
+                            (add ? bulk.add_float : bulk.mul_float)(dst->floats(), a->floats(), b->floats(), n);
+                        } else {
+                            for (int i = 0; i < n; i++) {
+                                dst->chars()[i] = (char_tp) (add ? a->chars()[i] + b->chars()[i]
+                                                                 : a->chars()[i] * b->chars()[i]);
+                            }
+                        }
+                        if (VERBOSE) {
+                            std::cout << (add ? "Added" : "Multiplied") << " " << n << " elements of arrays." << std::endl;
+                        }
+                        release_array(a);
+                        release_array(b);
+                        release_array(dst);
+                        DISPATCH;
+                    }
+                    TARGET(ARR_SUM):
+                    TARGET(ARR_MIN):
+                    TARGET(ARR_MAX): {
+                        array *arr = pop_array();
+                        int n = arr->array_size;
+                        if (ins->code != ARR_SUM && n == 0) {
+                            panic("Empty array");
+                        }
+                        slot res;
+                        if (arr->element_type == INT) {
+                            res = slot(ins->code == ARR_SUM ? bulk.sum_int(arr->ints(), n)
+                                       : ins->code == ARR_MIN ? bulk.min_int(arr->ints(), n)
+                                       : bulk.max_int(arr->ints(), n));
+                        } else if (arr->element_type == FLOAT) {
+                            res = slot(ins->code == ARR_SUM ? bulk.sum_float(arr->floats(), n)
+                                       : ins->code == ARR_MIN ? bulk.min_float(arr->floats(), n)
+                                       : bulk.max_float(arr->floats(), n));
+                        } else if (ins->code == ARR_SUM) {
+                            // the sum of chars is an int
+                            int_tp sum = 0;
+                            for (int i = 0; i < n; i++) sum += arr->chars()[i];
+                            res = slot(sum);
+                        } else {
+                            const char_tp *chars = arr->chars();
+                            res = slot(ins->code == ARR_MIN ? *std::min_element(chars, chars + n)
+                                                            : *std::max_element(chars, chars + n));
+                        }
+                        if (VERBOSE) {
+                            std::cout << "Reduced " << n << " elements of the array to " << res.as_string() << "."
+                                      << std::endl;
+                        }
+                        release_array(arr);
+                        OP_PUSH(res);
+                        DISPATCH;
+                    }
+                    TARGET(ARR_DOT): {
+                        array *b = pop_array();
+                        array *a = pop_array();
+                        check_same_shape(a, b);
+                        int n = a->array_size;
+                        slot res;
+                        if (a->element_type == INT) {
+                            res = slot(bulk.dot_int(a->ints(), b->ints(), n));
+                        } else if (a->element_type == FLOAT) {
+                            res = slot(bulk.dot_float(a->floats(), b->floats(), n));
+                        } else {
+                            int_tp sum = 0;
+                            for (int i = 0; i < n; i++) sum += (int_tp) a->chars()[i] * b->chars()[i];
+                            res = slot(sum);
+                        }
+                        if (VERBOSE) {
+                            std::cout << "Dot product of arrays is " << res.as_string() << "." << std::endl;
+                        }
+                        release_array(a);
+                        release_array(b);
+                        OP_PUSH(res);
+                        DISPATCH;
+                    }
+                    default:
+#ifdef USE_COMPUTED_GOTO
+                    unknown_opcode:
+#endif
+                    {
                         panic("Unexpected instruction");
                         break;
                     }
                 }
             }
         }
-        finish:
-        {
-            if (evaluator) {
-                finish = clock();
-                double time_delta = (double) (finish - start) / CLOCKS_PER_SEC;
-                std::cout << "<<<<<* Performance evaluator *>>>>>" << std::endl;
-                std::cout << n_ins << " instructions executed in total" << std::endl;
-                std::cout << "Time consumotion(s): " << std::fixed << std::setprecision(8) << time_delta << std::endl;
-                std::cout << "MIPS: " << std::fixed << std::setprecision(8) << (double) n_ins / time_delta * 1e-6 << std::endl;
+    }
+};
+
+std::unordered_map<std::string, instruct_code> Machine::string_inscode_mapping;
+std::unordered_map<std::string, instruct_code> Machine::internal_inscode_mapping;
+int Machine::inscode_param_cnt_mapping[200];
+std::string Machine::code_names[INSTRUCT_CODE_NUM];
+
+// Binary bytecode (.slb), in native byte order:
+// header | constant pool | packed instructions | address table (address -> instruction index, -1 if none)
+// Everything after the header is XORed with the password when one is given.
+enum slb_flags {
+    SLB_ENCRYPTED = 1
+};
+
+struct slb_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t constant_cnt;
+    uint32_t ins_cnt;
+    uint32_t addr_cnt;
+    uint32_t constants_offset;
+    uint32_t instructs_offset;
+    uint32_t addrs_offset;
+};
+
+struct slb_constant {
+    int32_t type;
+    int32_t reserved;
+    union {
+        int64_t int_val;
+        double float_val;
+    };
+};
+
+struct slb_instruct {
+    int32_t address;
+    int32_t code;
+    int32_t operand;
+};
+
+// Read-only view of a whole file, private pages so that it can be decrypted in place
+struct mapped_file {
+    char *data = nullptr;
+    size_t size = 0;
+
+    explicit mapped_file(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) panic("Cannot open " + path);
+        struct stat st{};
+        if (fstat(fd, &st) < 0) panic("Cannot stat " + path);
+        size = st.st_size;
+        if (size) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) panic("Cannot map " + path);
+            data = static_cast<char *>(p);
+        }
+        close(fd);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    ~mapped_file() {
+        if (data != nullptr) munmap(data, size);
+    }
+
+    bool is_binary() const {
+        return size >= sizeof(slb_header) && memcmp(data, SLB_MAGIC, 4) == 0;
+    }
+};
+
+void xor_bytes(char *data, size_t size, std::string password) {
+    password = MAGIC + password;
+    size_t len = password.length();
+    for (size_t i = 0; i < size; i++) data[i] = (char) ((unsigned int) data[i] ^ (unsigned int) password[i % len]);
+}
+
+// Check the sections of a mapped binary against its size, decrypting them if needed
+const slb_header &open_binary(mapped_file &file, const std::string &password) {
+    const auto &hd = *reinterpret_cast<const slb_header *>(file.data);
+    if (hd.version != SLB_VERSION) panic("Unsupported bytecode version");
+    if (hd.flags & SLB_ENCRYPTED) {
+        if (password.empty()) panic("Password required");
+        xor_bytes(file.data + sizeof(slb_header), file.size - sizeof(slb_header), password);
+    }
+    if (hd.ins_cnt > MAX_INSTRUCTION_NUM || hd.addr_cnt > MAX_INSTRUCTION_ADDR + 1 ||
+        (uint64_t) hd.constants_offset + (uint64_t) hd.constant_cnt * sizeof(slb_constant) > file.size ||
+        (uint64_t) hd.instructs_offset + (uint64_t) hd.ins_cnt * sizeof(slb_instruct) > file.size ||
+        (uint64_t) hd.addrs_offset + (uint64_t) hd.addr_cnt * sizeof(int32_t) > file.size) {
+        panic("Corrupted bytecode");
+    }
+    return hd;
+}
+
+template<typename T>
+const T *binary_section(const mapped_file &file, uint32_t offset) {
+    return reinterpret_cast<const T *>(file.data + offset);
+}
+
+slot constant_slot(const slb_constant &c) {
+    switch (c.type) {
+        case INT:
+            return slot((int_tp) c.int_val);
+        case FLOAT:
+            return slot((float_tp) c.float_val);
+        case CHAR:
+            return slot((char_tp) c.int_val);
+        default:
+            panic("Unexpected type");
+    }
+    return slot();
+}
+
+// Machine snapshot (.svs), in native byte order like binaries:
+// header | constants | instructions | address table | frames | slots (globals, stack, global operands) | arrays |
+// elements, page aligned so that they are used in place from the copy-on-write mapping
+struct snapshot_header {
+    char magic[4];
+    uint32_t version;
+    int32_t ip;
+    uint32_t constant_cnt;
+    uint32_t ins_cnt;
+    uint32_t addr_cnt;
+    uint32_t frame_cnt;
+    uint32_t global_cnt;
+    uint32_t stack_cnt;
+    uint32_t global_operand_cnt;
+    uint32_t array_cnt;
+    uint32_t reserved;
+    uint64_t constants_offset;
+    uint64_t instructs_offset;
+    uint64_t addrs_offset;
+    uint64_t frames_offset;
+    uint64_t slots_offset;
+    uint64_t arrays_offset;
+    uint64_t elements_offset;
+    uint64_t size;
+};
+
+struct snapshot_frame {
+    int32_t base;
+    int32_t var_cnt;
+    int32_t return_ip;
+    int32_t function;
+};
+
+// An array slot holds the index of its array
+typedef slb_constant snapshot_slot;
+
+struct snapshot_array {
+    int32_t element_type;
+    int32_t size;
+    int32_t ref_cnt;
+    int32_t reserved;
+    uint64_t offset;
+};
+
+bool is_snapshot(const std::string &path) {
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    char magic[4]{};
+    file.read(magic, 4);
+    return file && memcmp(magic, SNAPSHOT_MAGIC, 4) == 0;
+}
+
+void Machine::save_snapshot(const std::string &path) {
+    if (code == nullptr || status == HALTED) panic("Only a stopped program can be saved");
+    output.flush();
+    // arrays are numbered as they are found, their references are counted again from the slots saved
+    std::unordered_map<const array *, uint32_t> index;
+    std::vector<snapshot_array> arrays;
+    std::vector<const array *> order;
+    std::vector<snapshot_slot> slots;
+    auto save = [&](const slot &val) {
+        snapshot_slot ss{};
+        ss.type = val.type;
+        if (val.type == INT) {
+            ss.int_val = val.int_val;
+        } else if (val.type == FLOAT) {
+            ss.float_val = val.float_val;
+        } else if (val.type == CHAR) {
+            ss.int_val = val.char_val;
+        } else if (val.type == ARRAY) {
+            auto it = index.find(val.array_val);
+            if (it == index.end()) {
+                it = index.emplace(val.array_val, (uint32_t) arrays.size()).first;
+                snapshot_array sa{};
+                sa.element_type = val.array_val->element_type;
+                sa.size = val.array_val->array_size;
+                arrays.push_back(sa);
+                order.push_back(val.array_val);
+            }
+            arrays[it->second].ref_cnt++;
+            ss.int_val = it->second;
+        }
+        slots.push_back(ss);
+    };
+    for (int i = 0; i < var_cnt; i++) save(globals[i]);
+    for (int i = 0; i <= stack.top; i++) save(stack.data[i]);
+    for (int i = 0; i <= global_operands.top; i++) save(global_operands.data[i]);
+
+    snapshot_header hd{};
+    memcpy(hd.magic, SNAPSHOT_MAGIC, 4);
+    hd.version = SNAPSHOT_VERSION;
+    hd.ip = ip;
+    hd.constant_cnt = code->constants.size();
+    hd.ins_cnt = instructions.size();
+    hd.addr_cnt = code->addrs.size();
+    hd.frame_cnt = frames.size();
+    hd.global_cnt = var_cnt;
+    hd.stack_cnt = stack.top + 1;
+    hd.global_operand_cnt = global_operands.top + 1;
+    hd.array_cnt = arrays.size();
+    hd.constants_offset = (sizeof(snapshot_header) + 7) & ~7;
+    hd.instructs_offset = hd.constants_offset + hd.constant_cnt * sizeof(slb_constant);
+    hd.addrs_offset = hd.instructs_offset + hd.ins_cnt * sizeof(slb_instruct);
+    hd.frames_offset = (hd.addrs_offset + hd.addr_cnt * sizeof(int32_t) + 7) & ~7;
+    hd.slots_offset = hd.frames_offset + hd.frame_cnt * sizeof(snapshot_frame);
+    hd.arrays_offset = hd.slots_offset + slots.size() * sizeof(snapshot_slot);
+    long page = sysconf(_SC_PAGESIZE);
+    hd.elements_offset = (hd.arrays_offset + arrays.size() * sizeof(snapshot_array) + page - 1) / page * page;
+    uint64_t offset = hd.elements_offset;
+    for (size_t i = 0; i < arrays.size(); i++) {
+        arrays[i].offset = offset;
+        offset = (offset + order[i]->bytes() + 15) & ~15;
+    }
+    hd.size = offset;
+
+    std::string buf(hd.size, '\0');
+    memcpy(&buf[0], &hd, sizeof(hd));
+    auto *constants = reinterpret_cast<slb_constant *>(&buf[hd.constants_offset]);
+    for (size_t i = 0; i < code->constants.size(); i++) {
+        const slot &c = code->constants[i];
+        constants[i].type = c.type;
+        if (c.type == FLOAT) constants[i].float_val = c.float_val;
+        else constants[i].int_val = c.type == CHAR ? c.char_val : c.int_val;
+    }
+    auto *ins = reinterpret_cast<slb_instruct *>(&buf[hd.instructs_offset]);
+    for (size_t i = 0; i < instructions.size(); i++) {
+        ins[i] = slb_instruct{instructions[i].address, instructions[i].code, instructions[i].operand};
+    }
+    std::copy(code->addrs.begin(), code->addrs.end(), reinterpret_cast<int32_t *>(&buf[hd.addrs_offset]));
+    auto *fs = reinterpret_cast<snapshot_frame *>(&buf[hd.frames_offset]);
+    for (size_t i = 0; i < frames.size(); i++) {
+        fs[i] = snapshot_frame{frames[i].base, frames[i].var_cnt, frames[i].return_ip, frames[i].function};
+    }
+    std::copy(slots.begin(), slots.end(), reinterpret_cast<snapshot_slot *>(&buf[hd.slots_offset]));
+    std::copy(arrays.begin(), arrays.end(), reinterpret_cast<snapshot_array *>(&buf[hd.arrays_offset]));
+    for (size_t i = 0; i < arrays.size(); i++) {
+        if (order[i]->array_size) memcpy(&buf[arrays[i].offset], order[i]->elements, order[i]->bytes());
+    }
+    std::ofstream file(path, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!file.write(buf.data(), buf.size())) panic("Cannot write " + path);
+}
+
+void Machine::restore_snapshot(const std::string &path) {
+    reset();
+    unmap_image();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) panic("Cannot open " + path);
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        panic("Corrupted snapshot");
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) panic("Cannot map " + path);
+    image = static_cast<char *>(p);
+    image_size = st.st_size;
+    const auto &hd = *reinterpret_cast<const snapshot_header *>(image);
+    uint64_t slot_cnt = (uint64_t) hd.global_cnt + hd.stack_cnt + hd.global_operand_cnt;
+    auto fits = [&](uint64_t offset, uint64_t bytes) { return offset <= image_size && bytes <= image_size - offset; };
+    if (memcmp(hd.magic, SNAPSHOT_MAGIC, 4) != 0 || hd.version != SNAPSHOT_VERSION || hd.size != image_size ||
+        hd.ins_cnt == 0 || hd.ins_cnt > MAX_INSTRUCTION_NUM + 1 || hd.stack_cnt > MAX_STACK_SIZE ||
+        hd.global_operand_cnt > MAX_STACK_SIZE || hd.ip < -1 || hd.ip >= (int32_t) hd.ins_cnt ||
+        !fits(hd.constants_offset, (uint64_t) hd.constant_cnt * sizeof(slb_constant)) ||
+        !fits(hd.instructs_offset, (uint64_t) hd.ins_cnt * sizeof(slb_instruct)) ||
+        !fits(hd.addrs_offset, (uint64_t) hd.addr_cnt * sizeof(int32_t)) ||
+        !fits(hd.frames_offset, (uint64_t) hd.frame_cnt * sizeof(snapshot_frame)) ||
+        !fits(hd.slots_offset, slot_cnt * sizeof(snapshot_slot)) ||
+        !fits(hd.arrays_offset, (uint64_t) hd.array_cnt * sizeof(snapshot_array))) {
+        panic("Corrupted snapshot");
+    }
+
+    Program program;
+    const auto *constants = reinterpret_cast<const slb_constant *>(image + hd.constants_offset);
+    for (uint32_t i = 0; i < hd.constant_cnt; i++) program.constants.push_back(constant_slot(constants[i]));
+    const auto *ins = reinterpret_cast<const slb_instruct *>(image + hd.instructs_offset);
+    program.instructs.reserve(hd.ins_cnt);
+    for (uint32_t i = 0; i < hd.ins_cnt; i++) {
+        if (ins[i].code < 0 || ins[i].code >= INSTRUCT_CODE_NUM) panic("Corrupted snapshot");
+        if (Program::is_jump(instruct_code(ins[i].code)) && (ins[i].operand < 0 || ins[i].operand >= (int) hd.ins_cnt)) {
+            panic("Corrupted snapshot");
+        }
+        program.instructs.emplace_back(ins[i].address, instruct_code(ins[i].code), ins[i].operand);
+    }
+    const auto *addrs = reinterpret_cast<const int32_t *>(image + hd.addrs_offset);
+    program.addrs.assign(addrs, addrs + hd.addr_cnt);
+    // the instructions were linked and quickened by the machine saved
+    program.linked = true;
+    program.unverified = "the program was restored from a snapshot";
+    load(std::make_shared<const Program>(std::move(program)));
+
+    // elements are used in place, the first write to one of their pages copies it
+    std::vector<array *> arrays(hd.array_cnt);
+    const auto *sa = reinterpret_cast<const snapshot_array *>(image + hd.arrays_offset);
+    image_elements = reinterpret_cast<uintptr_t>(image + hd.elements_offset);
+    image_end = reinterpret_cast<uintptr_t>(image + image_size);
+    for (uint32_t i = 0; i < hd.array_cnt; i++) {
+        auto type = basic_data_types(sa[i].element_type);
+        if (type != INT && type != FLOAT && type != CHAR) panic("Corrupted snapshot");
+        uint64_t bytes = (uint64_t) array::element_size(type) * (uint32_t) sa[i].size;
+        if (sa[i].size < 0 || sa[i].ref_cnt <= 0 || sa[i].offset < hd.elements_offset || !fits(sa[i].offset, bytes)) {
+            panic("Corrupted snapshot");
+        }
+        arrays[i] = array_pool.create(sa[i].size ? image + sa[i].offset : nullptr, sa[i].size, type, false);
+        arrays[i]->ref_cnt = sa[i].ref_cnt;
+        memory.array_built(arrays[i]);
+    }
+    const auto *ss = reinterpret_cast<const snapshot_slot *>(image + hd.slots_offset);
+    auto restore = [&](const snapshot_slot &s) {
+        if (s.type == ARRAY) {
+            if (s.int_val < 0 || s.int_val >= (int64_t) arrays.size()) panic("Corrupted snapshot");
+            return slot(arrays[s.int_val]);
+        }
+        return s.type == VOID ? slot() : constant_slot(s);
+    };
+    if (hd.global_cnt) {
+        globals = new slot[hd.global_cnt];
+        var_cnt = (int) hd.global_cnt;
+        memory.peak_globals = var_cnt;
+        for (uint32_t i = 0; i < hd.global_cnt; i++) globals[i] = restore(*ss++);
+    }
+    stack.reserve((int) hd.stack_cnt);
+    for (uint32_t i = 0; i < hd.stack_cnt; i++) stack.data[++stack.top] = restore(*ss++);
+    global_operands.reserve((int) hd.global_operand_cnt);
+    for (uint32_t i = 0; i < hd.global_operand_cnt; i++) global_operands.data[++global_operands.top] = restore(*ss++);
+    const auto *fs = reinterpret_cast<const snapshot_frame *>(image + hd.frames_offset);
+    for (uint32_t i = 0; i < hd.frame_cnt; i++) {
+        if (fs[i].base < 0 || fs[i].base > stack.top + 1 || fs[i].var_cnt < 0 || fs[i].return_ip < -1 ||
+            fs[i].return_ip >= (int32_t) hd.ins_cnt) {
+            panic("Corrupted snapshot");
+        }
+        push_frame(fs[i].base);
+        esp->var_cnt = fs[i].var_cnt;
+        esp->return_ip = fs[i].return_ip;
+        esp->function = fs[i].function;
+    }
+    ip = hd.ip;
+}
+
+// Parse text bytecode, or assembler source in interact mode where address -1 ends the program
+Program parse_program(std::istream &is, bool in_interact) {
+    Program program;
+    int addr;
+    while (is >> addr) {
+        if (in_interact && addr == -1) {
+            break;
+        }
+        instruct_code ins;
+        if (in_interact) {
+            std::string ins_str;
+            is >> ins_str;
+            ins = Machine::string_inscode_mapping[ins_str];
+        } else {
+            int ins_tmp;
+            is >> ins_tmp;
+            if (ins_tmp < 0 || ins_tmp > LAST_PUBLIC_CODE) {
+                panic("Unexpected instruction");
+            }
+            ins = instruct_code(ins_tmp);
+        }
+        if (ins == CONSTANT) {
+            if (addr < 0 || addr >= (int) program.constants.size()) panic("Constant out of range");
+            int type;
+            is >> type;
+            switch (type) {
+                // int
+                case 0: {
+                    int_tp tmp;
+                    is >> tmp;
+                    program.constants[addr] = slot(tmp);
+                    break;
+                }
+                    // float
+                case 1: {
+                    float_tp tmp;
+                    is >> tmp;
+                    program.constants[addr] = slot(tmp);
+                    break;
+                }
+                    // char
+                case 2: {
+                    int tmp;
+                    is >> tmp;
+                    program.constants[addr] = slot((char_tp) tmp);
+                    break;
+                }
+
+                default: {
+                    panic("Unexpected type");
+                }
+            }
+            // reference count of the constant, no longer needed since scalars are not shared
+            int ref_cnt;
+            is >> ref_cnt;
+            continue;
+        } else if (ins == CMALLOC) {
+            int constant_cnt;
+            is >> constant_cnt;
+            program.constants.resize(constant_cnt);
+            continue;
+        }
+        int param_number = Machine::inscode_param_cnt_mapping[ins];
+        if (param_number) {
+            int param;
+            is >> param;
+            program.add_instruct(instruct(addr, ins, param));
+        } else {
+            program.add_instruct(instruct(addr, ins));
+        }
+    }
+    return program;
+}
+
+// Execution engines, the stack engine is the reference
+enum engine_kind {
+    STACK_ENGINE,
+    REGISTER_ENGINE,
+    JIT_ENGINE
+};
+
+// How the run and interact modes set up the machine
+struct run_options {
+    bool verbose = false;
+    bool evaluate = false;
+    engine_kind engine = STACK_ENGINE;
+    bool profile = false;
+    std::string profile_path; // JSON or CSV dump of the profile, none if empty
+    std::string samples_path; // Folded stacks of the sampling profiler, no sampling if empty
+    bool memory = false;
+    resource_limits limits;
+    std::string snapshot_path; // Save the machine at the first GETCH or after snapshot_at instructions instead of running on
+    long long snapshot_at = 0;
+    std::string debug_endpoint; // Port or Unix socket path the debugger client connects to, no debugger if empty
+};
+
+// -l instructions=N,calls=N,stack=N,heap=N, any of them in any order
+resource_limits parse_limits(const std::string &spec) {
+    resource_limits limits;
+    std::istringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) panic("Limit expected as name=value: " + item);
+        std::string name = item.substr(0, eq);
+        long long value = atoll(item.c_str() + eq + 1);
+        if (value < 0) panic("Negative limit " + item);
+        if (name == "instructions") {
+            limits.instructions = value;
+        } else if (name == "calls") {
+            limits.call_depth = (int) std::min(value, (long long) std::numeric_limits<int>::max());
+        } else if (name == "stack") {
+            limits.stack_slots = (int) std::min(value, (long long) MAX_STACK_SIZE);
+        } else if (name == "heap") {
+            limits.heap_bytes = value;
+        } else {
+            panic("Unknown limit " + name);
+        }
+    }
+    return limits;
+}
+
+void configure(Machine &machine, const run_options &options) {
+    if (isatty(STDOUT_FILENO)) {
+        machine.enable_line_buffering();
+    }
+    if (options.verbose) {
+        machine.enable_verbose();
+    }
+    if (options.evaluate) {
+        machine.enable_evaluator();
+    }
+    if (options.profile) {
+        machine.enable_profiler(options.profile_path);
+    }
+    if (!options.samples_path.empty()) {
+        machine.enable_sampler(options.samples_path);
+    }
+    if (options.memory) {
+        machine.enable_memory_report();
+    }
+    machine.set_limits(options.limits);
+    if (options.engine == REGISTER_ENGINE) {
+        machine.enable_register_engine();
+    } else if (options.engine == JIT_ENGINE) {
+        machine.enable_jit();
+    }
+}
+
+void run_program(Program program, const run_options &options) {
+    Machine machine = Machine();
+    configure(machine, options);
+    machine.load(std::move(program));
+    machine.dispatch();
+}
+
+// Run the program until its first GETCH, or for snapshot_at instructions, and save the machine there
+void snapshot_program(Program program, const run_options &options) {
+    Machine machine = Machine();
+    configure(machine, options);
+    std::istringstream no_input;
+    machine.redirect(no_input, std::cout);
+    machine.load(std::move(program));
+    dispatch_status status;
+    do {
+        status = machine.resume(options.snapshot_at ? options.snapshot_at : SNAPSHOT_SLICE);
+    } while (status == YIELDED && !options.snapshot_at);
+    if (status == HALTED) panic("Program halted before the snapshot");
+    machine.save_snapshot(options.snapshot_path);
+}
+
+/*
+ * Debugger of one machine, driven by a client over a socket with one command per line. The machine runs its slices
+ * as in any other run, breakpoints and watchpoints are BREAK instructions patched into the code it runs, so it is
+ * only slowed where it stops. Replies are data lines ended by "ok" or "error <why>", the client is told when the
+ * program stops by "stopped <reason> at <address>" and when it ends by "halted".
+ */
+class debug_session {
+    struct watchpoint {
+        bool global;
+        int index;
+    };
+
+    Machine &machine;
+    int fd;
+    std::string received;
+    std::map<int, instruct_code> patched; // Instruction index -> the instruction BREAK replaced
+    std::vector<bool> breakpoints;
+    std::vector<watchpoint> watchpoints;
+    std::vector<int> head_of; // Instruction index -> the first instruction of the fused span it is part of, or -1
+    std::unordered_map<int, int> indices; // Instruction address -> instruction index
+    bool halted = false;
+
+    void send(const std::string &line) {
+        std::string out = line + '\n';
+        for (size_t sent = 0; sent < out.size();) {
+            ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            sent += (size_t) n;
+        }
+    }
+
+    // false once the client is gone, does not wait when blocking is false and no whole line was received
+    bool receive(std::string &line, bool blocking, bool &got) {
+        got = false;
+        for (;;) {
+            size_t eol = received.find('\n');
+            if (eol != std::string::npos) {
+                line = received.substr(0, eol);
+                received.erase(0, eol + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                got = true;
+                return true;
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, blocking ? -1 : 0);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return ready == 0;
+            char buffer[4096];
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            received.append(buffer, (size_t) n);
+        }
+    }
+
+    // Instructions one fused instruction stands for, 1 if it is not fused
+    int span(int index) {
+        const instruct &ins = machine.instruction(index);
+        switch (ins.code) {
+            case ENTER:
+                return machine.instruction(index + 1).code == STORE_NAME ? machine.instruction(index + 1).operand + 2 : 1;
+            case PUSH_ARGS:
+                return 2 * ins.operand + 1;
+            case CALL_ARGS:
+                return 2 * ins.operand + 2;
+            case TAIL_CALL:
+                return 2 * ins.operand + 3;
+            default:
+                return Program::fused_length(ins.code);
+        }
+    }
+
+    // The instructions of the span run by themselves from now on, so that any of them can be stopped at
+    void unfuse(int head) {
+        instruct &ins = machine.instruction(head);
+        if (ins.code == ENTER) {
+            ins.code = VMALLOC;
+        } else if (ins.code == PUSH_ARGS || ins.code == CALL_ARGS || ins.code == TAIL_CALL) {
+            ins.code = ins.operand ? STORE_GLOBAL : PUSH;
+        } else {
+            ins.code = Program::unfused(ins.code);
+        }
+    }
+
+    std::string address(int index) {
+        return std::to_string(machine.instruction(index).address);
+    }
+
+    std::string value(const watchpoint &w) {
+        if (w.global) return w.index < machine.global_count() ? machine.global(w.index).as_string() : "none";
+        return w.index < machine.local_count() ? machine.local(w.index).as_string() : "none";
+    }
+
+    bool writes(const instruct &ins, const watchpoint &w) {
+        if (ins.operand != w.index) return false;
+        if (w.global) {
+            return ins.code == STORE_NAME_GLOBAL || ins.code == STORE_NAME_GLOBAL_NOPOP || ins.code == INC_NAME_GLOBAL ||
+                   ins.code == DEC_NAME_GLOBAL;
+        }
+        return ins.code == STORE_NAME || ins.code == STORE_NAME_NOPOP || ins.code == INC_NAME || ins.code == DEC_NAME;
+    }
+
+    // BREAK goes over the breakpoints and every instruction that writes a watched variable, nothing else is patched
+    void patch() {
+        for (const auto &p : patched) machine.instruction(p.first).code = p.second;
+        patched.clear();
+        int ins_cnt = machine.instruction_count();
+        for (int i = 0; i < ins_cnt; i++) {
+            bool stop = breakpoints[i];
+            for (const watchpoint &w : watchpoints) stop = stop || writes(machine.instruction(i), w);
+            if (!stop) continue;
+            int head = head_of[i];
+            if (head >= 0 && span(head) > i - head) unfuse(head);
+            patched[i] = machine.instruction(i).code;
+        }
+        for (auto &p : patched) machine.instruction(p.first).code = BREAK;
+    }
+
+    // Runs the next instruction as it was before it was patched, quickening may rewrite it while it runs
+    dispatch_status step_over() {
+        int i = machine.next_instruction();
+        auto p = patched.find(i);
+        if (p != patched.end()) machine.instruction(i).code = p->second;
+        dispatch_status status = machine.resume(1);
+        if (p != patched.end()) {
+            p->second = machine.instruction(i).code;
+            machine.instruction(i).code = BREAK;
+        }
+        return status;
+    }
+
+    // Steps one instruction, true if the program stopped for a watchpoint or halted, which the client is told
+    bool advance() {
+        std::vector<std::string> before;
+        for (const watchpoint &w : watchpoints) before.push_back(value(w));
+        if (step_over() == HALTED) {
+            halted = true;
+            send("halted");
+            return true;
+        }
+        for (size_t i = 0; i < watchpoints.size(); i++) {
+            std::string after = value(watchpoints[i]);
+            if (after == before[i]) continue;
+            send("stopped watch at " + address(machine.next_instruction()) + " " +
+                 (watchpoints[i].global ? "global " : "local ") + std::to_string(watchpoints[i].index) + " " +
+                 before[i] + " -> " + after);
+            return true;
+        }
+        return false;
+    }
+
+    // Slices until a breakpoint, a changed watchpoint, the end or a pause of the client
+    bool run_on() {
+        if (patched.count(machine.next_instruction()) && advance()) return true;
+        for (;;) {
+            dispatch_status status = machine.resume(DEBUG_SLICE);
+            if (status == HALTED) {
+                halted = true;
+                send("halted");
+                return true;
+            }
+            if (status == YIELDED) {
+                std::string line;
+                bool got;
+                if (!receive(line, false, got)) return false;
+                if (!got) continue;
+                if (line == "pause") {
+                    send("stopped pause at " + address(machine.next_instruction()));
+                    return true;
+                }
+                send("error running");
+                continue;
+            }
+            int i = machine.next_instruction();
+            if (breakpoints[i]) {
+                send("stopped breakpoint at " + address(i));
+                return true;
+            }
+            if (advance()) return true;
+        }
+    }
+
+    bool parse_index(std::istringstream &args, int &index) {
+        return (args >> index) && index >= 0;
+    }
+
+    std::string command(const std::string &line, bool &quit) {
+        std::istringstream args(line);
+        std::string name;
+        args >> name;
+        if (name == "quit") {
+            quit = true;
+            return "";
+        }
+        if (name == "break" || name == "clear") {
+            int addr;
+            if (!parse_index(args, addr) || !indices.count(addr)) return "no instruction at this address";
+            breakpoints[indices[addr]] = name == "break";
+            patch();
+            return "";
+        }
+        if (name == "watch" || name == "unwatch") {
+            std::string kind;
+            int index;
+            args >> kind;
+            if ((kind != "global" && kind != "local") || !parse_index(args, index)) {
+                return "expected " + name + " global|local index";
+            }
+            bool global = kind == "global";
+            auto it = std::find_if(watchpoints.begin(), watchpoints.end(), [&](const watchpoint &w) {
+                return w.global == global && w.index == index;
+            });
+            if (name == "watch" && it == watchpoints.end()) watchpoints.push_back(watchpoint{global, index});
+            if (name == "unwatch" && it != watchpoints.end()) watchpoints.erase(it);
+            patch();
+            return "";
+        }
+        if (name == "pause") return "not running";
+        if (halted) return "halted";
+        int next = machine.next_instruction();
+        if (name == "continue" || name == "step") {
+            send("ok");
+            if (name == "step" && !advance()) send("stopped step at " + address(machine.next_instruction()));
+            if (name == "continue" && !run_on()) quit = true;
+            return "-";
+        }
+        if (name == "where") {
+            auto p = patched.find(next);
+            const instruct &ins = machine.instruction(next);
+            instruct_code code = p != patched.end() ? p->second : ins.code;
+            send(address(next) + " " + Machine::code_names[code] + " " +
+                 (Program::is_jump(code) ? address(ins.operand) : std::to_string(ins.operand)));
+        } else if (name == "stack") {
+            // innermost call first, as the function entry and the return address, a frame not called yet has neither
+            const std::vector<frame> &frames = machine.call_frames();
+            for (auto f = frames.rbegin(); f != frames.rend(); f++) {
+                bool called = f->function >= 0 && f->return_ip < machine.instruction_count();
+                send(called ? address(f->function) + " " + address(f->return_ip) : "- -");
+            }
+        } else if (name == "locals") {
+            for (int i = 0; i < machine.local_count(); i++) send(std::to_string(i) + " " + machine.local(i).as_string());
+        } else if (name == "globals") {
+            for (int i = 0; i < machine.global_count(); i++) send(std::to_string(i) + " " + machine.global(i).as_string());
+        } else if (name == "operands") {
+            for (int i = 0; i < machine.operand_count(); i++) send(std::to_string(i) + " " + machine.operand(i).as_string());
+        } else {
+            return "unknown command " + name;
+        }
+        return "";
+    }
+
+public:
+    debug_session(Machine &_machine, int _fd) : machine(_machine), fd(_fd) {
+        int ins_cnt = machine.instruction_count();
+        breakpoints.assign(ins_cnt, false);
+        head_of.assign(ins_cnt, -1);
+        for (int i = 0; i < ins_cnt; i++) {
+            if (machine.instruction(i).address >= 0) indices.emplace(machine.instruction(i).address, i);
+        }
+        for (int i = 0; i < ins_cnt; i++) {
+            int n = span(i);
+            for (int j = i + 1; j < i + n && j < ins_cnt; j++) head_of[j] = i;
+            i += n - 1;
+        }
+    }
+
+    // Serves the client until it quits, a client gone away leaves the program running to its end without it
+    void serve() {
+        send("stopped entry at " + address(machine.next_instruction()));
+        for (;;) {
+            std::string line;
+            bool got;
+            bool quit = false;
+            if (!receive(line, true, got)) break;
+            if (line.empty()) continue;
+            std::string error = command(line, quit);
+            if (quit) {
+                if (error.empty()) send("ok");
+                return;
             }
+            if (error == "-") continue;
+            send(error.empty() ? "ok" : "error " + error);
         }
+        breakpoints.assign(breakpoints.size(), false);
+        watchpoints.clear();
+        patch();
+        while (!halted && machine.resume(DEBUG_SLICE) != HALTED) {}
     }
 };
 
-std::unordered_map<std::string, instruct_code> Machine::string_inscode_mapping;
-int Machine::inscode_param_cnt_mapping[200];
+// A TCP port on the loopback interface when the endpoint is a number, a Unix socket path otherwise
+int accept_debugger(const std::string &endpoint) {
+    bool port = !endpoint.empty() && std::all_of(endpoint.begin(), endpoint.end(), ::isdigit);
+    int listener = socket(port ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) panic("Cannot open the debugger socket");
+    int bound;
+    if (port) {
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) atoi(endpoint.c_str()));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bound = bind(listener, (sockaddr *) &addr, sizeof(addr));
+    } else {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (endpoint.size() >= sizeof(addr.sun_path)) panic("Debugger socket path too long");
+        strcpy(addr.sun_path, endpoint.c_str());
+        unlink(endpoint.c_str());
+        bound = bind(listener, (sockaddr *) &addr, sizeof(addr));
+    }
+    if (bound < 0 || listen(listener, 1) < 0) {
+        close(listener);
+        panic("Cannot listen on " + endpoint);
+    }
+    std::cerr << "Waiting for the debugger on " << endpoint << std::endl;
+    int fd;
+    while ((fd = accept(listener, nullptr, nullptr)) < 0 && errno == EINTR) {}
+    close(listener);
+    if (!port) unlink(endpoint.c_str());
+    if (fd < 0) panic("Cannot accept the debugger");
+    return fd;
+}
 
-void interpret(std::istream &is, bool verbose, bool evaluate, bool in_interact) {
+// Run the program stopped at its first instruction under a debugger client connected to the endpoint
+void debug_program(Program program, const run_options &options) {
     Machine machine = Machine();
-    if (verbose) {
-        machine.enable_verbose();
+    configure(machine, options);
+    // GETCH reads the console as in a normal run, the client is on its own socket, and lines are seen as they are
+    // printed even though the slices are stopped in the middle
+    machine.close_input();
+    machine.enable_line_buffering();
+    machine.load(std::move(program));
+    int fd = accept_debugger(options.debug_endpoint);
+    try {
+        debug_session(machine, fd).serve();
+    } catch (const std::exception &e) {
+        std::string line = std::string("panic ") + e.what() + '\n';
+        ::send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+        close(fd);
+        throw;
     }
-    if (evaluate) {
-        machine.enable_evaluator();
-    }
-    int addr;
-    while (is >> addr) {
-        if (in_interact && addr == -1) {
-            machine.dispatch();
-            break;
+    close(fd);
+}
+
+// A warm start, the machine goes on where the snapshot was taken
+void run_snapshot(const std::string &path, const run_options &options) {
+    Machine machine = Machine();
+    configure(machine, options);
+    machine.restore_snapshot(path);
+    machine.dispatch();
+}
+
+void interpret(std::istream &is, const run_options &options, bool in_interact) {
+    Program program = parse_program(is, in_interact);
+    // in interact mode nothing runs unless the program was ended by address -1
+    if (in_interact && !is) return;
+    run_program(std::move(program), options);
+}
+
+void interact(const run_options &options) {
+    interpret(std::cin, options, true);
+}
+
+// Constants and instructions of an assembly text, as they are stored in binary files
+struct assembly {
+    std::vector<slb_constant> constant_pool;
+    std::vector<slb_instruct> code;
+    int max_addr = -1;
+};
+
+/*
+ * Assembly text: whitespace separated tokens, ';' and '#' comment to the end of the line.
+ *   [address] MNEMONIC [operand]      the address defaults to the one after the previous instruction
+ *   [index] CONSTANT type value refs  the index defaults to the end of the constant pool
+ *   [address] CMALLOC n               n constants to be set by index
+ *   name:                             names the address of the next instruction, or the index of the next constant
+ * An operand can be a name, names are resolved once all of the text is read.
+ */
+struct asm_statement {
+    instruct_code code = NOOP;
+    int address = -1; // Not given
+    int operand{};
+    std::string_view mnemonic;
+    std::string_view symbol; // Operand name, or the name defined when code is LABEL_STATEMENT
+    slb_constant constant{};
+    int line{};
+};
+
+const instruct_code LABEL_STATEMENT = INSTRUCT_CODE_NUM;
+
+// Statements of a part of the text starting at a line, parsed on their own
+struct asm_chunk {
+    const char *begin{};
+    const char *end{};
+    std::vector<asm_statement> statements;
+    int lines = 0;
+    std::string error;
+    int error_line = -1;
+};
+
+class asm_parser {
+private:
+    const char *p;
+    const char *end;
+    int line = 0;
+    const std::unordered_map<std::string_view, instruct_code> &mnemonics;
+
+    std::string_view token() {
+        while (p < end) {
+            if (*p == '\n') {
+                line++;
+                p++;
+            } else if (*p == ';' || *p == '#') {
+                while (p < end && *p != '\n') p++;
+            } else if (isspace((unsigned char) *p)) {
+                p++;
+            } else {
+                break;
+            }
         }
-        instruct_code ins;
-        if (in_interact) {
-            std::string ins_str;
-            is >> ins_str;
-            ins = Machine::string_inscode_mapping[ins_str];
-        } else {
-            int ins_tmp;
-            is >> ins_tmp;
-            ins = instruct_code(ins_tmp);
+        const char *first = p;
+        while (p < end && !isspace((unsigned char) *p)) p++;
+        return {first, (size_t) (p - first)};
+    }
+
+    static bool is_number(std::string_view tok) {
+        size_t i = !tok.empty() && (tok[0] == '-' || tok[0] == '+');
+        return i < tok.size() && isdigit((unsigned char) tok[i]);
+    }
+
+    template<typename T>
+    static T number(std::string_view tok) {
+        if (!tok.empty() && tok[0] == '+') tok.remove_prefix(1);
+        T value{};
+        auto res = std::from_chars(tok.data(), tok.data() + tok.size(), value);
+        if (res.ec != std::errc() || res.ptr != tok.data() + tok.size()) {
+            panic("Number expected, got '" + std::string(tok) + "'");
         }
-        if (ins == CONSTANT) {
-            int type;
-            is >> type;
-            switch (type) {
-                // int
-                case 0: {
-                    int_tp tmp;
-                    is >> tmp;
-                    constants[addr] = new slot(tmp);
-                    break;
+        return value;
+    }
+
+    template<typename T>
+    T next_number() {
+        std::string_view tok = token();
+        if (tok.empty()) panic("Unexpected end of text");
+        return number<T>(tok);
+    }
+
+public:
+    asm_parser(const char *_begin, const char *_end, const std::unordered_map<std::string_view, instruct_code> &_mnemonics)
+            : p(_begin), end(_end), mnemonics(_mnemonics) {}
+
+    void parse(asm_chunk &chunk) {
+        try {
+            for (std::string_view tok = token(); !tok.empty(); tok = token()) {
+                asm_statement st;
+                st.line = line;
+                if (is_number(tok)) {
+                    st.address = number<int>(tok);
+                    tok = token();
+                    if (tok.empty()) panic("Instruction expected after address");
                 }
-                    // float
-                case 1: {
-                    float_tp tmp;
-                    is >> tmp;
-                    constants[addr] = new slot(tmp);
-                    break;
+                if (tok.back() == ':') {
+                    if (st.address != -1 || tok.size() == 1) panic("Bad label " + std::string(tok));
+                    st.code = LABEL_STATEMENT;
+                    st.symbol = tok.substr(0, tok.size() - 1);
+                    chunk.statements.push_back(st);
+                    continue;
                 }
-                    // char
-                case 2: {
-                    int tmp;
-                    is >> tmp;
-                    constants[addr] = new slot((char_tp) tmp);
-                    break;
+                auto it = mnemonics.find(tok);
+                if (it == mnemonics.end()) panic("Unknown instruction " + std::string(tok));
+                st.code = it->second;
+                st.mnemonic = tok;
+                if (st.code == CMALLOC) {
+                    st.operand = next_number<int>();
+                } else if (st.code == CONSTANT) {
+                    st.constant.type = next_number<int32_t>();
+                    if (st.constant.type == FLOAT) st.constant.float_val = next_number<double>();
+                    else st.constant.int_val = next_number<int64_t>();
+                    next_number<int>(); // reference count of the old text format, unused
+                } else if (Machine::inscode_param_cnt_mapping[st.code]) {
+                    tok = token();
+                    if (tok.empty()) panic("Operand expected");
+                    if (is_number(tok)) st.operand = number<int>(tok);
+                    else st.symbol = tok;
                 }
+                chunk.statements.push_back(st);
+            }
+        } catch (const vm_error &e) {
+            chunk.error = e.what();
+            chunk.error_line = line;
+        }
+        // a chunk ends at a line end, skip it if the next chunk has not counted it
+        while (p < end) {
+            if (*p++ == '\n') line++;
+        }
+        chunk.lines = line;
+    }
+};
 
-                default: {
-                    panic("Unexpected type");
+/*
+ * Texts of ASSEMBLY_CHUNK bytes or more are cut at line ends and parsed by up to workers threads, so a statement of
+ * a big text should not span lines. Names and addresses are resolved after, in the order of the text. The listing
+ * gets a line per instruction when it is given.
+ */
+assembly parse_assembly(const char *text, size_t size, int workers, std::ostream *listing) {
+    static const std::unordered_map<std::string_view, instruct_code> mnemonics = [] {
+        std::unordered_map<std::string_view, instruct_code> m;
+        for (const auto &x : Machine::string_inscode_mapping) m.emplace(x.first, x.second);
+        return m;
+    }();
+    int n = (int) std::max<size_t>(std::min<size_t>(std::max(workers, 1), size / ASSEMBLY_CHUNK), 1);
+    std::vector<asm_chunk> chunks(n);
+    const char *cut = text;
+    for (int i = 0; i < n; i++) {
+        chunks[i].begin = cut;
+        cut = i + 1 < n ? std::find(std::max(cut, text + size * (i + 1) / n), text + size, '\n') : text + size;
+        if (cut < text + size) cut++;
+        chunks[i].end = cut;
+    }
+    auto parse = [&](asm_chunk &c) {
+        c.statements.reserve((c.end - c.begin) / 12);
+        asm_parser(c.begin, c.end, mnemonics).parse(c);
+    };
+    if (n == 1) {
+        parse(chunks[0]);
+    } else {
+        std::vector<std::thread> threads;
+        for (int i = 1; i < n; i++) threads.emplace_back(parse, std::ref(chunks[i]));
+        parse(chunks[0]);
+        for (auto &t : threads) t.join();
+    }
+
+    assembly as;
+    std::vector<slb_constant> &constant_pool = as.constant_pool;
+    std::vector<slb_instruct> &code = as.code;
+    std::unordered_map<std::string_view, int> names;
+    std::vector<std::string_view> pending; // Labels waiting for the next instruction or constant
+    std::vector<std::pair<int, const asm_statement *>> fixups; // Instruction -> statement with a named operand
+    std::vector<int> fixup_lines;
+    int next_addr = 0;
+    int first_line = 1;
+    auto fail = [](const std::string &msg, int line) {
+        panic(msg + " at line " + std::to_string(line));
+    };
+    auto define = [&](int value, int line) {
+        for (std::string_view name : pending) {
+            if (!names.emplace(name, value).second) fail("Duplicate name " + std::string(name), line);
+        }
+        pending.clear();
+    };
+    code.reserve(std::accumulate(chunks.begin(), chunks.end(), (size_t) 0,
+                                 [](size_t k, const asm_chunk &c) { return k + c.statements.size(); }));
+    for (const asm_chunk &c : chunks) {
+        for (const asm_statement &st : c.statements) {
+            int line = first_line + st.line;
+            if (st.code == LABEL_STATEMENT) {
+                pending.push_back(st.symbol);
+            } else if (st.code == CMALLOC) {
+                if (st.operand < 0) fail("Negative constant pool size", line);
+                constant_pool.resize(st.operand);
+            } else if (st.code == CONSTANT) {
+                int index = st.address < 0 ? (int) constant_pool.size() : st.address;
+                if (st.address < 0) constant_pool.emplace_back();
+                if (index >= (int) constant_pool.size()) fail("Constant out of range", line);
+                constant_pool[index] = st.constant;
+                define(index, line);
+            } else {
+                int addr = st.address < 0 ? next_addr : st.address;
+                if (addr < 0 || addr > MAX_INSTRUCTION_ADDR) fail("Instruction address out of range", line);
+                if (listing != nullptr) {
+                    *listing << ":Generating " << st.mnemonic << " at " << addr << "...\n";
+                }
+                define(addr, line);
+                if (!st.symbol.empty()) {
+                    fixups.emplace_back((int) code.size(), &st);
+                    fixup_lines.push_back(line);
                 }
+                code.push_back(slb_instruct{addr, st.code, st.operand});
+                if (addr > as.max_addr) as.max_addr = addr;
+                next_addr = addr + 1;
             }
-            is >> constants[addr]->ref_cnt;
-            continue;
-        } else if (ins == CMALLOC) {
-            is >> constant_cnt;
-            if (constant_cnt) constants = new slot*[constant_cnt];
-            continue;
-        }
-        int param_number = Machine::inscode_param_cnt_mapping[ins];
-        if (param_number) {
-            int param;
-            is >> param;
-            machine.add_instruct(instruct(addr, ins, param));
-        } else {
-            machine.add_instruct(instruct(addr, ins));
         }
+        if (c.error_line >= 0) fail(c.error, first_line + c.error_line);
+        first_line += c.lines;
     }
-    if (!in_interact) machine.dispatch();
+    if (!pending.empty()) fail("Nothing follows label " + std::string(pending[0]), first_line);
+    for (size_t i = 0; i < fixups.size(); i++) {
+        auto it = names.find(fixups[i].second->symbol);
+        if (it == names.end()) fail("Undefined name " + std::string(fixups[i].second->symbol), fixup_lines[i]);
+        code[fixups[i].first].operand = it->second;
+    }
+    return as;
 }
 
-void interact(bool verbose, bool evaluate) {
-    interpret(std::cin, verbose, evaluate, true);
+// An assembly text run without writing it to a file first
+Program assembly_program(const assembly &as) {
+    Program program;
+    program.instructs.reserve(as.code.size() + 1);
+    for (const auto &c : as.constant_pool) program.constants.push_back(constant_slot(c));
+    for (const auto &si : as.code) program.add_instruct(instruct(si.address, instruct_code(si.code), si.operand));
+    return program;
 }
 
-void assemble(const std::string& raw_file_path, const std::string& out_file_path, std::string password) {
-    std::ifstream raw_file(raw_file_path, std::ios::in);
-    std::ofstream out_file(out_file_path, std::ios::out | std::ios::trunc);
+// Quiet unless verbose, then the instructions are listed as they are generated
+void assemble(const std::string& raw_file_path, const std::string& out_file_path, const std::string& password,
+              int workers, bool verbose) {
+    mapped_file raw_file(raw_file_path);
+    if (verbose) std::cout << "<<<<* SLang Virtual Machine Assembler *>>>>" << std::endl;
+    assembly as = parse_assembly(raw_file.data, raw_file.size, workers, verbose ? &std::cout : nullptr);
+    const std::vector<slb_constant> &constant_pool = as.constant_pool;
+    const std::vector<slb_instruct> &code = as.code;
+    std::vector<int32_t> table(as.max_addr + 1, -1);
+    for (int i = 0; i < (int) code.size(); i++) table[code[i].address] = i;
 
-    std::cout << "<<<<* SLang Virtual Machine Assembler *>>>>" << std::endl;
-    std::stringstream buf;
-    int addr;
-    buf << MAGIC;
-    while (raw_file >> addr) {
-        std::string ins_str;
-        raw_file >> ins_str;
-        std::cout << ":Generating " << ins_str << " at " << addr << "..." << std::endl;
-        instruct_code ins = Machine::string_inscode_mapping[ins_str];
-        int param_number = Machine::inscode_param_cnt_mapping[ins];
-        buf << addr << " " << ins << " ";
-        while (param_number--) {
-            std::string param;
-            raw_file >> param;
-            buf << param << " ";
-        }
+    slb_header hd{};
+    memcpy(hd.magic, SLB_MAGIC, 4);
+    hd.version = SLB_VERSION;
+    hd.flags = password.empty() ? 0 : SLB_ENCRYPTED;
+    hd.constant_cnt = constant_pool.size();
+    hd.ins_cnt = code.size();
+    hd.addr_cnt = table.size();
+    hd.constants_offset = (sizeof(slb_header) + 7) & ~7;
+    hd.instructs_offset = hd.constants_offset + hd.constant_cnt * sizeof(slb_constant);
+    hd.addrs_offset = hd.instructs_offset + hd.ins_cnt * sizeof(slb_instruct);
+    std::string buf(hd.addrs_offset + hd.addr_cnt * sizeof(int32_t), '\0');
+    memcpy(&buf[0], &hd, sizeof(hd));
+    std::copy(constant_pool.begin(), constant_pool.end(), reinterpret_cast<slb_constant *>(&buf[hd.constants_offset]));
+    std::copy(code.begin(), code.end(), reinterpret_cast<slb_instruct *>(&buf[hd.instructs_offset]));
+    std::copy(table.begin(), table.end(), reinterpret_cast<int32_t *>(&buf[hd.addrs_offset]));
+    if (hd.flags & SLB_ENCRYPTED) {
+        if (verbose) std::cout << ":Encrypting bytecode..." << std::endl;
+        xor_bytes(&buf[sizeof(slb_header)], buf.size() - sizeof(slb_header), password);
     }
 
-    std::string s = buf.str();
-    password = MAGIC + password;
-    int len = password.length();
-    std::cout << ":Encrypting bytecode..." << std::endl;
-    for (int i = 0; i < s.length(); i++) s[i] = (unsigned int) s[i] ^ (unsigned int) password[i % len];
-    out_file << s;
-
-    raw_file.close();
-    out_file.close();
+    std::ofstream out_file(out_file_path, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!out_file.write(buf.data(), buf.size())) panic("Cannot write " + out_file_path);
 }
 
-void run(const std::string& input_file_path, bool verbose, bool evaluate, std::string password) {
-    std::ifstream input_file(input_file_path, std::ios::in);
-    std::string content((std::istreambuf_iterator<char>(input_file)),
-                        (std::istreambuf_iterator<char>()));
-    password = MAGIC + password;
-    int len = password.length();
-    for (int i = 0; i < content.length(); i++) content[i] = (unsigned int) content[i] ^ (unsigned int) password[i % len];
+// Bytecode of the text format, kept readable for compatibility
+std::stringstream open_text(const mapped_file &file, const std::string &password) {
+    std::string content(file.data, file.size);
+    xor_bytes(&content[0], content.size(), password);
     std::stringstream ss(content);
     std::string hd;
     ss >> hd;
-    interpret(ss, verbose, evaluate, false);
+    return ss;
+}
+
+Program load_binary(mapped_file &file, const std::string &password) {
+    const slb_header &hd = open_binary(file, password);
+    const auto *pool = binary_section<slb_constant>(file, hd.constants_offset);
+    const auto *table = binary_section<int32_t>(file, hd.addrs_offset);
+    const auto *code = binary_section<slb_instruct>(file, hd.instructs_offset);
+    Program program;
+    program.instructs.reserve(hd.ins_cnt + 1);
+    program.addrs.assign(table, table + hd.addr_cnt);
+    program.constants.reserve(hd.constant_cnt);
+    for (uint32_t i = 0; i < hd.constant_cnt; i++) program.constants.push_back(constant_slot(pool[i]));
+    for (uint32_t i = 0; i < hd.ins_cnt; i++) {
+        const slb_instruct &si = code[i];
+        if (si.code < 0 || si.code > LAST_PUBLIC_CODE) {
+            panic("Unexpected instruction");
+        }
+        program.add_instruct(instruct(si.address, instruct_code(si.code), si.operand));
+    }
+    return program;
+}
+
+// Load a binary or text bytecode file
+Program load_program(const std::string &path, const std::string &password) {
+    mapped_file file(path);
+    if (file.is_binary()) return load_binary(file, password);
+    std::stringstream ss = open_text(file, password);
+    return parse_program(ss, false);
+}
+
+// Linked programs shared read-only by machines, keyed by path and password and reloaded when the file changes
+class program_cache {
+private:
+    struct entry {
+        struct timespec mtime;
+        off_t size;
+        std::shared_ptr<const Program> program;
+    };
+
+    std::mutex lock;
+    std::unordered_map<std::string, entry> entries;
+
+public:
+    std::shared_ptr<const Program> get(const std::string &path, const std::string &password) {
+        struct stat st{};
+        if (stat(path.c_str(), &st) < 0) panic("Cannot stat " + path);
+        std::string key = path + '\0' + password;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(key);
+            if (it != entries.end() && it->second.size == st.st_size &&
+                it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                return it->second.program;
+            }
+        }
+        // loaded outside the lock, a concurrent miss on the same file only loads it twice
+        Program program = load_program(path, password);
+        program.link();
+        auto shared = std::make_shared<const Program>(std::move(program));
+        std::lock_guard<std::mutex> guard(lock);
+        entries[key] = entry{st.st_mtim, st.st_size, shared};
+        return shared;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        entries.clear();
+    }
+};
+
+void run(const std::string& input_file_path, const run_options &options, const std::string& password) {
+    if (is_snapshot(input_file_path)) {
+        run_snapshot(input_file_path, options);
+    } else if (!options.snapshot_path.empty()) {
+        snapshot_program(load_program(input_file_path, password), options);
+    } else if (!options.debug_endpoint.empty()) {
+        debug_program(load_program(input_file_path, password), options);
+    } else {
+        run_program(load_program(input_file_path, password), options);
+    }
+}
+
+// The program as it is executed: specialized, quickenable and fused instructions, jumps to instruction addresses
+void disassemble_linked(const std::string& input_file_path, const std::string& password) {
+    Program program = load_program(input_file_path, password);
+    program.link();
+    // the last instruction is the HALT added by link()
+    for (int i = 0; i + 1 < program.size(); i++) {
+        const instruct &ins = program.instructs[i];
+        std::cout << ins.address << " " << Machine::code_names[ins.code] << " ";
+        if (Machine::inscode_param_cnt_mapping[ins.code]) {
+            std::cout << (Program::is_jump(ins.code) ? program.instructs[ins.operand].address : ins.operand) << " ";
+        }
+        int fused = Program::fused_length(ins.code);
+        if (fused > 1) std::cout << "; fused with the next " << fused - 1 << " ";
+        std::cout << std::endl;
+    }
 }
 
-void disassemble(const std::string& input_file_path, std::string password) {
-    std::ifstream input_file(input_file_path, std::ios::in);
-    std::string content((std::istreambuf_iterator<char>(input_file)),
-                        (std::istreambuf_iterator<char>()));
+void disassemble(const std::string& input_file_path, const std::string& password) {
+    mapped_file file(input_file_path);
     std::string code_name_mapping[200];
     for (const auto& x : Machine::string_inscode_mapping) {
         code_name_mapping[x.second] = x.first;
     }
-    password = MAGIC + password;
-    int len = password.length();
-    for (int i = 0; i < content.length(); i++) content[i] = ((unsigned int) content[i]) ^ ((unsigned int) password[i % len]);
-    std::stringstream ss(content);
-    std::string hd;
-    ss >> hd;
+    if (file.is_binary()) {
+        const slb_header &hd = open_binary(file, password);
+        const auto *pool = binary_section<slb_constant>(file, hd.constants_offset);
+        const auto *code = binary_section<slb_instruct>(file, hd.instructs_offset);
+        if (hd.constant_cnt) std::cout << 0 << " " << code_name_mapping[CMALLOC] << " " << hd.constant_cnt << " " << std::endl;
+        for (uint32_t i = 0; i < hd.constant_cnt; i++) {
+            std::cout << i << " " << code_name_mapping[CONSTANT] << " " << pool[i].type << " ";
+            if (pool[i].type == FLOAT) {
+                std::cout << std::setprecision(std::numeric_limits<double>::max_digits10) << pool[i].float_val;
+            } else {
+                std::cout << pool[i].int_val;
+            }
+            std::cout << " 1 " << std::endl;
+        }
+        for (uint32_t i = 0; i < hd.ins_cnt; i++) {
+            instruct_code ins = instruct_code(code[i].code);
+            std::cout << code[i].address << " " << code_name_mapping[ins] << " ";
+            if (Machine::inscode_param_cnt_mapping[ins]) std::cout << code[i].operand << " ";
+            std::cout << std::endl;
+        }
+        return;
+    }
+    std::stringstream ss = open_text(file, password);
     int addr;
     while (ss >> addr) {
         std::cout << addr << " ";
@@ -1225,26 +6657,377 @@ void disassemble(const std::string& input_file_path, std::string password) {
     }
 }
 
+// Work-stealing thread pool: a worker takes tasks from the back of its own queue and steals from the front of others
+class work_stealing_pool {
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    size_t next = 0;
+
+    bool take(size_t worker, std::function<void()> &task) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            task_queue &q = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+public:
+    explicit work_stealing_pool(int workers) {
+        for (int i = 0; i < std::max(workers, 1); i++) queues.emplace_back(new task_queue());
+    }
+
+    void submit(std::function<void()> task) {
+        task_queue &q = *queues[next++ % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(std::move(task));
+    }
+
+    // Run every submitted task, tasks must not submit new ones
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < queues.size(); w++) {
+            threads.emplace_back([this, w] {
+                std::function<void()> task;
+                while (take(w, task)) task();
+            });
+        }
+        for (auto &t : threads) t.join();
+    }
+};
+
+// Batch runner, each program is loaded once and shared by the machines running its instances
+struct batch_job {
+    std::string path;
+    int instances = 1;
+};
+
+struct batch_result {
+    int job{};
+    int instance{};
+    bool ok = false;
+    std::string error;
+    double seconds{};
+    std::string output;
+};
+
+// Jobs file: one "<program> [instances]" per line, '#' starts a comment
+std::vector<batch_job> read_jobs(const std::string &jobs_file_path) {
+    std::ifstream jobs_file(jobs_file_path, std::ios::in);
+    if (!jobs_file) panic("Cannot open " + jobs_file_path);
+    std::vector<batch_job> jobs;
+    std::string line;
+    while (std::getline(jobs_file, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream ls(line);
+        batch_job job;
+        if (!(ls >> job.path)) continue;
+        if (!(ls >> job.instances)) job.instances = 1;
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+// An instance of a time-sliced batch, with the streams its machine keeps between slices
+struct green_thread {
+    batch_result *result{};
+    std::istringstream in;
+    std::ostringstream out;
+    Machine machine;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Round robin over the instances given to one worker, each runs a slice in turn until all of them have halted
+void run_green_threads(const std::vector<batch_result *> &group,
+                       const std::vector<std::shared_ptr<const Program>> &programs,
+                       const std::vector<std::string> &load_errors, const resource_limits &limits, long long slice) {
+    std::deque<std::unique_ptr<green_thread>> ready;
+    for (batch_result *r : group) {
+        if (!load_errors[r->job].empty()) {
+            r->error = load_errors[r->job];
+            continue;
+        }
+        std::unique_ptr<green_thread> t(new green_thread());
+        t->result = r;
+        t->machine.redirect(t->in, t->out);
+        t->machine.close_input();
+        t->machine.set_limits(limits);
+        t->machine.load(programs[r->job]);
+        t->start = std::chrono::steady_clock::now();
+        ready.push_back(std::move(t));
+    }
+    while (!ready.empty()) {
+        std::unique_ptr<green_thread> t = std::move(ready.front());
+        ready.pop_front();
+        batch_result &r = *t->result;
+        try {
+            if (t->machine.resume(slice) != HALTED) {
+                ready.push_back(std::move(t));
+                continue;
+            }
+            r.ok = true;
+        } catch (const std::exception &e) {
+            r.error = e.what();
+        }
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t->start).count();
+        r.output = t->out.str();
+    }
+}
+
+// Every instance on a machine of its own, run to the end by a worker, or time-sliced with the others of its worker
+std::vector<batch_result> run_batch(const std::vector<batch_job> &jobs, int workers, const std::string &password,
+                                    program_cache &cache, const resource_limits &limits, long long slice) {
+    std::vector<std::shared_ptr<const Program>> programs(jobs.size());
+    std::vector<std::string> load_errors(jobs.size());
+    std::vector<batch_result> results;
+    for (int j = 0; j < (int) jobs.size(); j++) {
+        try {
+            programs[j] = cache.get(jobs[j].path, password);
+        } catch (const std::exception &e) {
+            load_errors[j] = e.what();
+        }
+        for (int i = 0; i < jobs[j].instances; i++) {
+            batch_result r;
+            r.job = j;
+            r.instance = i;
+            results.push_back(r);
+        }
+    }
+    work_stealing_pool pool(workers);
+    if (slice > 0) {
+        std::vector<std::vector<batch_result *>> groups(std::max(workers, 1));
+        for (size_t i = 0; i < results.size(); i++) groups[i % groups.size()].push_back(&results[i]);
+        for (const auto &group : groups) {
+            pool.submit([&group, &programs, &load_errors, &limits, slice] {
+                run_green_threads(group, programs, load_errors, limits, slice);
+            });
+        }
+        pool.run();
+        return results;
+    }
+    for (auto &r : results) {
+        pool.submit([&r, &programs, &load_errors, &limits] {
+            if (!load_errors[r.job].empty()) {
+                r.error = load_errors[r.job];
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::istringstream in;
+            std::ostringstream out;
+            try {
+                Machine machine = Machine();
+                machine.redirect(in, out);
+                machine.set_limits(limits);
+                machine.load(programs[r.job]);
+                machine.dispatch();
+                r.ok = true;
+            } catch (const std::exception &e) {
+                r.error = e.what();
+            }
+            r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            r.output = out.str();
+        });
+    }
+    pool.run();
+    return results;
+}
+
+// Outputs in job order followed by the report, true if every instance succeeded
+bool batch(const std::string &jobs_file_path, int workers, const std::string &password, const resource_limits &limits,
+           long long slice) {
+    std::vector<batch_job> jobs = read_jobs(jobs_file_path);
+    auto start = std::chrono::steady_clock::now();
+    program_cache cache;
+    std::vector<batch_result> results = run_batch(jobs, workers, password, cache, limits, slice);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int failed = 0;
+    for (const auto &r : results) std::cout << r.output;
+    std::cout << "<<<<<* Batch report *>>>>>" << std::endl;
+    for (const auto &r : results) {
+        if (!r.ok) failed++;
+        std::cout << jobs[r.job].path << " #" << r.instance << " "
+                  << (r.ok ? "ok" : "error: " + r.error) << " "
+                  << std::fixed << std::setprecision(8) << r.seconds << "s" << std::endl;
+    }
+    std::cout << results.size() << " instances of " << jobs.size() << " jobs, " << failed << " failed, "
+              << std::fixed << std::setprecision(8) << wall << "s on " << workers << " workers" << std::endl;
+    return failed == 0;
+}
+
+// Peak resident set size in KB since the last reset_peak_rss(), the peak of the process where it cannot be reset
+long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return atol(line.c_str() + 6);
+    }
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) clear_refs << "5" << std::endl;
+}
+
+struct bench_result {
+    std::string name;
+    std::string error;
+    double median{};
+    double p95{};
+    long long instructions{};
+    long peak_kb{};
+};
+
+// One program of the suite: assembled in memory, then warm-up runs and timed runs of dispatch() on fresh machines
+bench_result bench_program(const std::string &path, int runs, const run_options &options) {
+    bench_result r;
+    r.name = path.substr(path.find_last_of('/') + 1);
+    try {
+        mapped_file raw_file(path);
+        Program program = assembly_program(parse_assembly(raw_file.data, raw_file.size, 1, nullptr));
+        program.link();
+        auto shared = std::make_shared<const Program>(std::move(program));
+        reset_peak_rss();
+        std::vector<double> seconds;
+        for (int i = -BENCH_WARMUP; i < runs; i++) {
+            std::istringstream in;
+            std::ostringstream out;
+            Machine machine = Machine();
+            machine.redirect(in, out);
+            // the first warm-up run counts the instructions
+            if (i == -BENCH_WARMUP) machine.enable_evaluator();
+            if (options.engine == REGISTER_ENGINE) {
+                machine.enable_register_engine();
+            } else if (options.engine == JIT_ENGINE) {
+                machine.enable_jit();
+            }
+            machine.load(shared);
+            auto start = std::chrono::steady_clock::now();
+            machine.dispatch();
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (i == -BENCH_WARMUP) r.instructions = machine.executed_instructions();
+            if (i >= 0) seconds.push_back(elapsed);
+        }
+        r.peak_kb = peak_rss_kb();
+        std::sort(seconds.begin(), seconds.end());
+        int n = (int) seconds.size();
+        r.median = n % 2 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+        r.p95 = seconds[std::max((int) std::ceil(n * 0.95) - 1, 0)];
+    } catch (const std::exception &e) {
+        r.error = e.what();
+    }
+    return r;
+}
+
+// Every .txt program in the directory in name order, true if all of them ran
+bool bench(const std::string &dir, int runs, const run_options &options) {
+    std::vector<std::string> paths;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) panic("Cannot open " + dir);
+    while (dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".txt") == 0) paths.push_back(dir + "/" + name);
+    }
+    closedir(d);
+    std::sort(paths.begin(), paths.end());
+    static const char *engine_names[] = {"stack", "registers", "JIT"};
+    std::cout << "<<<<<* Benchmarks *>>>>>" << std::endl;
+    std::cout << "Engine: " << engine_names[options.engine] << ", " << BENCH_WARMUP << " warm-up and " << runs
+              << " timed runs each" << (options.engine == JIT_ENGINE ? ", native instructions are not counted" : "")
+              << std::endl;
+    std::cout << std::left << std::setw(20) << "Program" << std::right << std::setw(14) << "Median(s)"
+              << std::setw(14) << "P95(s)" << std::setw(16) << "Instructions" << std::setw(12) << "MIPS"
+              << std::setw(16) << "Peak RSS(KB)" << std::endl;
+    int failed = 0;
+    for (const auto &path : paths) {
+        bench_result r = bench_program(path, runs, options);
+        std::cout << std::left << std::setw(20) << r.name << std::right;
+        if (!r.error.empty()) {
+            failed++;
+            std::cout << " error: " << r.error << std::endl;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(6) << std::setw(14) << r.median << std::setw(14) << r.p95
+                  << std::setw(16) << r.instructions << std::setprecision(2) << std::setw(12)
+                  << r.instructions / r.median * 1e-6 << std::setw(16) << r.peak_kb << std::endl;
+    }
+    std::cout << paths.size() << " programs, " << failed << " failed" << std::endl;
+    return failed == 0;
+}
+
 int main(int argc, char *argv[]) {
+    // GETCH reads std::cin through its own buffer, and the machine buffers its output
+    std::ios::sync_with_stdio(false);
+    // the mappings are shared by all machines and read-only once loaded
     Machine::load_param_mapping();
+    Machine::load_name_code_mapping();
     enum run_mode {
         RUN,
         INTERACT,
         DISASSEMBLE,
-        ASSEMBLE
+        ASSEMBLE,
+        BATCH,
+        BENCH
     };
     run_mode rm = RUN;
-    char const *optstring = "r:d:a:ivo:p:eh";
+    char const *optstring = "r:d:a:b:B:n:j:s:l:W:c:g:ivo:p:eMP:S:RJh";
     std::string input_path;
     std::string output_path;
     std::string password;
-    bool verbose = false;
-    bool evaluate = false;
+    run_options options;
+    int workers = std::max((int) std::thread::hardware_concurrency(), 1);
+    int runs = BENCH_RUNS;
+    std::string limits_spec;
+    long long slice = 0;
     int o;
     while ((o = getopt(argc, argv, optstring)) != -1) {
         switch (o) {
             case 'e':
-                evaluate = true;
+                options.evaluate = true;
+                break;
+            case 'M':
+                options.memory = true;
+                break;
+            case 'l':
+                limits_spec.assign(optarg);
+                break;
+            case 'W':
+                options.snapshot_path.assign(optarg);
+                break;
+            case 'g':
+                options.debug_endpoint.assign(optarg);
+                break;
+            case 'c':
+                options.snapshot_at = std::max(atoll(optarg), 0LL);
+                break;
+            case 'P':
+                // - only prints the profile
+                options.profile = true;
+                options.profile_path = strcmp(optarg, "-") != 0 ? optarg : "";
+                break;
+            case 'S':
+                options.samples_path.assign(optarg);
+                break;
+            case 'R':
+                options.engine = REGISTER_ENGINE;
+                break;
+            case 'J':
+                options.engine = JIT_ENGINE;
                 break;
             case 'r':
                 rm = RUN;
@@ -1261,8 +7044,25 @@ int main(int argc, char *argv[]) {
                 rm = ASSEMBLE;
                 input_path.assign(optarg);
                 break;
+            case 'b':
+                rm = BATCH;
+                input_path.assign(optarg);
+                break;
+            case 'j':
+                workers = std::max(atoi(optarg), 1);
+                break;
+            case 's':
+                slice = std::max(atoll(optarg), 0LL);
+                break;
+            case 'B':
+                rm = BENCH;
+                input_path.assign(optarg);
+                break;
+            case 'n':
+                runs = std::max(atoi(optarg), 1);
+                break;
             case 'v':
-                verbose = true;
+                options.verbose = true;
                 break;
             case 'o':
                 output_path.assign(optarg);
@@ -1275,28 +7075,53 @@ int main(int argc, char *argv[]) {
                 std::cout <<
                  "\n"
                  "Usage:\n"
-                 "$ svm -r (-e) ./helloworld.slb (-v) (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator)\n"
-                 "$ svm -d ./helloworld.slb (-p password) -- Disassembly\n"
-                 "$ svm -i (-v) (-e) -- Interact Mode (-v: in verbose mode, -e: performance evaluator)\n"
-                 "$ svm -a ./helloworld.txt -o ./helloworld.slb (-p password) -- Assembly input file\n" << std::endl;
-                break;
+                 "$ svm -r (-e) (-M) (-l limits) (-P profile.json|profile.csv|-) (-S stacks.folded) (-R|-J) ./helloworld.slb (-v) (-p password) -- Run program (-v: in verbose mode, -e: performance evaluator, -M: memory report, -l: resource limits as instructions=N,calls=N,stack=N,heap=N, -P: evaluator with a per-opcode profile on the stack engine, written to the file unless it is -, -S: sample the call stacks on the stack engine, written as folded stacks, -R: register engine, -J: register engine with JIT)\n"
+                 "$ svm -r ./init.slb -W ./init.svs (-c count) (-p password) -- Run the program until its first GETCH (or for count instructions) and save the machine, svm -r ./init.svs goes on from there\n"
+                 "$ svm -r ./helloworld.slb -g port|socket (-p password) -- Debug the program from a client connected to the TCP port on 127.0.0.1 or to the Unix socket, one command per line: break/clear ADDR, watch/unwatch global|local N, continue, step, pause, where, stack, locals, globals, operands, quit\n"
+                 "$ svm -d ./helloworld.slb (-v) (-p password) -- Disassembly (-v: as linked, with superinstructions)\n"
+                 "$ svm -i (-v) (-e) (-M) (-R|-J) -- Interact Mode (-v: in verbose mode, -e: performance evaluator, -M: memory report, -R: register engine, -J: register engine with JIT)\n"
+                 "$ svm -a ./helloworld.txt -o ./helloworld.slb (-v) (-j workers) (-p password) -- Assembly input file, with labels and named constants (-v: list the instructions, -j: parse big files in parallel)\n"
+                 "$ svm -b ./jobs.txt (-j workers) (-s slice) (-l limits) (-p password) -- Run a batch of programs in parallel, with the resource limits of every instance (-s: each worker runs its instances in turns of slice instructions on the stack engine)\n"
+                 "$ svm -B ./bench (-n runs) (-R|-J) -- Benchmark every assembly program of the directory\n" << std::endl;
+                return 0;
         }
     }
-    switch (rm) {
-        case RUN:
-            run(input_path, verbose, evaluate, password);
-            break;
-        case INTERACT:
-            Machine::load_name_code_mapping();
-            interact(verbose, evaluate);
-            break;
-        case ASSEMBLE:
-            Machine::load_name_code_mapping();
-            assemble(input_path, output_path, password);
-            break;
-        case DISASSEMBLE:
-            Machine::load_name_code_mapping();
-            disassemble(input_path, password);
-            break;
+    if (rm != INTERACT && input_path.empty()) {
+        std::cout << "No input file, see svm -h" << std::endl;
+        return 0;
+    }
+    try {
+        options.limits = parse_limits(limits_spec);
+        switch (rm) {
+            case RUN:
+                run(input_path, options, password);
+                break;
+            case INTERACT:
+                interact(options);
+                break;
+            case ASSEMBLE:
+                assemble(input_path, output_path, password, workers, options.verbose);
+                break;
+            case DISASSEMBLE:
+                if (options.verbose) {
+                    disassemble_linked(input_path, password);
+                } else {
+                    disassemble(input_path, password);
+                }
+                break;
+            case BATCH:
+                return batch(input_path, workers, password, options.limits, slice) ? 0 : 1;
+            case BENCH:
+                return bench(input_path, runs, options) ? 0 : 1;
+        }
+    } catch (const limit_exceeded &e) {
+        // a clean termination, nothing is wrong with the machine
+        std::cout << "Limit exceeded: " << e.what() << std::endl;
+        return 3;
+    } catch (const vm_error &e) {
+        std::cout << "Runtime error: " << e.what() << std::endl;
+        std::cout << "Enter verbose mode to see details." << std::endl;
+        std::cout << "ABORTING..." << std::endl;
+        abort();
     }
 }
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Differential tests: every program runs on the stack engine, the register engine and the JIT, and each run must
+# print the expected output next to it.
+# $ tests/run.sh ./svm
+svm=${1:-./svm}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+for src in "$dir"/*.txt; do
+    name=$(basename "$src" .txt)
+    "$svm" -a "$src" -o "$tmp/$name.slb" > /dev/null || { echo "FAIL $name: cannot assemble"; failed=1; continue; }
+    for engine in "" -R -J; do
+        "$svm" -r "$tmp/$name.slb" $engine < /dev/null > "$tmp/$name.out" 2>&1
+        if ! cmp -s "$tmp/$name.out" "$dir/$name.out"; then
+            echo "FAIL $name ${engine:-stack}"
+            failed=1
+        fi
+    done
+done
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed